@@ -48,6 +48,8 @@ typedef struct {
 ben_obj_t *bencode_decode(const uint8_t *data, size_t size);
 void bencode_free(ben_obj_t *obj);
 ben_obj_t *bencode_dict_get(const ben_obj_t *dict, const char *key);
+// Поиск по бинарному ключу (ключ может содержать нулевые байты, например pieces root в BEP 52)
+ben_obj_t *bencode_dict_get_bin(const ben_obj_t *dict, const uint8_t *key, size_t key_len);
 const uint8_t *bencode_string_data(const ben_obj_t *obj, size_t *len);
 int64_t bencode_int_value(const ben_obj_t *obj);
 
@@ -0,0 +1,89 @@
+#ifndef BITFIELD_H
+#define BITFIELD_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "utils.h"
+
+/*
+ * Битовое поле кусков. Хранится словами по 64 бита в порядке протокола:
+ * кусок 0 - старший бит первого слова. Поэтому перевод в/из сообщения bitfield -
+ * это перестановка байтов слова, а поиск следующего куска - clz по слову.
+ * Хвост последнего слова (биты за nbits) всегда нулевой.
+ */
+typedef struct {
+    uint64_t *words;
+    size_t nwords;
+    uint32_t nbits;
+} bitfield_t;
+
+// Состояние куска
+typedef enum {
+    PIECE_NONE = 0,     // не запрошен
+    PIECE_REQUESTED,    // запрошен у пира
+    PIECE_RECEIVED,     // все блоки получены, не проверен
+    PIECE_VERIFIED,     // хеш совпал
+    PIECE_WRITTEN       // записан в хранилище/архив
+} piece_state_t;
+
+// Уровни приоритета кусков - значения file_priority_t: 0 - не качать, 3 - в первую очередь
+#define PIECE_PRIO_LEVELS 4
+#define PIECE_PRIO_DEFAULT 2
+
+// Карта состояний кусков с битовыми полями для быстрого выбора
+typedef struct {
+    uint8_t *state;     // piece_state_t на каждый кусок
+    bitfield_t claimed; // кусок не в PIECE_NONE (запрошен или уже есть) - не выбирать повторно
+    bitfield_t have;    // кусок проверен (PIECE_VERIFIED/PIECE_WRITTEN)
+    bitfield_t level[PIECE_PRIO_LEVELS];     // куски по уровню приоритета; level[0] - ненужные (всегда claimed)
+    uint32_t level_count[PIECE_PRIO_LEVELS];
+    uint32_t count;
+} piece_map_t;
+
+#define BITFIELD_WORD_BIT(i) (UINT64_C(1) << (63 - ((i) % 64)))
+
+static inline int bitfield_get(const bitfield_t *bf, uint32_t i) {
+    return i < bf->nbits && (bf->words[i / 64] & BITFIELD_WORD_BIT(i)) != 0;
+}
+
+static inline void bitfield_set(bitfield_t *bf, uint32_t i) {
+    if (i < bf->nbits) bf->words[i / 64] |= BITFIELD_WORD_BIT(i);
+}
+
+static inline void bitfield_clear(bitfield_t *bf, uint32_t i) {
+    if (i < bf->nbits) bf->words[i / 64] &= ~BITFIELD_WORD_BIT(i);
+}
+
+void bitfield_init(bitfield_t *bf, uint32_t nbits);
+void bitfield_free(bitfield_t *bf);
+void bitfield_set_all(bitfield_t *bf);
+void bitfield_clear_all(bitfield_t *bf);
+
+// Загрузка из сообщения bitfield (len байт, старший бит - первый кусок); лишние биты отбрасываются
+void bitfield_from_bytes(bitfield_t *bf, const uint8_t *bytes, size_t len);
+// Выгрузка в формат сообщения bitfield ((nbits + 7) / 8 байт)
+void bitfield_to_bytes(const bitfield_t *bf, uint8_t *out);
+
+// Количество установленных битов (popcount по словам)
+uint32_t bitfield_count(const bitfield_t *bf);
+// Первый установленный бит с номером >= from, -1 если нет
+int64_t bitfield_next_set(const bitfield_t *bf, uint32_t from);
+// Первый кусок >= from, который есть у пира и нет у нас: peer & ~mine; -1 если нет
+int64_t bitfield_next_interesting(const bitfield_t *mine, const bitfield_t *peer, uint32_t from);
+// То же, но только среди кусков из mask: peer & mask & ~mine
+int64_t bitfield_next_interesting_in(const bitfield_t *mine, const bitfield_t *peer,
+                                     const bitfield_t *mask, uint32_t from);
+// Есть ли у пира хоть один нужный нам кусок
+int bitfield_any_interesting(const bitfield_t *mine, const bitfield_t *peer);
+
+void piece_map_init(piece_map_t *pm, uint32_t count);
+void piece_map_free(piece_map_t *pm);
+void piece_map_set(piece_map_t *pm, uint32_t index, piece_state_t state);
+// Назначить уровень приоритета (до начала скачивания); уровень 0 исключает кусок из выбора
+void piece_map_set_priority(piece_map_t *pm, uint32_t index, int prio);
+// Количество кусков, которые ещё нужно скачать
+uint32_t piece_map_left(const piece_map_t *pm);
+
+#endif
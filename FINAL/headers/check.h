@@ -0,0 +1,51 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include "torrent.h"
+#include "storage.h"
+#include "bitfield.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define CHECK_BATCH_PIECES 16       // сколько кусков поток забирает за раз (соседние куски читаются подряд)
+#define CHECK_MAX_THREADS 256
+
+// Отображённый в память файл торрента
+typedef struct {
+    const uint8_t *map;   // NULL - файла нет, он пустой или это padding
+    uint64_t offset;      // смещение файла в общем потоке данных
+    uint64_t length;      // ожидаемый размер файла
+    uint64_t mapped;      // сколько байт реально есть на диске (файл может быть короче)
+    int is_pad;           // padding-файл: данные - нули
+} check_file_t;
+
+// Общее состояние проверки
+typedef struct {
+    const torrent_t *tor;
+    check_file_t *files;
+    size_t file_count;
+    atomic_uint next_piece;   // следующий кусок для раздачи потокам
+    uint8_t *result;          // результат по кускам (1 байт на кусок, без гонок между потоками)
+} check_ctx_t;
+
+/**
+ * Проверяет уже скачанные данные (директория -O или файл -o) по хешам торрента.
+ * Файлы отображаются в память, куски распределяются между потоками.
+ * @param cfg       Конфигурация (пути и количество потоков)
+ * @param tor       Торрент
+ * @param bitfield  [out] битовое поле проверенных кусков (освобождает вызывающий), может быть NULL
+ * @return Количество повреждённых или отсутствующих кусков, -1 при ошибке
+ */
+int check_torrent(const config_t *cfg, const torrent_t *tor, uint8_t **bitfield);
+
+#endif
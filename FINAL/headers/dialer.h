@@ -0,0 +1,65 @@
+#ifndef DIALER_H
+#define DIALER_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include "network.h"
+#include "swarm.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "utils.h"
+
+/*
+ * Планировщик подключений. Сроки ведёт в общем колесе таймеров цикла событий. Держит до DIALER_HALF_OPEN неблокирующих connect
+ * одновременно (у каждого свой срок в колесе таймеров) и пул уже установленных
+ * соединений, пока загрузка идёт от текущего пира: смена пира не ждёт connect.
+ * Адрес, к которому не удалось подключиться, пробуется снова после паузы,
+ * удваивающейся с каждой неудачей.
+ */
+
+#define DIALER_HALF_OPEN 8           // connect в полёте + готовые соединения в пуле
+#define DIALER_READY_TTL 20000       // сколько держать установленное соединение без handshake, мс
+#define DIALER_BACKOFF_MS 2000       // пауза после первой неудачи, дальше удваивается
+#define DIALER_MAX_FAILURES 4        // после стольких неудач подряд адрес отбрасывается
+#define DIALER_POLL_MS 200           // предел одного ожидания в dialer_take (проверка флага остановки)
+
+typedef struct dialer dialer_t;
+
+// Слот: connect в полёте или готовое соединение
+typedef struct {
+    dialer_t *owner;
+    int sock;                        // -1 - слот свободен
+    int cand;
+    int ready;                       // соединение установлено, ждёт dialer_take
+    tw_timer_t timer;                // срок connect или время жизни в пуле
+} dial_t;
+
+// Пауза перед повтором для кандидата
+typedef struct {
+    dialer_t *owner;
+    int cand;
+    tw_timer_t timer;
+} dial_retry_t;
+
+struct dialer {
+    swarm_t *sw;
+    timer_wheel_t *wheel;            // колесо цикла событий загрузки
+    dial_t slots[DIALER_HALF_OPEN];
+    int inflight;                    // connect в полёте
+    int ready;                       // готовых соединений
+    dial_retry_t **retry;            // по одному на кандидата (создаётся при первой неудаче)
+    size_t retry_cap;
+    size_t retry_pending;            // кандидатов в паузе
+    int timeout_ms;                  // срок одного connect
+};
+
+dialer_t *dialer_create(swarm_t *sw, timer_wheel_t *wheel, int timeout_ms);
+// Продвинуть подключения: запустить новые, обработать завершённые и таймеры (ждёт не дольше wait_ms)
+void dialer_poll(dialer_t *d, int wait_ms);
+// Взять установленное соединение, при необходимости дождавшись его; -1 - кандидаты закончились
+int dialer_take(dialer_t *d, int *cand);
+void dialer_free(dialer_t *d);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include "utils.h"
+
+#define MERKLE_BLOCK_SIZE 16384   // размер листа дерева BitTorrent v2 (16 KiB)
+#define MERKLE_HASH_LEN 32        // длина SHA-256
+
+// Наименьшая степень двойки, не меньшая count (ширина слоя дерева)
+size_t merkle_width(size_t count);
+
+// SHA-256 одного блока данных (лист дерева). Последний блок файла может быть короче 16 KiB
+void merkle_hash_block(const uint8_t *data, size_t len, uint8_t out[MERKLE_HASH_LEN]);
+
+// Корень поддерева из width нулевых листьев (хеш выравнивания)
+void merkle_pad_hash(size_t width, uint8_t out[MERKLE_HASH_LEN]);
+
+// Корень дерева из count листьев, дополненных до width нулевыми хешами
+void merkle_root(const uint8_t *leaves, size_t count, size_t width, uint8_t out[MERKLE_HASH_LEN]);
+
+// Корень дерева, построенного по блокам данных (листья считаются по 16 KiB)
+void merkle_root_of_data(const uint8_t *data, size_t len, size_t width, uint8_t out[MERKLE_HASH_LEN]);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "torrent.h"
+#include "utils.h"
+
+/*
+ * Метрики клиента в текстовом формате Prometheus.
+ * Счётчики обновляются атомарно (relaxed) прямо на горячем пути, отдаёт их отдельный
+ * поток: GET по HTTP на 127.0.0.1:<port> или по unix-сокету (curl --unix-socket).
+ */
+
+#define METRICS_MAX_PEERS 256        // слотов под пиров (адреса сверх лимита не учитываются)
+#define METRICS_MAX_FDS 1024         // сокеты с номерами выше не привязываются к пирам
+#define METRICS_HIST_BUCKETS 12
+#define METRICS_POLL_MS 200          // период проверки флага остановки потока
+
+// Гистограмма задержек; границы корзин - metrics_hist_bounds_us
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS + 1]; // последняя - +Inf
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+} metrics_hist_t;
+
+// Счётчики одного пира (слот живёт до конца работы, адрес не меняется)
+typedef struct {
+    char addr[64];                          // "ip:port" или "[ip6]:port"
+    _Atomic uint64_t bytes_in;              // байт получено (вся сеть, включая протокол)
+    _Atomic uint64_t bytes_out;             // байт отправлено
+    atomic_int connected;
+    atomic_int choked;                      // пир нас душит
+    atomic_int requests;                    // запросов в полёте (глубина очереди)
+    _Atomic uint64_t rate;                  // EWMA скорости, байт/с
+    _Atomic uint64_t rtt_us;                // EWMA RTT блока, мкс
+} metrics_peer_t;
+
+typedef struct {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t pieces_verified;
+    _Atomic uint64_t pieces_failed;
+    _Atomic uint64_t blocks_rejected;
+    atomic_int pieces_left;
+    atomic_int disk_queue;                  // записей на диск/в архив в процессе
+    atomic_int connects_inflight;           // неблокирующих connect в полёте
+    _Atomic uint64_t connects_failed;       // неудачных connect (включая таймауты)
+    _Atomic uint64_t requests_timed_out;    // request без ответа дольше PEER_REQUEST_TIMEOUT
+    _Atomic uint64_t keepalives_sent;
+    _Atomic uint64_t announces;             // обращений к трекеру (первое и повторные)
+    metrics_hist_t hash_download;           // проверка хеша скачанного куска
+    metrics_hist_t hash_check;              // проверка в пуле потоков --check
+    metrics_hist_t disk_write;              // запись куска
+    metrics_peer_t peers[METRICS_MAX_PEERS];
+    atomic_int peer_count;
+} metrics_t;
+
+extern metrics_t metrics;
+
+// Запустить поток с endpoint: "unix:/path", "/path" (unix-сокет), "[host:]port" (HTTP)
+int metrics_start(const char *endpoint, const torrent_t *tor);
+void metrics_stop(void);
+
+// Слот пира по адресу (создаётся при первом обращении), -1 - нет свободных слотов
+int metrics_peer_slot(const char *addr);
+// Привязать сокет к слоту: трафик сокета будет учитываться на пира
+void metrics_peer_attach(int slot, int sock);
+void metrics_peer_detach(int slot, int sock);
+// Учёт трафика сокета (вызывается из network.c)
+void metrics_sock_io(int sock, size_t in, size_t out);
+
+void metrics_observe_us(metrics_hist_t *h, uint64_t us);
+
+static inline metrics_peer_t *metrics_peer(int slot) {
+    return slot >= 0 && slot < METRICS_MAX_PEERS ? &metrics.peers[slot] : NULL;
+}
+
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t v) {
+    atomic_fetch_add_explicit(counter, v, memory_order_relaxed);
+}
+
+#endif
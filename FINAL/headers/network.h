@@ -13,19 +13,47 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include "timer_wheel.h"
 #include "utils.h"
 
 #define CONNECTIOIN_TIMEOUT 10000
 #define UNCHOKE_TIMEOUT 30000
 #define RECEIVE_TIMEOUT 30000
-// Подключение к пиру по IP и порту с таймаутом (в миллисекундах)
-// Возвращает сокет или -1 при ошибке
-int tcp_connect_timeout(uint32_t ip, uint16_t port, int timeout_ms);
+
+#define PEER_COMPACT_V4 6           // компактная запись peers: IPv4 + порт
+#define PEER_COMPACT_V6 18          // компактная запись peers6: IPv6 + порт
+#define PEER_ADDR_STRLEN (INET6_ADDRSTRLEN + 8) // "[addr]:port"
+
+// Адрес пира: IPv4 или IPv6, порт внутри sockaddr в сетевом порядке
+typedef struct {
+    struct sockaddr_storage sa;
+    socklen_t len;
+} peer_t;
+
+// Адрес из компактной записи трекера (family - AF_INET для peers, AF_INET6 для peers6)
+int peer_addr_from_compact(peer_t *p, const uint8_t *data, int family);
+// Адрес из текстового IP (словарная форма списка пиров), port - в порядке хоста
+int peer_addr_from_string(peer_t *p, const char *ip, uint16_t port);
+int peer_addr_equal(const peer_t *a, const peer_t *b);
+// "ip:port" или "[ip6]:port"
+char *peer_addr_str(const peer_t *p, char *buf, size_t len);
+
+// Неблокирующий connect: начать (*done = 1 - установлено сразу) и завершить после события poll
+// (0 - установлено, сокет переведён в блокирующий режим; иначе код ошибки)
+int tcp_connect_start(const peer_t *peer, int *done);
+int tcp_connect_finish(int sock);
+
+// Цикл событий загрузки: колесо таймеров обслуживается во время ожиданий приёма
+// (ожидание ограничено ближайшим таймером). Во время отправки таймеры не выполняются,
+// поэтому обработчик может сам отправлять сообщения, не разрывая чужое сообщение.
+void net_set_timers(timer_wheel_t *tw);
+// Прервать текущее ожидание приёма на сокете (вызывается из обработчика таймера)
+void net_interrupt(int sock);
 
 // Отправка ровно len байт с таймаутом (возвращает 0 при успехе, -1 при ошибке)
 int send_full_timeout(int sock, const void *buf, size_t len, int timeout_ms);
 
-// Получение ровно len байт с таймаутом (возвращает 0 при успехе, -1 при ошибке)
+// Получение ровно len байт с таймаутом (возвращает 0 при успехе, -1 при ошибке или прерывании)
 int recv_full_timeout(int sock, void *buf, size_t len, int timeout_ms);
 
 // Получение сообщения переменной длины: сначала читается 4-байтный length prefix,
@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 #include "torrent.h"
 #include "network.h"
+#include "bitfield.h"
+#include "metrics.h"
 #include "utils.h"
 
 #define BLOCK_SIZE 16384  // 16 KiB
@@ -17,28 +19,77 @@
 #define HANDSHAKE_SIZE 68
 #define HANDSHAKE_TIMEOUT 10000
 #define PEER_SEND_TIMEOUT 5000
+#define PEER_KEEPALIVE_INTERVAL 120000 // keep-alive, если мы ничего не отправляли 2 минуты
+#define PEER_REQUEST_TIMEOUT 30000     // срок ответа на один request
 #define PEER_ID_LEN 20
+
+// BitTorrent v2 (BEP 52)
+#define RESERVED_V2_BYTE 7        // байт зарезервированного поля с флагом v2
+#define RESERVED_V2_BIT 0x10      // флаг поддержки v2
+#define MSG_HASH_REQUEST 21       // hash request: запрос хешей merkle-дерева
+#define MSG_HASHES 22             // hashes: ответ с хешами
+#define MSG_HASH_REJECT 23        // hash reject: отказ
+#define HASH_REQUEST_MAX 512      // максимальное количество хешей в одном запросе
+
+// Fast extension (BEP 6)
+#define RESERVED_FAST_BYTE 7      // байт зарезервированного поля с флагом fast extension
+#define RESERVED_FAST_BIT 0x04    // флаг поддержки fast extension
+#define MSG_SUGGEST_PIECE 13      // suggest piece: пир советует кусок (есть в кеше)
+#define MSG_HAVE_ALL 14           // have all: у пира все куски
+#define MSG_HAVE_NONE 15          // have none: у пира нет кусков
+#define MSG_REJECT_REQUEST 16     // reject request: пир отказал в запросе блока
+#define MSG_ALLOWED_FAST 17       // allowed fast: кусок можно качать, даже будучи choked
+#define PEER_BLOCK_REJECTED -2    // результат peer_receive_block: пир явно отклонил запрос
+
+// Оценка производительности пира
+#define PEER_EWMA_ALPHA 0.3       // вес нового замера в скользящем среднем
                           
-typedef struct {
-    uint32_t ip;   // в сетевом порядке (big-endian)
-    uint16_t port; // в сетевом порядке
-} peer_t;
 
+// Статистика соединения (экспоненциальные скользящие средние)
+typedef struct {
+    double rate_ewma;       // скорость, байт/с
+    double rtt_ewma_ms;     // время от request до получения блока, мс
+    uint64_t bytes_in;      // получено полезных байт
+    uint32_t blocks;        // получено блоков
+    uint32_t errors;        // таймауты, отказы, обрывы
+    uint32_t hash_fails;    // куски, не прошедшие проверку хеша
+} peer_stats_t;
 
 typedef struct {
     int sock;
-    uint8_t *bitfield;
-    size_t bitfield_len;
+    bitfield_t have;            // куски пира (пока пир не прислал bitfield - считаем, что есть все)
     int choked;
     int interested;
+    uint32_t num_pieces;        // количество кусков торрента
+    int fast;                   // обе стороны поддерживают fast extension (BEP 6)
+    int v2;                     // пир поддерживает v2 (BEP 52): можно запрашивать хеши листьев
+    uint32_t *allowed_fast;     // куски, которые можно качать в состоянии choked (ещё не опробованные)
+    size_t allowed_fast_count;
+    uint32_t *suggested;        // куски, предложенные пиром (ещё не опробованные)
+    size_t suggested_count;
+    peer_stats_t stats;         // производительность соединения
+    int metrics_slot;           // слот в метриках (-1 - пир не учитывается)
+    timer_wheel_t *timers;      // колесо цикла событий (NULL - таймеры соединения не взведены)
+    tw_timer_t keepalive;       // keep-alive при простое исходящего направления
+    tw_timer_t request_timer;   // срок ответа на текущий request
+    int request_expired;        // срок истёк, ожидание блока прервано
 }peer_connection_t ;
 
 // Проверить, есть ли у пира кусок с данным индексом
-int peer_has_piece(peer_connection_t *peer, uint32_t index);
+static inline int peer_has_piece(const peer_connection_t *peer, uint32_t index) {
+    return bitfield_get(&peer->have, index);
+}
 
-// Выполнить handshake с пиром
+// Выполнить handshake с пиром (заполняет peer->fast и peer->v2 по зарезервированным битам пира
+// и создаёт битовое поле кусков пира)
 // Возвращает 0 при успехе, -1 при ошибке
-int peer_handshake(int sock, const torrent_t *tor, const uint8_t *my_peer_id, uint8_t *peer_id_out);
+int peer_handshake(peer_connection_t *peer, const torrent_t *tor, const uint8_t *my_peer_id, uint8_t *peer_id_out);
+
+// Отправить have none (BEP 6): у нас нет кусков
+int peer_send_have_none(int sock);
+
+// Обработать служебное сообщение пира (choke, unchoke, have, bitfield, сообщения BEP 6)
+void peer_process_message(peer_connection_t *peer, uint8_t msg_id, const uint8_t *payload, size_t payload_len);
 
 // Отправить сообщение interested
 int peer_send_interested(int sock);
@@ -46,6 +97,15 @@ int peer_send_interested(int sock);
 // Отправить сообщение request
 int peer_send_request(int sock, uint32_t index, uint32_t begin, uint32_t length);
 
+// Отправить keep-alive (сообщение нулевой длины)
+int peer_send_keepalive(int sock);
+
+// Взвести таймеры соединения в колесе цикла событий (keep-alive); снимаются в peer_close
+void peer_timers_start(peer_connection_t *peer, timer_wheel_t *tw);
+
+// Отправить request и взвести срок ответа на него (ожидание в peer_receive_block прерывается по сроку)
+int peer_request_block(peer_connection_t *peer, uint32_t index, uint32_t begin, uint32_t length);
+
 // Прочитать и обработать сообщение от пира (низкоуровневая функция)
 // Возвращает -1 при ошибке, 0 при успехе, *msg_id заполняется (0..255)
 int peer_read_message(int sock, uint8_t *msg_id, uint8_t **payload, size_t *payload_len, int timeout_ms);
@@ -53,13 +113,20 @@ int peer_read_message(int sock, uint8_t *msg_id, uint8_t **payload, size_t *payl
 // Получить кусок (после отправки request ожидает piece сообщение)
 int peer_receive_piece(int sock, uint32_t expected_index, uint8_t *buffer, size_t length, int timeout_ms);
 
-// Ждем unchoke
+// Ждем unchoke. Возвращает 0 - unchoked, 1 - choked, но есть allowed fast куски, -1 - ошибка
 int peer_wait_for_unchoke(peer_connection_t *peer, int timeout_ms);
 
+// Учесть полученный блок в статистике (длина и время от запроса до ответа)
+void peer_stats_block(peer_connection_t *peer, size_t len, double elapsed_ms);
+
 // Освобождение ресурсов пира
 void peer_close(peer_connection_t *peer);
 
-//Получение блока
-int peer_receive_block(int sock, uint32_t expected_index, uint32_t expected_begin,
+//Получение блока (0 - успех, -1 - ошибка, PEER_BLOCK_REJECTED - пир отклонил запрос)
+int peer_receive_block(peer_connection_t *peer, uint32_t expected_index, uint32_t expected_begin,
                        uint8_t *buffer, size_t length, int timeout_ms);
+
+// Запросить у пира хеши листьев (блоков по 16 KiB) куска v2 и проверить их по слою кусков
+// Возвращает количество хешей (*leaves выделяется динамически) или -1 при ошибке
+int peer_request_leaf_hashes(peer_connection_t *peer, const torrent_t *tor, uint32_t index, uint8_t **leaves, int timeout_ms);
 #endif
@@ -8,6 +8,9 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
 #define PATH_LEN 4096
 
 // Внутренняя структура для представления одного файла в хранилище
@@ -27,6 +30,9 @@ typedef struct storage {
     const char *extract_dir; // корневая директория для извлечения (может быть NULL)
 } storage_t;
 
+// Путь к файлу торрента на диске (с учётом -o/-O), освобождает вызывающий
+char *storage_file_path(const config_t *cfg, const file_t *tf);
+
 storage_t *storage_open(const config_t *cfg, const torrent_t *tor);
 void storage_write(storage_t *st, uint32_t piece_index, const uint8_t *data, uint32_t len);
 void storage_close(storage_t *st);
@@ -0,0 +1,67 @@
+#ifndef SWARM_H
+#define SWARM_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "peer.h"
+#include "utils.h"
+
+#define SWARM_EVICT_PERCENTILE 25    // пир медленнее 25-го перцентиля рой считается слабым
+#define SWARM_EVAL_MIN_BLOCKS 32     // сколько блоков получить от пира, прежде чем оценивать
+#define SWARM_EVAL_MIN_SAMPLES 3     // сколько оценок других пиров нужно для сравнения
+#define SWARM_MAX_ATTEMPTS 3         // сколько раз пир может вернуться в очередь после вытеснения
+#define SWARM_BAN_HASH_FAILS 1       // после стольких битых кусков пир банится
+#define SWARM_ROUND_MS 10000         // период пересмотра текущего пира (как раунд rechoke)
+
+// Кандидат на подключение
+typedef struct {
+    peer_t addr;
+    int banned;         // прислал битые данные - больше не подключаемся
+    int attempts;       // сколько раз к нему уже подключались
+    int failures;       // неудачных connect подряд (для экспоненциальной паузы)
+    double last_rate;   // скорость при последнем подключении, байт/с
+} candidate_t;
+
+// Пул кандидатов и история скоростей пиров
+typedef struct {
+    candidate_t *cands;
+    size_t count;
+    size_t *queue;          // очередь индексов кандидатов (кольцевой буфер)
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_cap;
+    size_t standby;         // кандидатов с готовым соединением в пуле планировщика подключений
+    double *rates;          // скорости завершённых соединений (для перцентиля)
+    size_t rate_count;
+    size_t rate_cap;
+} swarm_t;
+
+// Создать пул из списка пиров трекера
+swarm_t *swarm_create(const peer_t *peers, int peer_count);
+
+// Добавить новых пиров (повторный announce); уже известные адреса пропускаются.
+// Возвращает количество добавленных
+int swarm_add(swarm_t *sw, const peer_t *peers, int peer_count);
+
+// Следующий кандидат для подключения; -1, если очередь пуста
+int swarm_next(swarm_t *sw);
+
+// Вернуть кандидата в конец очереди без учёта попытки (повтор после паузы)
+void swarm_retry(swarm_t *sw, int cand);
+
+// Учесть итог соединения: сохранить скорость, забанить или вернуть в очередь
+// evicted - пир вытеснен за низкую скорость (возвращается в конец очереди)
+void swarm_release(swarm_t *sw, int cand, const peer_stats_t *stats, int evicted);
+
+// Проверить, пора ли вытеснить текущего пира (1 - медленнее перцентиля роя)
+int swarm_should_evict(const swarm_t *sw, const peer_stats_t *stats);
+
+// Проверить, нужно ли забанить пира по статистике
+int swarm_should_ban(const peer_stats_t *stats);
+
+void swarm_free(swarm_t *sw);
+
+#endif
@@ -7,10 +7,19 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "torrent.h"
 #include "utils.h"
 
 #define TAR_BLOCK_SIZE 512
+#define TAR_IOV_MAX 1024                 // iovec в одном writev (IOV_MAX в Linux)
+#define TAR_PIPE_SIZE (1024 * 1024)      // желаемый размер буфера канала stdout
+#define TAR_PATH_MAX 4096
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL // максимум для 11 восьмеричных цифр поля size (8 GiB - 1)
+#define TAR_PENDING_MAX (64u * 1024 * 1024) // предел кусков, ждущих предыдущих в памяти, байт
 
 /* Формат заголовка ustar (512 байт) */
 typedef struct {
@@ -33,13 +42,31 @@ typedef struct {
     char padding[12];
 } tar_header_t;
 
+/* Файл архива: заголовок формируется один раз при открытии */
+typedef struct {
+    uint64_t offset;               // смещение файла в общем потоке данных торрента
+    uint64_t length;
+    int skip;                      // pad-файл (BEP 47) или не выбранный в --files - в архив не попадает
+    uint8_t *header;               // ustar-заголовок, при необходимости с предшествующей PAX-записью
+    size_t header_len;             // кратно TAR_BLOCK_SIZE
+} tar_entry_t;
+
 /* Внутренняя структура для отслеживания текущего файла */
 typedef struct {
     const torrent_t *tor;          // ссылка на торрент (не владеем)
-    FILE *out;                     // выходной поток
-    int current_file_index;        // индекс текущего файла в tor->files
-    uint64_t file_bytes_written; // сколько байт текущего файла уже записано
-    uint64_t total_written;   // общее количество байт, записанных в архив (для расчёта паддинга)
+    int fd;                        // дескриптор выходного потока
+    tar_entry_t *entries;          // по одному на файл торрента
+    size_t current_file_index;     // первый ещё не дописанный файл
+    int header_written;            // заголовок текущего файла уже выведен
+    uint64_t total_written;        // общее количество байт, записанных в архив
+    uint32_t next_piece;           // следующий кусок по порядку потока
+    uint8_t *piece_prio;           // приоритеты кусков: куски с FILE_PRIO_SKIP не ожидаются
+    uint8_t **pending;             // куски, пришедшие раньше очереди (копии), ждут предыдущих
+    uint32_t *pending_len;
+    size_t pending_count;
+    struct iovec iov[TAR_IOV_MAX]; // собираемая пачка: заголовки, данные, выравнивание
+    int iov_count;
+    int failed;                    // ошибка записи - дальше ничего не пишем
 } tar_writer_t;
 
 /**
@@ -53,6 +80,8 @@ tar_writer_t *tar_writer_open(FILE *out, const torrent_t *tor);
 /**
  * Записывает очередной кусок данных в tar-архив.
  * Функция автоматически распределяет данные по файлам в соответствии с их смещениями.
+ * Заголовки, данные и выравнивание уходят одним writev. Кусок, пришедший раньше
+ * предыдущих, копируется и выводится, когда до него дойдёт очередь.
  * @param tw    Контекст tar-писателя
  * @param piece_index   Номер куска
  * @param data          Указатель на данные куска
@@ -60,6 +89,16 @@ tar_writer_t *tar_writer_open(FILE *out, const torrent_t *tor);
  */
 void tar_writer_write(tar_writer_t *tw, uint32_t piece_index, const uint8_t *data, uint32_t len);
 
+/**
+ * Граница окна загрузки: архив пишется по порядку, поэтому брать можно только куски
+ * от следующего по очереди до возвращённого номера (не включая) - тогда ждущие
+ * в памяти куски не превышают TAR_PENDING_MAX.
+ * @param tw    Контекст
+ * @param first[out] Следующий кусок по порядку потока
+ * @return      Номер первого куска за окном (не больше числа кусков)
+ */
+uint32_t tar_writer_window(const tar_writer_t *tw, uint32_t *first);
+
 /**
  * Завершает запись tar-архива: дописывает выравнивание для последнего файла
  * и два нулевых блока в конец.
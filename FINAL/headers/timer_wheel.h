@@ -0,0 +1,52 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stddef.h>
+#include "utils.h"
+
+/*
+ * Иерархическое колесо таймеров: TW_LEVELS колец по TW_SLOTS слотов. Уровень 0 - тики
+ * по TW_TICK_MS, каждый следующий в TW_SLOTS раз грубее (0.64 с, 41 с, 44 мин, 46 ч на оборот).
+ * Таймер кладётся на уровень по расстоянию до срока; когда младшее кольцо делает оборот,
+ * слот старшего кольца раскладывается ниже (каскад). Вставка и отмена - O(1): таймер
+ * встроен в объект-владелец и связан в двусвязный список слота.
+ */
+
+#define TW_TICK_MS 10                    // разрешение таймеров, мс
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)          // слотов в кольце
+#define TW_LEVELS 4                      // дальше 46 ч таймер ждёт на последнем уровне и раскладывается заново
+
+typedef void (*tw_callback_t)(void *arg);
+
+typedef struct tw_timer {
+    struct tw_timer *next, *prev;        // список слота (NULL - таймер не взведён)
+    uint64_t expires;                    // тик срабатывания
+    tw_callback_t cb;
+    void *arg;
+} tw_timer_t;
+
+typedef struct {
+    tw_timer_t slots[TW_LEVELS][TW_SLOTS]; // заголовки кольцевых списков
+    uint64_t tick;                       // последний обработанный тик
+    double start_ms;                     // время тика 0
+    size_t count;                        // взведённых таймеров
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t *tw, double now_ms);
+void tw_timer_init(tw_timer_t *t, tw_callback_t cb, void *arg);
+// Взвести таймер через delay_ms от now_ms (уже взведённый переносится)
+void tw_schedule(timer_wheel_t *tw, tw_timer_t *t, double now_ms, double delay_ms);
+void tw_cancel(timer_wheel_t *tw, tw_timer_t *t);
+// Выполнить обработчики наступивших таймеров; возвращает их количество
+int tw_advance(timer_wheel_t *tw, double now_ms);
+// Сколько мс можно ждать до ближайшего таймера (не больше max_ms, -1 - бесконечно)
+int tw_next_timeout(const timer_wheel_t *tw, double now_ms, int max_ms);
+
+static inline int tw_armed(const tw_timer_t *t) {
+    return t->next != NULL;
+}
+
+#endif
@@ -4,17 +4,37 @@
 #define _POSIX_C_SOURCE 200809L
 #include "bencode.h"
 #include "utils.h"
+#include "merkle.h"
 #include <string.h>
 #include <openssl/sha.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 
+// Приоритет файла (--files): куски выбираются от высокого уровня к низкому
+typedef enum {
+    FILE_PRIO_SKIP = 0,  // не скачивать
+    FILE_PRIO_LOW,
+    FILE_PRIO_NORMAL,    // по умолчанию
+    FILE_PRIO_HIGH
+} file_priority_t;
+
+#define FILE_PRIO_LEVELS 4
+#define TORRENT_PATH_LEN 4096 // путь файла внутри торрента (для сопоставления с шаблонами)
+
 // Структура для одного файла внутри торрента
 typedef struct {
     char **path;         // список компонентов пути (например, {"dir", "subdir", "file.txt", NULL})
     size_t path_len;     // количество компонентов
     uint64_t length;     // размер файла в байтах
+    int is_pad;          // padding-файл (attr "p"): только выравнивание, на диск не пишется
+    int priority;        // file_priority_t
+
+    // BitTorrent v2 (BEP 52)
+    int has_root;                          // есть pieces root (непустой файл v2)
+    uint8_t pieces_root[MERKLE_HASH_LEN];  // корень merkle-дерева файла
+    uint8_t *piece_layer;                  // слой кусков: SHA-256 поддеревьев (32 * layer_count байт)
+    size_t layer_count;                    // количество хешей в слое (0 - файл не больше куска)
 } file_t;
 
 // Основная структура торрента
@@ -30,11 +50,16 @@ typedef struct {
     char *name;                   // имя торрента (для single-file это имя файла, для multi-file — имя корневой директории)
     uint32_t piece_length;        // размер куска в байтах
     uint32_t num_pieces;          // количество кусков
-    uint8_t *pieces;              // массив SHA1-хешей кусков (20 * num_pieces байт)
+    uint8_t *pieces;              // массив SHA1-хешей кусков (20 * num_pieces байт), NULL для чистого v2
+
+    // BitTorrent v2 (BEP 52)
+    int meta_version;             // 1 - v1, 2 - v2 или гибридный торрент
+    uint8_t info_hash_v2[32];     // SHA-256 от закодированного info-словаря
 
     // Файлы
     file_t *files;                // массив файлов
     size_t file_count;            // количество файлов
+    uint64_t *file_offset;        // начало каждого файла в потоке (file_count + 1), для поиска файла куска
 
     // Общий размер всех файлов (сумма length)
     uint64_t total_length;
@@ -52,7 +77,29 @@ void torrent_free(torrent_t *tor);
 // Получить размер i-го куска в байтах (последний кусок может быть меньше)
 uint32_t piece_size(const torrent_t *tor, uint32_t index);
 
-// Проверить, совпадает ли хеш куска с ожидаемым
+// Проверить, совпадает ли хеш куска с ожидаемым (SHA1 v1 и/или merkle-корень v2)
 int verify_piece(const torrent_t *tor, uint32_t index, const uint8_t *data);
 
+// Есть ли у торрента merkle-хеши v2 для проверки отдельных блоков
+int torrent_has_v2(const torrent_t *tor);
+
+// Найти файл (не padding), в котором начинается кусок; *piece_in_file - номер куска внутри файла
+const file_t *piece_file(const torrent_t *tor, uint32_t index, uint32_t *piece_in_file);
+
+// Применить выбор файлов --files: "0,2-4,*.mkv:high,extras/*:skip" (номера с 0, glob по пути).
+// Не перечисленные файлы пропускаются. Возвращает количество выбранных файлов или -1
+int torrent_select_files(torrent_t *tor, const char *spec);
+
+// Приоритет каждого куска: максимум по пересекающимся с ним файлам (out - num_pieces байт)
+void torrent_piece_priorities(const torrent_t *tor, uint8_t *out);
+
+// Проверить кусок по merkle-дереву v2 (1 - совпало или v2 неприменим, 0 - ошибка)
+int verify_piece_v2(const torrent_t *tor, uint32_t index, const uint8_t *data, uint32_t len);
+
+// Проверить хеши листьев куска (полученные от пира) по слою кусков (1/0)
+int verify_piece_leaves(const torrent_t *tor, uint32_t index, const uint8_t *leaves, size_t count);
+
+// Проверить один блок куска по проверенному хешу листа (1/0)
+int verify_block_v2(const uint8_t *leaf, const uint8_t *data, uint32_t len);
+
 #endif
@@ -23,9 +23,22 @@ typedef struct memory {
     size_t size;
 } memory_t;
 
-// Получить список пиров от трекера
+#define TRACKER_DEFAULT_INTERVAL 1800 // интервал повторного обращения, если трекер его не прислал, с
+#define TRACKER_MIN_INTERVAL 30        // чаще не обращаемся, даже если трекер просит, с
+#define TRACKER_TIMEOUT 30             // таймаут первого обращения, с
+#define TRACKER_REANNOUNCE_TIMEOUT 5   // таймаут повторного: запрос идёт посреди загрузки и блокирует её, с
+
+// Параметры обращения к трекеру
+typedef struct {
+    const char *event;    // "started" для первого обращения, NULL - повторное
+    uint64_t downloaded;  // байт скачано и проверено
+    uint64_t left;        // байт осталось скачать
+    long timeout;         // таймаут запроса, с
+} announce_t;
+
+// Получить список пиров от трекера; *interval (если не NULL) - через сколько секунд обратиться снова.
 // Возвращает количество пиров (или -1 при ошибке)
-int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, peer_t **peers_out);
+int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, const announce_t *ann, peer_t **peers_out, int *interval);
 
 // Генерация случайного peer_id (20 байт в виде строки)
 void generate_peer_id(uint8_t *peer_id);
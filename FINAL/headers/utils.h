@@ -12,25 +12,62 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <bits/getopt_core.h>
 
-#define LOG_ERROR(...)   log_error(__FILE__, __LINE__, __VA_ARGS__)
-#define LOG_WARN(...)    log_warn(__FILE__, __LINE__, __VA_ARGS__)
-#define LOG_INFO(...)    log_info(__VA_ARGS__)
-#ifdef DEBUG
-#define LOG_DEBUG(...)   log_debug(__FILE__, __LINE__, __VA_ARGS__)
-#else
-#define LOG_DEBUG(...)   ((void)0)
+/*
+ * Уровни логирования. LOG_COMPILE_LEVEL - порог времени компиляции: вызовы выше него
+ * не попадают в бинарник (make LOG_LEVEL=2 убирает LOG_DEBUG). log_level - порог
+ * времени выполнения (-v, -q, --log-level), проверяется до форматирования строки.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
 #endif
 
-#define TORRENT_BUFFER_CAPACITY 4096
+#define LOG_RING_SIZE 1024     // слотов в кольцевом буфере (степень двойки)
+#define LOG_LINE_MAX 512       // максимальная длина строки лога, длиннее - обрезается
 
-// макросы для работы с битовыми полями (обмен данными с торрент-трекером)
-#define IS_DONE(pieces, idx) ((pieces)[(idx)/8] & (1 << (7 - ((idx)%8))))
-#define MARK_DONE(pieces, idx) ((pieces)[(idx)/8]  |= (1<< (7 - ((idx)%8))))
+extern int log_level;
 
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)
+#define LOG_AT(level, file, line, ...) \
+    do { if (log_enabled(level)) log_write((level), (file), (line), __VA_ARGS__); } while (0)
 
-#define DEBUG //расширенный вывод логов stderr
+// вызов выше порога компиляции: код не генерируется, но аргументы и формат проверяются
+#define LOG_DISABLED(...) do { if (0) log_write(LOG_LEVEL_DEBUG, NULL, 0, __VA_ARGS__); } while (0)
+
+#define LOG_ERROR(...)   LOG_AT(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...)    LOG_AT(LOG_LEVEL_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOG_WARN(...)    LOG_DISABLED(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...)    LOG_AT(LOG_LEVEL_INFO, NULL, 0, __VA_ARGS__)
+#else
+#define LOG_INFO(...)    LOG_DISABLED(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)   LOG_AT(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)   LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#define TORRENT_BUFFER_CAPACITY 4096
+
+// Выделение места под файлы (--alloc)
+typedef enum {
+    ALLOC_SPARSE = 0,      // ftruncate до итогового размера, блоки - по мере записи (по умолчанию)
+    ALLOC_FULL,            // posix_fallocate: все блоки резервируются заранее
+    ALLOC_NONE             // файл растёт по мере записи
+} alloc_mode_t;
 
 typedef struct {
     char *input_file;      // путь к .torrent файлу
@@ -41,6 +78,11 @@ typedef struct {
     int use_stdin;         // читать из stdin
     int use_stdout;        // писать в stdout
     int use_tar;           // Использовать tar - 1, не использовать - 0
+    int check_only;        // --check: только проверить уже скачанные данные
+    int threads;           // -j: количество потоков проверки (0 - по числу ядер)
+    char *metrics_addr;    // --metrics: адрес endpoint метрик (NULL - не запускать)
+    char *files_spec;      // --files: выбор и приоритеты файлов (NULL - все файлы)
+    alloc_mode_t alloc_mode; // --alloc: выделение места под файлы
 } config_t;
 
 void *xmalloc(size_t size);
@@ -52,49 +94,28 @@ void xfree(void *ptr);
 extern volatile int running;
 void setup_signals(void);
 
+// Монотонное время в миллисекундах (для замеров скорости и таймеров)
+double monotonic_ms(void);
+
 // Чтение всего файла в память
 size_t read_file(const char *path, void **data);
 // Чтение из конвеера
 size_t read_stdin(uint8_t **out);
 
 /*
- * Логирование в stderr
- * */
-static inline void log_error(const char *file, int line, const char *fmt, ...) {
-    fprintf(stderr, "[ERROR] %s:%d ", file, line);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
-
-static inline void log_warn(const char *file, int line, const char *fmt, ...) {
-    fprintf(stderr, "[WARNING] %s:%d ", file, line);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
-
-static inline void log_info(const char *fmt, ...) {
-    fprintf(stderr, "[INFO] ");
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
-
-static inline void log_debug(const char *file, int line, const char *fmt, ...) {
-    fprintf(stderr, "[DEBUG] %s:%d ", file, line);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
+ * Логирование в stderr. Строка форматируется в вызывающем потоке и кладётся в
+ * lock-free кольцевой буфер, в stderr её пишет фоновый поток. При переполнении
+ * строка отбрасывается (счётчик потерь печатается позже) - вызывающий не блокируется.
+ * До log_start и после log_stop запись синхронная.
+ */
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+// Запустить фоновый поток записи (остановка - log_stop, также вызывается при exit)
+int log_start(void);
+// Дописать всё из буфера и остановить поток
+void log_stop(void);
+// Разобрать имя уровня (error/warn/info/debug или число), -1 - неизвестный уровень
+int log_level_parse(const char *name);
 
 void parse_args(int argc, char **argv, config_t *cfg);
 void free_config(config_t *cfg);
@@ -332,6 +332,23 @@ ben_obj_t *bencode_dict_get(const ben_obj_t *dict, const char *key) {
     return NULL;
 }
 
+/**
+ * Находит значение по бинарному ключу заданной длины
+ * @param *dict указатель на объект, содержащий словарь
+ * @param *key указатель на ключ
+ * @param key_len длина ключа
+ * @return benobj_t или NULL
+ */
+ben_obj_t *bencode_dict_get_bin(const ben_obj_t *dict, const uint8_t *key, size_t key_len) {
+    if (!dict || dict->type != BEN_DICT) return NULL;
+    for (size_t i = 0; i < dict->value.dict.count; i++) {
+        const ben_pair_t *pair = &dict->value.dict.pairs[i];
+        if (pair->key_len == key_len && memcmp(pair->key, key, key_len) == 0)
+            return pair->value;
+    }
+    return NULL;
+}
+
 /**
  * Возвращает строку из объекта ben_obj_t
  * 
@@ -0,0 +1,234 @@
+#include "bitfield.h"
+
+/**
+ * Маска значащих битов последнего слова
+ *
+ * @param *bf битовое поле
+ * @return маска (все единицы, если nbits кратно 64)
+ */
+static uint64_t tail_mask(const bitfield_t *bf) {
+    uint32_t rem = bf->nbits % 64;
+    return rem ? ~UINT64_C(0) << (64 - rem) : ~UINT64_C(0);
+}
+
+/**
+ * Создаёт пустое битовое поле
+ *
+ * @param *bf битовое поле
+ * @param nbits количество битов (кусков)
+ */
+void bitfield_init(bitfield_t *bf, uint32_t nbits) {
+    bf->nbits = nbits;
+    bf->nwords = (nbits + 63) / 64;
+    bf->words = xcalloc(bf->nwords ? bf->nwords : 1, sizeof(uint64_t));
+}
+
+void bitfield_free(bitfield_t *bf) {
+    free(bf->words);
+    memset(bf, 0, sizeof(*bf));
+}
+
+void bitfield_set_all(bitfield_t *bf) {
+    if (!bf->nwords) return;
+    memset(bf->words, 0xff, bf->nwords * sizeof(uint64_t));
+    bf->words[bf->nwords - 1] &= tail_mask(bf);
+}
+
+void bitfield_clear_all(bitfield_t *bf) {
+    memset(bf->words, 0, bf->nwords * sizeof(uint64_t));
+}
+
+/**
+ * Загружает битовое поле из сообщения протокола
+ *
+ * @param *bf битовое поле (размер задан заранее)
+ * @param *bytes данные сообщения bitfield
+ * @param len длина данных
+ */
+void bitfield_from_bytes(bitfield_t *bf, const uint8_t *bytes, size_t len) {
+    for (size_t w = 0; w < bf->nwords; w++) {
+        uint64_t v = 0;
+        for (size_t b = 0; b < 8; b++) {
+            size_t pos = w * 8 + b;
+            v = (v << 8) | (pos < len ? bytes[pos] : 0);
+        }
+        bf->words[w] = v;
+    }
+    if (bf->nwords) bf->words[bf->nwords - 1] &= tail_mask(bf);
+}
+
+/**
+ * Выгружает битовое поле в формат сообщения протокола
+ *
+ * @param *bf битовое поле
+ * @param *out буфер на (nbits + 7) / 8 байт
+ */
+void bitfield_to_bytes(const bitfield_t *bf, uint8_t *out) {
+    size_t len = (bf->nbits + 7) / 8;
+    for (size_t pos = 0; pos < len; pos++) {
+        out[pos] = (uint8_t)(bf->words[pos / 8] >> (56 - 8 * (pos % 8)));
+    }
+}
+
+/**
+ * Количество установленных битов
+ *
+ * @param *bf битовое поле
+ * @return количество
+ */
+uint32_t bitfield_count(const bitfield_t *bf) {
+    uint32_t n = 0;
+    for (size_t w = 0; w < bf->nwords; w++) {
+        n += (uint32_t)__builtin_popcountll(bf->words[w]);
+    }
+    return n;
+}
+
+/**
+ * Первый установленный бит с номером >= from
+ *
+ * @param *bf битовое поле
+ * @param from начальная позиция
+ * @return номер бита или -1
+ */
+int64_t bitfield_next_set(const bitfield_t *bf, uint32_t from) {
+    if (from >= bf->nbits) return -1;
+    size_t w = from / 64;
+    uint64_t v = bf->words[w] & (~UINT64_C(0) >> (from % 64)); // отбрасываем биты до from
+    while (!v) {
+        if (++w >= bf->nwords) return -1;
+        v = bf->words[w];
+    }
+    return (int64_t)(w * 64 + (size_t)__builtin_clzll(v));
+}
+
+/**
+ * Первый кусок >= from, который есть у пира и отсутствует в mine (peer & ~mine).
+ * Работает по 64 куска за шаг.
+ *
+ * @param *mine наши куски (включая уже запрошенные)
+ * @param *peer куски пира
+ * @param from начальная позиция
+ * @return номер куска или -1
+ */
+int64_t bitfield_next_interesting(const bitfield_t *mine, const bitfield_t *peer, uint32_t from) {
+    if (mine->nbits != peer->nbits || from >= mine->nbits) return -1;
+    size_t w = from / 64;
+    uint64_t v = peer->words[w] & ~mine->words[w] & (~UINT64_C(0) >> (from % 64));
+    while (!v) {
+        if (++w >= mine->nwords) return -1;
+        v = peer->words[w] & ~mine->words[w];
+    }
+    return (int64_t)(w * 64 + (size_t)__builtin_clzll(v));
+}
+
+/**
+ * Первый кусок >= from из mask, который есть у пира и отсутствует в mine (peer & mask & ~mine)
+ *
+ * @param *mine наши куски (включая уже запрошенные)
+ * @param *peer куски пира
+ * @param *mask допустимые куски (например, один уровень приоритета)
+ * @param from начальная позиция
+ * @return номер куска или -1
+ */
+int64_t bitfield_next_interesting_in(const bitfield_t *mine, const bitfield_t *peer,
+                                     const bitfield_t *mask, uint32_t from) {
+    if (mine->nbits != peer->nbits || mine->nbits != mask->nbits || from >= mine->nbits) return -1;
+    size_t w = from / 64;
+    uint64_t v = peer->words[w] & mask->words[w] & ~mine->words[w] & (~UINT64_C(0) >> (from % 64));
+    while (!v) {
+        if (++w >= mine->nwords) return -1;
+        v = peer->words[w] & mask->words[w] & ~mine->words[w];
+    }
+    return (int64_t)(w * 64 + (size_t)__builtin_clzll(v));
+}
+
+/**
+ * Есть ли у пира хоть один кусок, которого нет у нас
+ *
+ * @param *mine наши куски
+ * @param *peer куски пира
+ * @return 1/0
+ */
+int bitfield_any_interesting(const bitfield_t *mine, const bitfield_t *peer) {
+    if (mine->nbits != peer->nbits) return 0;
+    uint64_t acc = 0;
+    for (size_t w = 0; w < mine->nwords; w++) {
+        acc |= peer->words[w] & ~mine->words[w];
+    }
+    return acc != 0;
+}
+
+/**
+ * Создаёт карту состояний: все куски в PIECE_NONE с приоритетом PIECE_PRIO_DEFAULT
+ *
+ * @param *pm карта
+ * @param count количество кусков
+ */
+void piece_map_init(piece_map_t *pm, uint32_t count) {
+    pm->count = count;
+    pm->state = xcalloc(count ? count : 1, 1);
+    bitfield_init(&pm->claimed, count);
+    bitfield_init(&pm->have, count);
+    for (int l = 0; l < PIECE_PRIO_LEVELS; l++) {
+        bitfield_init(&pm->level[l], count);
+        pm->level_count[l] = 0;
+    }
+    bitfield_set_all(&pm->level[PIECE_PRIO_DEFAULT]);
+    pm->level_count[PIECE_PRIO_DEFAULT] = count;
+}
+
+void piece_map_free(piece_map_t *pm) {
+    free(pm->state);
+    bitfield_free(&pm->claimed);
+    bitfield_free(&pm->have);
+    for (int l = 0; l < PIECE_PRIO_LEVELS; l++) bitfield_free(&pm->level[l]);
+}
+
+/**
+ * Меняет состояние куска и поддерживает битовые поля claimed/have
+ *
+ * @param *pm карта
+ * @param index номер куска
+ * @param state новое состояние
+ */
+void piece_map_set(piece_map_t *pm, uint32_t index, piece_state_t state) {
+    if (index >= pm->count) return;
+    pm->state[index] = (uint8_t)state;
+    if (state == PIECE_NONE) bitfield_clear(&pm->claimed, index);
+    else bitfield_set(&pm->claimed, index);
+    if (state >= PIECE_VERIFIED) bitfield_set(&pm->have, index);
+    else bitfield_clear(&pm->have, index);
+}
+
+/**
+ * Переносит кусок на другой уровень приоритета. Ненужный кусок (уровень 0)
+ * помечается claimed, чтобы выбор кусков его не видел
+ *
+ * @param *pm карта
+ * @param index номер куска
+ * @param prio уровень 0..PIECE_PRIO_LEVELS-1
+ */
+void piece_map_set_priority(piece_map_t *pm, uint32_t index, int prio) {
+    if (index >= pm->count || prio < 0 || prio >= PIECE_PRIO_LEVELS) return;
+    for (int l = 0; l < PIECE_PRIO_LEVELS; l++) {
+        if (bitfield_get(&pm->level[l], index)) {
+            bitfield_clear(&pm->level[l], index);
+            pm->level_count[l]--;
+        }
+    }
+    bitfield_set(&pm->level[prio], index);
+    pm->level_count[prio]++;
+    if (prio == 0) bitfield_set(&pm->claimed, index);
+    else if (pm->state[index] == PIECE_NONE) bitfield_clear(&pm->claimed, index);
+}
+
+/**
+ * Сколько нужных кусков ещё не получено
+ *
+ * @param *pm карта
+ * @return количество
+ */
+uint32_t piece_map_left(const piece_map_t *pm) {
+    return pm->count - pm->level_count[0] - bitfield_count(&pm->have);
+}
@@ -0,0 +1,236 @@
+#include "check.h"
+
+/**
+ * Отображает файлы торрента в память (только чтение)
+ *
+ * @param *ctx контекст проверки
+ * @param *cfg конфигурация (пути)
+ */
+static void map_files(check_ctx_t *ctx, const config_t *cfg) {
+    const torrent_t *tor = ctx->tor;
+    uint64_t offset = 0;
+    ctx->file_count = tor->file_count;
+    ctx->files = xcalloc(tor->file_count, sizeof(check_file_t));
+    for (size_t i = 0; i < tor->file_count; i++) {
+        check_file_t *cf = &ctx->files[i];
+        const file_t *tf = &tor->files[i];
+        cf->offset = offset;
+        cf->length = tf->length;
+        cf->is_pad = tf->is_pad;
+        offset += tf->length;
+        if (tf->is_pad || tf->length == 0) continue;
+
+        char *path = storage_file_path(cfg, tf);
+        int fd = open(path, O_RDONLY);
+        struct stat sb;
+        if (fd < 0 || fstat(fd, &sb) < 0) {
+            LOG_WARN("Missing file %s", path);
+            if (fd >= 0) close(fd);
+            free(path);
+            continue;
+        }
+        cf->mapped = (uint64_t)sb.st_size < tf->length ? (uint64_t)sb.st_size : tf->length;
+        if (cf->mapped < tf->length) {
+            LOG_WARN("File %s is truncated (%llu of %llu bytes)", path,
+                     (unsigned long long)cf->mapped, (unsigned long long)tf->length);
+        }
+        if (cf->mapped > 0) {
+            void *map = mmap(NULL, cf->mapped, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                LOG_WARN("mmap failed for %s: %s", path, strerror(errno));
+                cf->mapped = 0;
+            } else {
+                // читаем файл последовательно: ядро увеличивает окно readahead и раньше освобождает страницы
+                posix_madvise(map, cf->mapped, POSIX_MADV_SEQUENTIAL);
+                cf->map = map;
+            }
+        }
+        close(fd); // отображение остаётся валидным после закрытия дескриптора
+        free(path);
+    }
+}
+
+/**
+ * Снимает отображения файлов
+ *
+ * @param *ctx контекст проверки
+ */
+static void unmap_files(check_ctx_t *ctx) {
+    for (size_t i = 0; i < ctx->file_count; i++) {
+        if (ctx->files[i].map) munmap((void*)ctx->files[i].map, ctx->files[i].mapped);
+    }
+    free(ctx->files);
+}
+
+/**
+ * Индекс первого файла, заканчивающегося после pos (двоичный поиск по смещениям)
+ *
+ * @param *ctx контекст проверки
+ * @param pos смещение в общем потоке данных
+ * @return индекс файла
+ */
+static size_t find_file(const check_ctx_t *ctx, uint64_t pos) {
+    size_t lo = 0, hi = ctx->file_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ctx->files[mid].offset + ctx->files[mid].length <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Просит ядро заранее подгрузить диапазон [start, end) общего потока (readahead)
+ *
+ * @param *ctx контекст проверки
+ * @param start начало диапазона
+ * @param end конец диапазона
+ */
+static void prefetch_range(const check_ctx_t *ctx, uint64_t start, uint64_t end) {
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = find_file(ctx, start); i < ctx->file_count && ctx->files[i].offset < end; i++) {
+        const check_file_t *cf = &ctx->files[i];
+        if (!cf->map) continue;
+        uint64_t from = start > cf->offset ? start - cf->offset : 0;
+        uint64_t to = end - cf->offset < cf->mapped ? end - cf->offset : cf->mapped;
+        if (from >= to) continue;
+        from -= from % page;
+        posix_madvise((void*)(cf->map + from), to - from, POSIX_MADV_WILLNEED);
+    }
+}
+
+/**
+ * Возвращает указатель на данные куска. Если кусок целиком лежит в одном файле,
+ * данные берутся прямо из отображения, иначе собираются в buf.
+ *
+ * @param *ctx контекст проверки
+ * @param index номер куска
+ * @param len длина куска
+ * @param *buf буфер потока (piece_length байт)
+ * @return указатель на данные или NULL, если данных на диске нет
+ */
+static const uint8_t *piece_data(const check_ctx_t *ctx, uint32_t index, uint32_t len, uint8_t *buf) {
+    uint64_t start = (uint64_t)index * ctx->tor->piece_length;
+    uint64_t end = start + len;
+    size_t i = find_file(ctx, start);
+    if (i >= ctx->file_count) return NULL;
+
+    const check_file_t *cf = &ctx->files[i];
+    if (cf->map && end <= cf->offset + cf->mapped) {
+        return cf->map + (start - cf->offset); // без копирования
+    }
+
+    for (uint64_t pos = start; pos < end; i++) {
+        if (i >= ctx->file_count) return NULL;
+        cf = &ctx->files[i];
+        uint64_t file_end = cf->offset + cf->length;
+        if (file_end <= pos) continue;
+        uint64_t chunk_end = end < file_end ? end : file_end;
+        size_t n = chunk_end - pos;
+        if (cf->is_pad) {
+            memset(buf + (pos - start), 0, n);
+        } else if (cf->map && chunk_end - cf->offset <= cf->mapped) {
+            memcpy(buf + (pos - start), cf->map + (pos - cf->offset), n);
+        } else {
+            return NULL; // файл отсутствует или обрезан
+        }
+        pos = chunk_end;
+    }
+    return buf;
+}
+
+/**
+ * Рабочий поток: забирает пачки соседних кусков и проверяет их хеши
+ *
+ * @param *arg контекст проверки
+ * @return NULL
+ */
+static void *check_worker(void *arg) {
+    check_ctx_t *ctx = arg;
+    const torrent_t *tor = ctx->tor;
+    uint8_t *buf = xmalloc(tor->piece_length);
+
+    while (running) {
+        uint32_t first = atomic_fetch_add(&ctx->next_piece, CHECK_BATCH_PIECES);
+        if (first >= tor->num_pieces) break;
+        uint32_t last = first + CHECK_BATCH_PIECES;
+        if (last > tor->num_pieces) last = tor->num_pieces;
+
+        prefetch_range(ctx, (uint64_t)first * tor->piece_length,
+                       (uint64_t)(last - 1) * tor->piece_length + piece_size(tor, last - 1));
+        for (uint32_t i = first; i < last; i++) {
+            const uint8_t *data = piece_data(ctx, i, piece_size(tor, i), buf);
+            if (!data) continue;
+            double t0 = monotonic_ms();
+            ctx->result[i] = verify_piece(tor, i, data);
+            metrics_observe_us(&metrics.hash_check, (uint64_t)((monotonic_ms() - t0) * 1000.0));
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Проверка скачанных данных по хешам торрента в несколько потоков
+ *
+ * @param *cfg конфигурация (пути, количество потоков)
+ * @param *tor торрент
+ * @param **bitfield[out] битовое поле целых кусков (может быть NULL)
+ * @return количество повреждённых/отсутствующих кусков, -1 при ошибке
+ */
+int check_torrent(const config_t *cfg, const torrent_t *tor, uint8_t **bitfield) {
+    if (tor->num_pieces == 0) return -1;
+    if (cfg->output_file && tor->file_count > 1) {
+        LOG_ERROR("Multi-file torrent cannot be checked against a single file. Use -O <directory>");
+        return -1;
+    }
+
+    check_ctx_t ctx = { .tor = tor };
+    atomic_init(&ctx.next_piece, 0);
+    ctx.result = xcalloc(tor->num_pieces, 1);
+    map_files(&ctx, cfg);
+
+    int threads = cfg->threads > 0 ? cfg->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > CHECK_MAX_THREADS) threads = CHECK_MAX_THREADS;
+    LOG_INFO("Checking %u pieces with %d threads", tor->num_pieces, threads);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pthread_t tids[CHECK_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, check_worker, &ctx) != 0) {
+            LOG_WARN("pthread_create failed, continuing with %d threads", started);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) check_worker(&ctx); // проверяем в текущем потоке
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    unmap_files(&ctx);
+
+    // упаковываем результат в битовое поле
+    bitfield_t valid;
+    bitfield_init(&valid, tor->num_pieces);
+    for (uint32_t i = 0; i < tor->num_pieces; i++) {
+        if (ctx.result[i]) bitfield_set(&valid, i);
+    }
+    free(ctx.result);
+    uint32_t good = bitfield_count(&valid);
+    uint8_t *bits = xmalloc((tor->num_pieces + 7) / 8);
+    bitfield_to_bytes(&valid, bits);
+    bitfield_free(&valid);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mib = tor->total_length / (1024.0 * 1024.0);
+    LOG_INFO("Check finished: %u/%u pieces valid (%.1f%%), %.1f MiB in %.2f s (%.1f MiB/s)",
+             good, tor->num_pieces, 100.0 * good / tor->num_pieces, mib, secs, secs > 0 ? mib / secs : 0.0);
+
+    if (bitfield) *bitfield = bits;
+    else free(bits);
+    return running ? (int)(tor->num_pieces - good) : -1;
+}
@@ -0,0 +1,231 @@
+#include "dialer.h"
+
+static void retry_expired(void *arg);
+
+/**
+ * Таймер паузы кандидата; создаётся при первой неудаче (пул растёт при повторных announce)
+ *
+ * @param *d планировщик
+ * @param cand индекс кандидата
+ * @return таймер
+ */
+static dial_retry_t *retry_timer(dialer_t *d, int cand) {
+    if ((size_t)cand >= d->retry_cap) {
+        size_t cap = d->sw->count > (size_t)cand ? d->sw->count : (size_t)cand + 1;
+        d->retry = xrealloc(d->retry, cap * sizeof(dial_retry_t*));
+        memset(d->retry + d->retry_cap, 0, (cap - d->retry_cap) * sizeof(dial_retry_t*));
+        d->retry_cap = cap;
+    }
+    if (!d->retry[cand]) {
+        dial_retry_t *r = xcalloc(1, sizeof(dial_retry_t));
+        r->owner = d;
+        r->cand = cand;
+        tw_timer_init(&r->timer, retry_expired, r);
+        d->retry[cand] = r;
+    }
+    return d->retry[cand];
+}
+
+/**
+ * Учитывает неудачный connect: кандидат уходит в паузу (экспоненциальную) или отбрасывается
+ *
+ * @param *d планировщик
+ * @param cand индекс кандидата
+ * @param err код ошибки
+ */
+static void connect_failed(dialer_t *d, int cand, int err) {
+    candidate_t *c = &d->sw->cands[cand];
+    char addr[PEER_ADDR_STRLEN];
+    peer_addr_str(&c->addr, addr, sizeof(addr));
+    metrics_add(&metrics.connects_failed, 1);
+    c->failures++;
+    if (c->failures >= DIALER_MAX_FAILURES) {
+        LOG_DEBUG("Connect to %s failed: %s, giving up after %d attempts", addr, strerror(err), c->failures);
+        return;
+    }
+    double delay = (double)DIALER_BACKOFF_MS * (1 << (c->failures - 1));
+    LOG_DEBUG("Connect to %s failed: %s, retry in %.0f s", addr, strerror(err), delay / 1000);
+    tw_schedule(d->wheel, &retry_timer(d, cand)->timer, monotonic_ms(), delay);
+    d->retry_pending++;
+}
+
+/**
+ * Пауза кандидата закончилась - он возвращается в очередь
+ */
+static void retry_expired(void *arg) {
+    dial_retry_t *r = arg;
+    r->owner->retry_pending--;
+    swarm_retry(r->owner->sw, r->cand);
+}
+
+/**
+ * Таймер слота: для connect в полёте - таймаут, для готового соединения - оно
+ * слишком долго ждало в пуле (пир закроет соединение без handshake), кандидат
+ * возвращается в очередь и будет подключён заново
+ */
+static void slot_expired(void *arg) {
+    dial_t *s = arg;
+    dialer_t *d = s->owner;
+    close(s->sock);
+    s->sock = -1;
+    if (s->ready) {
+        d->ready--;
+        swarm_retry(d->sw, s->cand);
+    } else {
+        d->inflight--;
+        connect_failed(d, s->cand, ETIMEDOUT);
+    }
+}
+
+/**
+ * Переводит слот в пул готовых соединений
+ */
+static void slot_ready(dialer_t *d, dial_t *s) {
+    s->ready = 1;
+    d->ready++;
+    d->sw->cands[s->cand].failures = 0;
+    tw_schedule(d->wheel, &s->timer, monotonic_ms(), DIALER_READY_TTL);
+}
+
+/**
+ * Запускает connect к следующим кандидатам, пока есть свободные слоты
+ *
+ * @param *d планировщик
+ */
+static void start_connects(dialer_t *d) {
+    while (running && d->inflight + d->ready < DIALER_HALF_OPEN) {
+        int cand = swarm_next(d->sw);
+        if (cand < 0) break;
+        int done = 0;
+        int sock = tcp_connect_start(&d->sw->cands[cand].addr, &done);
+        if (sock < 0) {
+            connect_failed(d, cand, errno);
+            continue;
+        }
+        dial_t *s = d->slots;
+        while (s->sock >= 0) s++; // свободный слот есть: inflight + ready < DIALER_HALF_OPEN
+        s->sock = sock;
+        s->cand = cand;
+        s->ready = 0;
+        if (done && tcp_connect_finish(sock) == 0) {
+            slot_ready(d, s);
+            continue;
+        }
+        d->inflight++;
+        tw_schedule(d->wheel, &s->timer, monotonic_ms(), d->timeout_ms);
+    }
+    d->sw->standby = (size_t)d->ready;
+    atomic_store(&metrics.connects_inflight, d->inflight);
+}
+
+/**
+ * Создаёт планировщик подключений над пулом кандидатов
+ *
+ * @param *sw пул кандидатов (планировщик берёт кандидатов через swarm_next)
+ * @param *wheel колесо таймеров цикла событий
+ * @param timeout_ms срок одного connect
+ * @return планировщик
+ */
+dialer_t *dialer_create(swarm_t *sw, timer_wheel_t *wheel, int timeout_ms) {
+    dialer_t *d = xcalloc(1, sizeof(dialer_t));
+    d->sw = sw;
+    d->wheel = wheel;
+    d->timeout_ms = timeout_ms;
+    for (int i = 0; i < DIALER_HALF_OPEN; i++) {
+        d->slots[i].owner = d;
+        d->slots[i].sock = -1;
+        tw_timer_init(&d->slots[i].timer, slot_expired, &d->slots[i]);
+    }
+    return d;
+}
+
+/**
+ * Продвигает подключения: запускает новые connect, ждёт событий на сокетах
+ * не дольше wait_ms (и не дольше ближайшего таймера), обрабатывает итоги и таймеры
+ *
+ * @param *d планировщик
+ * @param wait_ms сколько можно ждать (0 - только проверить, -1 - до ближайшего события)
+ */
+void dialer_poll(dialer_t *d, int wait_ms) {
+    start_connects(d);
+    struct pollfd pfd[DIALER_HALF_OPEN];
+    dial_t *who[DIALER_HALF_OPEN];
+    int n = 0;
+    for (int i = 0; i < DIALER_HALF_OPEN; i++) {
+        if (d->slots[i].sock >= 0 && !d->slots[i].ready) {
+            pfd[n] = (struct pollfd){ .fd = d->slots[i].sock, .events = POLLOUT };
+            who[n++] = &d->slots[i];
+        }
+    }
+    int timeout = tw_next_timeout(d->wheel, monotonic_ms(), wait_ms);
+    if (n > 0 || timeout != 0) {
+        int ret = poll(pfd, n, timeout);
+        for (int k = 0; ret > 0 && k < n; k++) {
+            if (!pfd[k].revents) continue;
+            dial_t *s = who[k];
+            tw_cancel(d->wheel, &s->timer);
+            d->inflight--;
+            int err = tcp_connect_finish(s->sock);
+            if (err == 0) {
+                slot_ready(d, s);
+            } else {
+                close(s->sock);
+                s->sock = -1;
+                connect_failed(d, s->cand, err);
+            }
+        }
+    }
+    tw_advance(d->wheel, monotonic_ms());
+    start_connects(d); // освободившиеся слоты - следующим кандидатам
+}
+
+/**
+ * Возвращает установленное соединение из пула (самое свежее), при пустом пуле
+ * ждёт, пока какой-нибудь connect завершится
+ *
+ * @param *d планировщик
+ * @param *cand[out] индекс кандидата
+ * @return дескриптор сокета (блокирующий режим) или -1, если подключаться больше не к кому
+ */
+int dialer_take(dialer_t *d, int *cand) {
+    while (running) {
+        dial_t *best = NULL;
+        for (int i = 0; i < DIALER_HALF_OPEN; i++) {
+            dial_t *s = &d->slots[i];
+            if (s->sock >= 0 && s->ready && (!best || s->timer.expires > best->timer.expires)) best = s;
+        }
+        if (best) {
+            int sock = best->sock;
+            *cand = best->cand;
+            tw_cancel(d->wheel, &best->timer);
+            best->sock = -1;
+            d->ready--;
+            start_connects(d);
+            return sock;
+        }
+        if (!d->inflight && !d->retry_pending && d->sw->queue_len == 0) break;
+        dialer_poll(d, DIALER_POLL_MS);
+    }
+    return -1;
+}
+
+/**
+ * Закрывает незавершённые и неиспользованные соединения
+ *
+ * @param *d планировщик
+ */
+void dialer_free(dialer_t *d) {
+    if (!d) return;
+    for (int i = 0; i < DIALER_HALF_OPEN; i++) {
+        tw_cancel(d->wheel, &d->slots[i].timer);
+        if (d->slots[i].sock >= 0) close(d->slots[i].sock);
+    }
+    for (size_t i = 0; i < d->retry_cap; i++) {
+        if (!d->retry[i]) continue;
+        tw_cancel(d->wheel, &d->retry[i]->timer);
+        free(d->retry[i]);
+    }
+    atomic_store(&metrics.connects_inflight, 0);
+    free(d->retry);
+    free(d);
+}
@@ -10,12 +10,40 @@
 #include "tracker.h"
 #include "storage.h"
 #include "network.h"
+#include "dialer.h"
 #include "tar.h"
+#include "check.h"
+#include "swarm.h"
 
 static int load_torrent(torrent_t *tor, config_t *cfg);
 static void log_info_about_torrent(torrent_t *tor);
 static int setup_output_context(config_t *cfg, const torrent_t *tor); 
-static int download_pieces(const torrent_t *tor, const peer_t *peers, int peer_count, const uint8_t my_peer_id[20],const config_t *cfg);
+static int download_pieces(const torrent_t *tor, const peer_t *peers, int peer_count, int announce_interval,
+                           const uint8_t my_peer_id[20],const config_t *cfg);
+static int run_check(const config_t *cfg, const torrent_t *tor);
+static int64_t pick_piece(peer_connection_t *peer, const piece_map_t *pieces, uint32_t cursor[PIECE_PRIO_LEVELS],
+                          uint32_t limit);
+static int download_piece(peer_connection_t *peer, uint32_t index, uint8_t *buf, uint32_t piece_len);
+static int repair_piece_v2(peer_connection_t *peer, const torrent_t *tor, uint32_t index, uint8_t *buf, uint32_t piece_len);
+static int piece_has_leaves(const torrent_t *tor, uint32_t index);
+static int timed_verify_piece(const torrent_t *tor, uint32_t index, const uint8_t *buf);
+
+// Таймеры загрузки, не привязанные к соединению. Обработчики только взводят флаги:
+// решения принимаются в цикле загрузки между кусками, а не посреди ожидания приёма
+typedef struct {
+    timer_wheel_t *wheel;
+    tw_timer_t round;           // раунд пересмотра текущего пира (SWARM_ROUND_MS)
+    tw_timer_t announce;        // повторное обращение к трекеру
+    int round_due;
+    int announce_due;
+    int interval;               // последний интервал трекера, с
+    uint64_t downloaded;        // прогресс для трекера: байт записано
+    uint64_t left;              // байт выбранных кусков ещё не записано
+} loop_timers_t;
+
+static void round_expired(void *arg);
+static void announce_expired(void *arg);
+static void reannounce(const torrent_t *tor, const uint8_t *my_peer_id, swarm_t *sw, loop_timers_t *lt);
 
 int main(int argc, char **argv) {
     config_t cfg;
@@ -23,6 +51,7 @@ int main(int argc, char **argv) {
 
     parse_args(argc, argv, &cfg);
     setup_signals();
+    log_start();
 
     if(load_torrent(&tor, &cfg)) {
         return 1;
@@ -30,31 +59,58 @@ int main(int argc, char **argv) {
 
     log_info_about_torrent(&tor);
 
+    int selected = torrent_select_files(&tor, cfg.files_spec);
+    if (selected < 0) {
+        torrent_free(&tor);
+        free_config(&cfg);
+        return 1;
+    }
+    if (cfg.files_spec) LOG_INFO("Selected files: %d of %zu", selected, tor.file_count);
+
+    if (cfg.metrics_addr && metrics_start(cfg.metrics_addr, &tor) < 0) {
+        torrent_free(&tor);
+        free_config(&cfg);
+        return 1;
+    }
+
+    if (cfg.check_only) {
+        int ret = run_check(&cfg, &tor);
+        metrics_stop();
+        torrent_free(&tor);
+        free_config(&cfg);
+        return ret;
+    }
+
     uint8_t my_peer_id[PEER_ID_LEN + 1];
     generate_peer_id(my_peer_id);
     peer_t *peers = NULL;
 
-    int peer_count = tracker_get_peers(&tor, my_peer_id, &peers);
+    int announce_interval = TRACKER_DEFAULT_INTERVAL;
+    announce_t started = { .event = "started", .downloaded = 0, .left = tor.total_length, .timeout = TRACKER_TIMEOUT };
+    int peer_count = tracker_get_peers(&tor, my_peer_id, &started, &peers, &announce_interval);
     if (peer_count <= 0) {
         LOG_ERROR("No peers received from tracker");
+        metrics_stop();
         torrent_free(&tor);
         free_config(&cfg);
         return 1;
     }
     // Переключаем вывод: хранилище/архив
     if (setup_output_context(&cfg, &tor) != 0) {
+        metrics_stop();
         free(peers);
         torrent_free(&tor);
         free_config(&cfg);
         return 1;
     }
-    int pieces_left = download_pieces(&tor, peers, peer_count, my_peer_id, &cfg);
+    int pieces_left = download_pieces(&tor, peers, peer_count, announce_interval, my_peer_id, &cfg);
     if (pieces_left == 0) {
         LOG_INFO("All pieces downloaded successfully!");
     } else {
         LOG_ERROR("Download incomplete, %d pieces missing", pieces_left);
     }
 
+    metrics_stop();
     free(peers);
     torrent_free(&tor);
     free_config(&cfg);
@@ -114,16 +170,43 @@ static void log_info_about_torrent(torrent_t *tor) {
     LOG_INFO("Piece length: %u", tor->piece_length);
     LOG_INFO("Number of pieces: %u", tor->num_pieces);
     LOG_INFO("Number of files: %zu", tor->file_count);
-#ifdef DEBUG
-    for (size_t i = 0; i < tor->file_count; i++) {
-        // Собираем путь
-        fprintf(stderr,"[DEBUG]  File %zu: ", i);
-        for (size_t j = 0; j < tor->files[i].path_len; j++) {
-            fprintf(stderr,"%s/", tor->files[i].path[j]);
+    if (log_enabled(LOG_LEVEL_DEBUG)) {
+        for (size_t i = 0; i < tor->file_count; i++) {
+            // Собираем путь
+            char path[PATH_LEN] = {0};
+            for (size_t j = 0; j < tor->files[i].path_len; j++) {
+                strncat(path, tor->files[i].path[j], sizeof(path) - strlen(path) - 1);
+                strncat(path, "/", sizeof(path) - strlen(path) - 1);
+            }
+            LOG_DEBUG("File %zu: %s (%llu bytes)", i, path, (unsigned long long)tor->files[i].length);
         }
-        fprintf(stderr," (%llu bytes)\n", (unsigned long long)tor->files[i].length);
     }
-#endif
+}
+
+/**
+ * Режим --check: проверяет уже скачанные данные и печатает битовое поле в stdout (hex)
+ * @param cfg - конфигурация (-o/-O, количество потоков)
+ * @param tor - торрент
+ * @return код завершения: 0 - все куски целы, 2 - есть повреждённые, 1 - ошибка
+ */
+static int run_check(const config_t *cfg, const torrent_t *tor) {
+    if (!cfg->output_file && !cfg->extract_dir) {
+        LOG_ERROR("--check requires -o <file> or -O <directory>");
+        return 1;
+    }
+    uint8_t *bitfield = NULL;
+    int bad = check_torrent(cfg, tor, &bitfield);
+    if (bad < 0) {
+        free(bitfield);
+        return 1;
+    }
+    for (size_t i = 0; i < (tor->num_pieces + 7) / 8; i++) {
+        printf("%02x", bitfield[i]);
+    }
+    printf("\n");
+    printf("pieces: %u valid: %u missing: %d\n", tor->num_pieces, tor->num_pieces - bad, bad);
+    free(bitfield);
+    return bad ? 2 : 0;
 }
 
 /**
@@ -165,103 +248,200 @@ static int setup_output_context(config_t *cfg, const torrent_t *tor) {
  * @param tor         Указатель на структуру торрента.
  * @param peers       Массив доступных пиров.
  * @param peer_count  Количество пиров в массиве.
+ * @param announce_interval Интервал повторного обращения к трекеру, с.
  * @param my_peer_id  Наш идентификатор (20 байт).
  * @param cfg         Указатель на конфигурацию (содержит информацию о выводе).
  * @return Количество оставшихся (нескачанных) кусков. 0, если все скачаны успешно.
  */
-static int download_pieces(const torrent_t *tor, const peer_t *peers, int peer_count,
+static int download_pieces(const torrent_t *tor, const peer_t *peers, int peer_count, int announce_interval,
                     const uint8_t my_peer_id[20],const config_t *cfg)
 
 {
-    // Массив для отметки скачанных кусков
-    uint8_t *pieces_done = xcalloc((tor->num_pieces + 7) / 8, 1);
-    int pieces_left = tor->num_pieces;
-
-    for (int peer_idx = 0; peer_idx < peer_count && pieces_left > 0 && running; peer_idx++) {
-        peer_t p = peers[peer_idx];
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &p.ip, ip_str, sizeof(ip_str));
-        uint16_t port = ntohs(p.port);
-        LOG_INFO("Trying peer %s:%u (%d/%d)", ip_str, port, peer_idx + 1, peer_count);
-
-        int sock = tcp_connect_timeout(p.ip, p.port, CONNECTIOIN_TIMEOUT);
-        if (sock < 0) {
-            LOG_WARN("Failed to connect to peer");
-            continue;
+    // Состояния кусков: запрошенные не выбираются повторно, проверенные считаются скачанными
+    piece_map_t pieces;
+    piece_map_init(&pieces, tor->num_pieces);
+    // Приоритеты из --files: куски только невыбранных файлов не качаются
+    uint8_t *prio = xmalloc(tor->num_pieces ? tor->num_pieces : 1);
+    torrent_piece_priorities(tor, prio);
+    uint64_t bytes_left = 0;
+    int reordered = 0;
+    for (uint32_t i = 0; i < tor->num_pieces; i++) {
+        // tar пишется строго по порядку: кусок high из конца архива пришлось бы держать в памяти
+        // до прихода всех предыдущих, поэтому для --tar действует только skip
+        if (cfg->use_tar && prio[i] != FILE_PRIO_SKIP && prio[i] != PIECE_PRIO_DEFAULT) {
+            prio[i] = PIECE_PRIO_DEFAULT;
+            reordered = 1;
         }
+        if (prio[i] != PIECE_PRIO_DEFAULT) piece_map_set_priority(&pieces, i, prio[i]);
+        if (prio[i]) bytes_left += piece_size(tor, i);
+    }
+    free(prio);
+    if (reordered) LOG_WARN("Tar output is written in order: only the skip priority of --files applies");
+    int pieces_left = piece_map_left(&pieces);
+    atomic_store(&metrics.pieces_left, pieces_left);
+    if (cfg->files_spec) {
+        LOG_INFO("Selected pieces: %d of %u (high %u, normal %u, low %u)", pieces_left, tor->num_pieces,
+                 pieces.level_count[FILE_PRIO_HIGH], pieces.level_count[FILE_PRIO_NORMAL], pieces.level_count[FILE_PRIO_LOW]);
+    }
+    // Пул кандидатов: медленные пиры возвращаются в конец очереди, приславшие битые данные - банятся
+    swarm_t *sw = swarm_create(peers, peer_count);
+
+    // Цикл событий: все сроки загрузки (connect, keep-alive, ответы на request, раунды,
+    // announce) в одном колесе, которое обслуживается в ожиданиях приёма и в dialer_poll
+    timer_wheel_t wheel;
+    tw_init(&wheel, monotonic_ms());
+    net_set_timers(&wheel);
+    loop_timers_t lt = { .wheel = &wheel,
+                         .interval = announce_interval < TRACKER_MIN_INTERVAL ? TRACKER_MIN_INTERVAL : announce_interval,
+                         .left = bytes_left };
+    tw_timer_init(&lt.round, round_expired, &lt);
+    tw_timer_init(&lt.announce, announce_expired, &lt);
+    tw_schedule(&wheel, &lt.round, monotonic_ms(), SWARM_ROUND_MS);
+    if (tor->announce) tw_schedule(&wheel, &lt.announce, monotonic_ms(), lt.interval * 1000.0);
 
+    // Подключения идут параллельно в фоне загрузки: смена пира берёт готовое соединение из пула
+    dialer_t *dl = dialer_create(sw, &wheel, CONNECTIOIN_TIMEOUT);
+    int cand, sock;
+
+    while (pieces_left > 0 && running) {
+        if (lt.announce_due) reannounce(tor, my_peer_id, sw, &lt);
+        if ((sock = dialer_take(dl, &cand)) < 0) break;
+        char addr_str[PEER_ADDR_STRLEN];
+        peer_addr_str(&sw->cands[cand].addr, addr_str, sizeof(addr_str));
+        LOG_INFO("Connected to peer %s (%d/%zu, attempt %d)", addr_str, cand + 1, sw->count, sw->cands[cand].attempts);
+
+        int mslot = metrics_peer_slot(addr_str);
+        metrics_peer_attach(mslot, sock);
         peer_connection_t peer = {
             .sock = sock,
             .choked = 1,
-            .bitfield = NULL,
-            .bitfield_len = 0
+            .metrics_slot = mslot
         };
 
         uint8_t peer_id_resp[20];
-        if (peer_handshake(sock, tor, my_peer_id, peer_id_resp) < 0) {
+        if (peer_handshake(&peer, tor, my_peer_id, peer_id_resp) < 0) {
             LOG_WARN("Handshake failed");
-            close(sock);
+            metrics_peer_detach(mslot, sock);
+            peer_close(&peer);
             continue;
         }
 
-        LOG_INFO("Handshake successful with peer, waiting for unchoke...");
-        if (peer_send_interested(sock) < 0) {
+        LOG_INFO("Handshake successful with peer%s, waiting for unchoke...", peer.fast ? " (fast extension)" : "");
+        if ((peer.fast && peer_send_have_none(sock) < 0) || peer_send_interested(sock) < 0) {
             LOG_WARN("Failed to send interested");
-            close(sock);
-            continue;
-        }
-
-        if (peer_wait_for_unchoke(&peer, UNCHOKE_TIMEOUT) < 0) {
-            LOG_WARN("Failed to get unchoke");
+            metrics_peer_detach(mslot, sock);
             peer_close(&peer);
             continue;
         }
+        peer_timers_start(&peer, &wheel);
 
-        // Получили unchoke, начинаем скачивать недостающие куски
-        for (uint32_t i = 0; i < tor->num_pieces && pieces_left > 0 && running; i++) {
-            if (IS_DONE(pieces_done, i)) continue; // уже скачан
-
-            if (!peer_has_piece(&peer, i)) {
-                LOG_DEBUG("Peer lacks piece %u", i);
-                continue;
+        // Качаем недостающие куски. Пока пир нас душит - только allowed fast (BEP 6)
+        uint32_t cursor[PIECE_PRIO_LEVELS] = {0};
+        int evicted = 0;
+        int rejected = 0;                 // были ли отказы в текущем проходе
+        int pass_start_left = pieces_left; // сколько кусков оставалось в начале прохода
+        while (pieces_left > 0 && running) {
+            dialer_poll(dl, 0); // продвигаем подключения к следующим пирам
+            if (peer.choked && peer_wait_for_unchoke(&peer, UNCHOKE_TIMEOUT) < 0) {
+                LOG_WARN("Failed to get unchoke");
+                break;
+            }
+            uint32_t limit = tor->num_pieces;
+            if (cfg->use_tar) {
+                // tar пишется по порядку: перебор не раньше начала окна и не дальше его конца
+                uint32_t first;
+                limit = tar_writer_window((tar_writer_t*)cfg->out_ctx, &first);
+                for (int l = 0; l < PIECE_PRIO_LEVELS; l++) if (cursor[l] < first) cursor[l] = first;
             }
+            int64_t next = pick_piece(&peer, &pieces, cursor, limit);
+            if (next < 0) {
+                if (peer.choked) continue; // allowed fast исчерпаны, ждём unchoke
+                if (rejected && pieces_left < pass_start_left) {
+                    // повторяем отклонённые куски, пока проход даёт прогресс
+                    memset(cursor, 0, sizeof(cursor));
+                    rejected = 0;
+                    pass_start_left = pieces_left;
+                    continue;
+                }
+                // нужные куски у пира есть, но за окном tar: вернём его в очередь
+                if (limit < tor->num_pieces && bitfield_any_interesting(&pieces.claimed, &peer.have)) evicted = 1;
+                break;                     // у пира больше нет нужных кусков
+            }
+            uint32_t i = (uint32_t)next;
 
             uint32_t piece_len = piece_size(tor, i);
             uint8_t *buf = xmalloc(piece_len);
-            int piece_ok = 1;
-
-            uint32_t offset = 0;
-            while (offset < piece_len && piece_ok && running) {
-                uint32_t block_len = (piece_len - offset) > BLOCK_SIZE ? BLOCK_SIZE : (piece_len - offset);
-                if (peer_send_request(sock, i, offset, block_len) < 0) {
-                    LOG_ERROR("Failed to send request for piece %u block %u", i, offset);
-                    piece_ok = 0;
-                    break;
-                }
-                if (peer_receive_block(sock, i, offset, buf + offset, block_len, RECEIVE_TIMEOUT) < 0) {
-                    LOG_ERROR("Failed to receive block %u for piece %u", offset, i);
-                    piece_ok = 0;
-                    break;
+            piece_map_set(&pieces, i, PIECE_REQUESTED);
+            int ret = download_piece(&peer, i, buf, piece_len);
+            if (ret == 0) piece_map_set(&pieces, i, PIECE_RECEIVED);
+
+            int valid = ret == 0 && timed_verify_piece(tor, i, buf);
+            int corrupt = ret == 0 && !valid;
+            if (corrupt) {
+                if (torrent_has_v2(tor) && peer.v2 && piece_has_leaves(tor, i)) {
+                    // v2: находим повреждённые блоки по хешам листьев и докачиваем только их
+                    ret = repair_piece_v2(&peer, tor, i, buf, piece_len);
+                    valid = ret == 0 && timed_verify_piece(tor, i, buf);
                 }
-                offset += block_len;
+                // к бану ведёт только неисправленный кусок: пир, у которого починка по блокам
+                // удалась, остаётся в рое (в малых v2-роях он может быть единственным источником)
+                if (!valid) peer.stats.hash_fails++;
             }
 
-            if (piece_ok && verify_piece(tor, i, buf)) {
+            if (valid) {
+                piece_map_set(&pieces, i, PIECE_VERIFIED);
+                metrics_add(&metrics.pieces_verified, 1);
                 // Записываем кусок в нужный обработчик
+                atomic_fetch_add(&metrics.disk_queue, 1);
+                double write_start = monotonic_ms();
                 if (cfg->use_tar) {
                     tar_writer_write((tar_writer_t*)cfg->out_ctx, i, buf, piece_len);
                 } else {
                     storage_write((storage_t*)cfg->out_ctx, i, buf, piece_len);
                 }
-                MARK_DONE(pieces_done, i);
-                pieces_left--;
+                metrics_observe_us(&metrics.disk_write, (uint64_t)((monotonic_ms() - write_start) * 1000.0));
+                atomic_fetch_sub(&metrics.disk_queue, 1);
+                piece_map_set(&pieces, i, PIECE_WRITTEN);
+                lt.downloaded += piece_len;
+                lt.left -= piece_len;
+                pieces_left = piece_map_left(&pieces);
+                atomic_store(&metrics.pieces_left, pieces_left);
                 LOG_INFO("Piece %u done, %d left", i, pieces_left);
+            } else if (ret == PEER_BLOCK_REJECTED) {
+                piece_map_set(&pieces, i, PIECE_NONE);
+                metrics_add(&metrics.blocks_rejected, 1);
+                LOG_WARN("Peer rejected piece %u, trying next piece", i);
+                peer.stats.errors++;
+                rejected = 1;
             } else {
                 LOG_ERROR("Failed to download piece %u", i);
-                // Не помечаем, попробуем у другого пира
+                // Возвращаем в PIECE_NONE, попробуем у другого пира
+                piece_map_set(&pieces, i, PIECE_NONE);
+                metrics_add(&metrics.pieces_failed, 1);
+                if (!corrupt) peer.stats.errors++; // хеш-ошибка уже учтена выше
             }
             free(buf);
+            // бан проверяем до выхода по сломанному соединению: иначе провал починки спасает пира
+            if (swarm_should_ban(&peer.stats)) {
+                LOG_WARN("Peer %s sent corrupt data, banned", addr_str);
+                break;
+            }
+            if (ret == -1) break; // соединение сломано, переходим к следующему пиру
+            if (lt.announce_due) reannounce(tor, my_peer_id, sw, &lt);
+            if (!lt.round_due) continue;
+            lt.round_due = 0;
+            if (swarm_should_evict(sw, &peer.stats)) {
+                LOG_WARN("Peer %s is too slow (%.1f KiB/s), switching to next peer",
+                         addr_str, peer.stats.rate_ewma / 1024.0);
+                evicted = 1;
+                break;
+            }
         }
+        LOG_INFO("Peer %s: %.1f KiB/s, rtt %.1f ms, %u blocks, %u errors, %u hash fails",
+                 addr_str, peer.stats.rate_ewma / 1024.0, peer.stats.rtt_ewma_ms,
+                 peer.stats.blocks, peer.stats.errors, peer.stats.hash_fails);
+        swarm_release(sw, cand, &peer.stats, evicted);
+        metrics_peer_detach(mslot, sock);
         peer_close(&peer);
     }
 
@@ -272,7 +452,196 @@ static int download_pieces(const torrent_t *tor, const peer_t *peers, int peer_c
         storage_close((storage_t*)cfg->out_ctx);
     }
 
-    free(pieces_done);
+    dialer_free(dl);
+    tw_cancel(&wheel, &lt.round);
+    tw_cancel(&wheel, &lt.announce);
+    net_set_timers(NULL);
+    swarm_free(sw);
+    piece_map_free(&pieces);
     return pieces_left;
 }
 
+
+/**
+ * Выбирает следующий кусок для скачивания у пира. В состоянии choked доступны только
+ * allowed fast куски, после unchoke сначала пробуются предложенные пиром (suggest),
+ * затем недостающие куски по порядку, начиная с самого высокого уровня приоритета.
+ *
+ * Последовательный перебор идёт по словам битовых полей (peer & level & ~claimed), а не по кускам.
+ *
+ * @param peer         Соединение с пиром (списки allowed fast/suggest расходуются).
+ * @param pieces       Карта состояний кусков.
+ * @param cursor       Позиции последовательного перебора для этого пира, по одной на уровень.
+ * @param limit        Куски с номером >= limit не выбираются (окно потока tar).
+ * @return Номер куска или -1, если у пира нечего качать.
+ */
+static int64_t pick_piece(peer_connection_t *peer, const piece_map_t *pieces, uint32_t cursor[PIECE_PRIO_LEVELS],
+                          uint32_t limit) {
+    uint32_t **list = peer->choked ? &peer->allowed_fast : &peer->suggested;
+    size_t *count = peer->choked ? &peer->allowed_fast_count : &peer->suggested_count;
+    while (*count > 0) {
+        uint32_t i = (*list)[--(*count)];
+        if (i < limit && !bitfield_get(&pieces->claimed, i) && peer_has_piece(peer, i)) return i;
+    }
+    if (peer->choked) return -1;
+
+    for (int l = PIECE_PRIO_LEVELS - 1; l > 0; l--) {
+        if (!pieces->level_count[l]) continue;
+        int64_t i = bitfield_next_interesting_in(&pieces->claimed, &peer->have, &pieces->level[l], cursor[l]);
+        if (i >= 0 && i < limit) {
+            cursor[l] = (uint32_t)i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Скачивает кусок блоками по BLOCK_SIZE.
+ *
+ * @param peer        Соединение с пиром.
+ * @param index       Номер куска.
+ * @param buf         Буфер для данных куска.
+ * @param piece_len   Размер куска.
+ * @return 0 - успех, -1 - ошибка соединения, PEER_BLOCK_REJECTED - пир отклонил запрос.
+ */
+static int download_piece(peer_connection_t *peer, uint32_t index, uint8_t *buf, uint32_t piece_len) {
+    uint32_t offset = 0;
+    while (offset < piece_len && running) {
+        uint32_t block_len = (piece_len - offset) > BLOCK_SIZE ? BLOCK_SIZE : (piece_len - offset);
+        if (peer_request_block(peer, index, offset, block_len) < 0) {
+            LOG_ERROR("Failed to send request for piece %u block %u", index, offset);
+            return -1;
+        }
+        double sent_at = monotonic_ms();
+        metrics_peer_t *m = metrics_peer(peer->metrics_slot);
+        if (m) atomic_fetch_add(&m->requests, 1);
+        int ret = peer_receive_block(peer, index, offset, buf + offset, block_len, RECEIVE_TIMEOUT);
+        if (m) atomic_fetch_sub(&m->requests, 1);
+        if (ret != 0) {
+            if (ret != PEER_BLOCK_REJECTED) LOG_ERROR("Failed to receive block %u for piece %u", offset, index);
+            return ret;
+        }
+        peer_stats_block(peer, block_len, monotonic_ms() - sent_at);
+        offset += block_len;
+    }
+    return running ? 0 : -1;
+}
+
+/**
+ * Проверяет, есть ли у куска несколько листьев merkle-дерева. Кусок из одного блока
+ * по хешам листьев не исправить: его хеш и есть единственный лист.
+ *
+ * @param tor         Указатель на структуру торрента.
+ * @param index       Номер куска.
+ * @return 1 - листьев больше одного, 0 - нет (или у файла куска нет дерева).
+ */
+static int piece_has_leaves(const torrent_t *tor, uint32_t index) {
+    uint32_t k;
+    const file_t *f = piece_file(tor, index, &k);
+    if (!f || !f->has_root) return 0;
+    uint64_t rest = f->length - (uint64_t)k * tor->piece_length;
+    uint64_t data_len = rest < tor->piece_length ? rest : tor->piece_length;
+    return data_len > MERKLE_BLOCK_SIZE;
+}
+
+/**
+ * Исправляет кусок, не прошедший проверку, по merkle-дереву v2: запрашивает у пира
+ * хеши листьев куска, сверяет каждый блок и перекачивает только повреждённые.
+ *
+ * @param peer        Соединение с пиром.
+ * @param tor         Указатель на структуру торрента.
+ * @param index       Номер куска.
+ * @param buf         Данные куска (исправляются на месте).
+ * @param piece_len   Размер куска.
+ * @return 0 - все повреждённые блоки заменены, -1 - исправить не удалось.
+ */
+static int repair_piece_v2(peer_connection_t *peer, const torrent_t *tor, uint32_t index, uint8_t *buf, uint32_t piece_len) {
+    uint8_t *leaves = NULL;
+    int count = peer_request_leaf_hashes(peer, tor, index, &leaves, RECEIVE_TIMEOUT);
+    if (count < 0) {
+        LOG_WARN("No verified block hashes for piece %u, whole piece will be retried", index);
+        return -1;
+    }
+
+    // данные файла в куске; хвост гибридного куска - выравнивание нулями
+    uint32_t k;
+    const file_t *f = piece_file(tor, index, &k);
+    uint64_t rest = f->length - (uint64_t)k * tor->piece_length;
+    uint32_t data_len = rest < piece_len ? (uint32_t)rest : piece_len;
+    memset(buf + data_len, 0, piece_len - data_len);
+
+    int bad = 0;
+    int ret = 0;
+    for (uint32_t offset = 0, b = 0; offset < data_len && ret == 0 && running; offset += MERKLE_BLOCK_SIZE, b++) {
+        uint32_t block_len = (data_len - offset) > MERKLE_BLOCK_SIZE ? MERKLE_BLOCK_SIZE : (data_len - offset);
+        const uint8_t *leaf = leaves + (size_t)b * MERKLE_HASH_LEN;
+        if ((int)b >= count || verify_block_v2(leaf, buf + offset, block_len)) continue;
+
+        bad++;
+        LOG_DEBUG("Piece %u block %u is corrupt, re-requesting", index, offset);
+        if (peer_request_block(peer, index, offset, block_len) < 0
+            || peer_receive_block(peer, index, offset, buf + offset, block_len, RECEIVE_TIMEOUT) != 0
+            || !verify_block_v2(leaf, buf + offset, block_len)) {
+            ret = -1;
+        }
+    }
+    free(leaves);
+    LOG_INFO("Piece %u: %d corrupt block(s) re-downloaded%s", index, bad, ret ? " (failed)" : "");
+    return ret;
+}
+
+/**
+ * Проверяет хеш куска и записывает время проверки в метрики.
+ *
+ * @param tor         Указатель на структуру торрента.
+ * @param index       Номер куска.
+ * @param buf         Данные куска.
+ * @return 1 - хеш совпал, 0 - нет.
+ */
+static int timed_verify_piece(const torrent_t *tor, uint32_t index, const uint8_t *buf) {
+    double t0 = monotonic_ms();
+    int ok = verify_piece(tor, index, buf);
+    metrics_observe_us(&metrics.hash_download, (uint64_t)((monotonic_ms() - t0) * 1000.0));
+    return ok;
+}
+
+/**
+ * Раунд пересмотра пира (аналог rechoke): раз в SWARM_ROUND_MS цикл загрузки сравнивает
+ * скорость текущего пира с роем, а не после каждого куска
+ */
+static void round_expired(void *arg) {
+    loop_timers_t *lt = arg;
+    lt->round_due = 1;
+    tw_schedule(lt->wheel, &lt->round, monotonic_ms(), SWARM_ROUND_MS);
+}
+
+static void announce_expired(void *arg) {
+    loop_timers_t *lt = arg;
+    lt->announce_due = 1;
+}
+
+/**
+ * Повторно обращается к трекеру (с текущим прогрессом) и добавляет новых пиров в пул. Следующее
+ * обращение - через интервал из ответа (не чаще TRACKER_MIN_INTERVAL); при ошибке - через прежний интервал.
+ *
+ * @param tor         Указатель на структуру торрента.
+ * @param my_peer_id  Наш идентификатор.
+ * @param sw          Пул кандидатов.
+ * @param lt          Таймеры загрузки.
+ */
+static void reannounce(const torrent_t *tor, const uint8_t *my_peer_id, swarm_t *sw, loop_timers_t *lt) {
+    lt->announce_due = 0;
+    peer_t *peers = NULL;
+    int interval = lt->interval;
+    // короткий таймаут: пока ждём трекер, загрузка стоит
+    announce_t ann = { .event = NULL, .downloaded = lt->downloaded, .left = lt->left, .timeout = TRACKER_REANNOUNCE_TIMEOUT };
+    int count = tracker_get_peers(tor, my_peer_id, &ann, &peers, &interval);
+    if (count > 0) {
+        int added = swarm_add(sw, peers, count);
+        LOG_INFO("Re-announce: %d new peer(s), %zu known", added, sw->count);
+    }
+    free(peers);
+    lt->interval = interval < TRACKER_MIN_INTERVAL ? TRACKER_MIN_INTERVAL : interval;
+    tw_schedule(lt->wheel, &lt->announce, monotonic_ms(), lt->interval * 1000.0);
+}
@@ -0,0 +1,107 @@
+#include "merkle.h"
+
+/**
+ * Хеш пары узлов: SHA-256(left || right)
+ *
+ * @param *left левый узел
+ * @param *right правый узел
+ * @param *out результат
+ */
+static void hash_pair(const uint8_t *left, const uint8_t *right, uint8_t *out) {
+    uint8_t buf[MERKLE_HASH_LEN * 2];
+    memcpy(buf, left, MERKLE_HASH_LEN);
+    memcpy(buf + MERKLE_HASH_LEN, right, MERKLE_HASH_LEN);
+    SHA256(buf, sizeof(buf), out);
+}
+
+/**
+ * Вычисляет ширину слоя дерева: ближайшая сверху степень двойки
+ *
+ * @param count количество листьев
+ * @return ширина слоя (не меньше 1)
+ */
+size_t merkle_width(size_t count) {
+    size_t w = 1;
+    while (w < count) w <<= 1;
+    return w;
+}
+
+/**
+ * Хеш листа дерева (блока данных до 16 KiB)
+ *
+ * @param *data данные блока
+ * @param len длина блока
+ * @param *out SHA-256 блока
+ */
+void merkle_hash_block(const uint8_t *data, size_t len, uint8_t out[MERKLE_HASH_LEN]) {
+    SHA256(data, len, out);
+}
+
+/**
+ * Корень поддерева из width нулевых листьев. Используется для выравнивания
+ * последнего куска файла и слоя кусков до степени двойки (BEP 52)
+ *
+ * @param width количество листьев (степень двойки)
+ * @param *out корень поддерева
+ */
+void merkle_pad_hash(size_t width, uint8_t out[MERKLE_HASH_LEN]) {
+    memset(out, 0, MERKLE_HASH_LEN);
+    for (size_t w = 1; w < width; w <<= 1) {
+        hash_pair(out, out, out);
+    }
+}
+
+/**
+ * Строит дерево снизу вверх и возвращает корень. Недостающие листья (count..width)
+ * считаются нулевыми хешами, поэтому хвост дерева не материализуется:
+ * на каждом уровне нечётный последний узел объединяется с хешем выравнивания.
+ *
+ * @param *leaves массив хешей листьев (count * 32 байт)
+ * @param count количество листьев
+ * @param width ширина дерева (степень двойки, >= count)
+ * @param *out корень дерева
+ */
+void merkle_root(const uint8_t *leaves, size_t count, size_t width, uint8_t out[MERKLE_HASH_LEN]) {
+    if (count == 0) {
+        merkle_pad_hash(width, out);
+        return;
+    }
+    uint8_t *layer = xmalloc(count * MERKLE_HASH_LEN);
+    memcpy(layer, leaves, count * MERKLE_HASH_LEN);
+
+    uint8_t pad[MERKLE_HASH_LEN] = {0}; // хеш выравнивания для текущего уровня
+    size_t n = count;
+    for (size_t w = width; w > 1; w >>= 1) {
+        size_t next = (n + 1) / 2;
+        for (size_t i = 0; i < next; i++) {
+            const uint8_t *left = layer + 2 * i * MERKLE_HASH_LEN;
+            const uint8_t *right = (2 * i + 1 < n) ? left + MERKLE_HASH_LEN : pad;
+            hash_pair(left, right, layer + i * MERKLE_HASH_LEN);
+        }
+        hash_pair(pad, pad, pad);
+        n = next;
+    }
+    memcpy(out, layer, MERKLE_HASH_LEN);
+    free(layer);
+}
+
+/**
+ * Корень дерева по сырым данным: режет данные на блоки по 16 KiB,
+ * хеширует каждый и строит дерево шириной width
+ *
+ * @param *data данные
+ * @param len длина данных
+ * @param width ширина дерева в листьях
+ * @param *out корень дерева
+ */
+void merkle_root_of_data(const uint8_t *data, size_t len, size_t width, uint8_t out[MERKLE_HASH_LEN]) {
+    size_t count = (len + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+    uint8_t *leaves = xmalloc(count ? count * MERKLE_HASH_LEN : 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t off = i * MERKLE_BLOCK_SIZE;
+        size_t blen = (len - off) > MERKLE_BLOCK_SIZE ? MERKLE_BLOCK_SIZE : (len - off);
+        merkle_hash_block(data + off, blen, leaves + i * MERKLE_HASH_LEN);
+    }
+    merkle_root(leaves, count, width, out);
+    free(leaves);
+}
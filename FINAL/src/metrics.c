@@ -0,0 +1,355 @@
+#include "metrics.h"
+#include <netdb.h>
+
+metrics_t metrics;
+
+// Верхние границы корзин гистограмм, мкс
+static const uint64_t metrics_hist_bounds_us[METRICS_HIST_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+// Сокет -> слот пира + 1 (0 - сокет не привязан)
+static atomic_int fd_slot[METRICS_MAX_FDS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    pthread_t thread;
+    int listen_fd;
+    atomic_int stop;
+    char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    char info_hash[41];
+    char name[128];
+    uint32_t num_pieces;
+    uint64_t total_length;
+} server = { .listen_fd = -1 };
+
+/**
+ * Добавляет замер в гистограмму
+ *
+ * @param *h гистограмма
+ * @param us значение, мкс
+ */
+void metrics_observe_us(metrics_hist_t *h, uint64_t us) {
+    size_t b = 0;
+    while (b < METRICS_HIST_BUCKETS && us > metrics_hist_bounds_us[b]) b++;
+    atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum_us, us);
+}
+
+/**
+ * Находит или создаёт слот пира
+ *
+ * @param *addr адрес пира ("ip:port" или "[ip6]:port")
+ * @return номер слота или -1
+ */
+int metrics_peer_slot(const char *addr) {
+
+    pthread_mutex_lock(&slot_lock);
+    int count = atomic_load(&metrics.peer_count);
+    int slot = -1;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(metrics.peers[i].addr, addr) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0 && count < METRICS_MAX_PEERS) {
+        slot = count;
+        metrics_peer_t *p = &metrics.peers[slot];
+        snprintf(p->addr, sizeof(p->addr), "%s", addr);
+        atomic_store(&p->choked, 1);
+        atomic_store(&metrics.peer_count, count + 1); // публикуем слот после заполнения адреса
+    }
+    pthread_mutex_unlock(&slot_lock);
+    return slot;
+}
+
+void metrics_peer_attach(int slot, int sock) {
+    metrics_peer_t *p = metrics_peer(slot);
+    if (!p) return;
+    atomic_store(&p->connected, 1);
+    atomic_store(&p->choked, 1);
+    atomic_store(&p->requests, 0);
+    if (sock >= 0 && sock < METRICS_MAX_FDS) atomic_store(&fd_slot[sock], slot + 1);
+}
+
+void metrics_peer_detach(int slot, int sock) {
+    metrics_peer_t *p = metrics_peer(slot);
+    if (!p) return;
+    atomic_store(&p->connected, 0);
+    atomic_store(&p->requests, 0);
+    if (sock >= 0 && sock < METRICS_MAX_FDS) atomic_store(&fd_slot[sock], 0);
+}
+
+/**
+ * Учитывает трафик сокета в общих счётчиках и счётчиках пира
+ *
+ * @param sock сокет
+ * @param in получено байт
+ * @param out отправлено байт
+ */
+void metrics_sock_io(int sock, size_t in, size_t out) {
+    metrics_add(&metrics.bytes_in, in);
+    metrics_add(&metrics.bytes_out, out);
+    if (sock < 0 || sock >= METRICS_MAX_FDS) return;
+    metrics_peer_t *p = metrics_peer(atomic_load_explicit(&fd_slot[sock], memory_order_relaxed) - 1);
+    if (!p) return;
+    metrics_add(&p->bytes_in, in);
+    metrics_add(&p->bytes_out, out);
+}
+
+/**
+ * Печатает гистограмму в формате Prometheus (секунды, накопительные корзины)
+ */
+static void render_hist(FILE *out, const char *name, const char *labels, metrics_hist_t *h) {
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b <= METRICS_HIST_BUCKETS; b++) {
+        cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if (b < METRICS_HIST_BUCKETS) {
+            fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                    metrics_hist_bounds_us[b] / 1e6, (unsigned long long)cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+        }
+    }
+    fprintf(out, "%s_sum{%s} %.6f\n", name, labels, atomic_load(&h->sum_us) / 1e6);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)atomic_load(&h->count));
+}
+
+static void render_counter(FILE *out, const char *name, const char *type, const char *help,
+                           const char *labels, unsigned long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s{%s} %llu\n", name, help, name, type, name, labels, value);
+}
+
+/**
+ * Формирует текст метрик
+ *
+ * @param **body[out] текст (освобождает вызывающий)
+ * @return длина текста
+ */
+static size_t render(char **body) {
+    size_t len = 0;
+    FILE *out = open_memstream(body, &len);
+    if (!out) return 0;
+
+    char t[256];
+    snprintf(t, sizeof(t), "info_hash=\"%s\"", server.info_hash);
+
+    fprintf(out, "# HELP torrent_info Torrent being processed\n# TYPE torrent_info gauge\n");
+    fprintf(out, "torrent_info{%s,name=\"%s\"} 1\n", t, server.name);
+    render_counter(out, "torrent_size_bytes", "gauge", "Total payload size", t, server.total_length);
+    render_counter(out, "torrent_pieces", "gauge", "Number of pieces", t, server.num_pieces);
+    render_counter(out, "torrent_pieces_left", "gauge", "Pieces not yet verified", t,
+                   (unsigned long long)atomic_load(&metrics.pieces_left));
+    render_counter(out, "torrent_pieces_verified_total", "counter", "Pieces that passed hash check", t,
+                   atomic_load(&metrics.pieces_verified));
+    render_counter(out, "torrent_pieces_failed_total", "counter", "Pieces that failed to download or verify", t,
+                   atomic_load(&metrics.pieces_failed));
+    render_counter(out, "torrent_blocks_rejected_total", "counter", "Block requests rejected by peers", t,
+                   atomic_load(&metrics.blocks_rejected));
+    render_counter(out, "torrent_bytes_in_total", "counter", "Bytes received from peers", t,
+                   atomic_load(&metrics.bytes_in));
+    render_counter(out, "torrent_bytes_out_total", "counter", "Bytes sent to peers", t,
+                   atomic_load(&metrics.bytes_out));
+    render_counter(out, "torrent_disk_queue_depth", "gauge", "Piece writes in progress", t,
+                   (unsigned long long)atomic_load(&metrics.disk_queue));
+    render_counter(out, "torrent_connects_inflight", "gauge", "Non-blocking connects in progress", t,
+                   (unsigned long long)atomic_load(&metrics.connects_inflight));
+    render_counter(out, "torrent_connects_failed_total", "counter", "Failed or timed out peer connects", t,
+                   atomic_load(&metrics.connects_failed));
+    render_counter(out, "torrent_requests_timed_out_total", "counter", "Block requests without a reply in time", t,
+                   atomic_load(&metrics.requests_timed_out));
+    render_counter(out, "torrent_keepalives_sent_total", "counter", "Keep-alive messages sent", t,
+                   atomic_load(&metrics.keepalives_sent));
+    render_counter(out, "torrent_announces_total", "counter", "Tracker announces", t,
+                   atomic_load(&metrics.announces));
+
+    char l[320];
+    fprintf(out, "# HELP torrent_hash_seconds Piece hash verification latency\n# TYPE torrent_hash_seconds histogram\n");
+    snprintf(l, sizeof(l), "%s,pool=\"download\"", t);
+    render_hist(out, "torrent_hash_seconds", l, &metrics.hash_download);
+    snprintf(l, sizeof(l), "%s,pool=\"check\"", t);
+    render_hist(out, "torrent_hash_seconds", l, &metrics.hash_check);
+    fprintf(out, "# HELP torrent_disk_write_seconds Piece write latency\n# TYPE torrent_disk_write_seconds histogram\n");
+    render_hist(out, "torrent_disk_write_seconds", t, &metrics.disk_write);
+
+    // метрики пиров: по одному семейству, строки для всех слотов
+    static const struct {
+        const char *name, *type, *help;
+    } peer_families[] = {
+        { "torrent_peer_bytes_in_total", "counter", "Bytes received from peer" },
+        { "torrent_peer_bytes_out_total", "counter", "Bytes sent to peer" },
+        { "torrent_peer_connected", "gauge", "Peer connection is open" },
+        { "torrent_peer_choked", "gauge", "Peer is choking us" },
+        { "torrent_peer_requests_outstanding", "gauge", "Block requests in flight" },
+        { "torrent_peer_rate_bytes", "gauge", "Download rate EWMA, bytes per second" },
+        { "torrent_peer_rtt_seconds", "gauge", "Block round-trip time EWMA" },
+    };
+    int count = atomic_load(&metrics.peer_count);
+    for (size_t f = 0; f < sizeof(peer_families) / sizeof(peer_families[0]); f++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", peer_families[f].name, peer_families[f].help,
+                peer_families[f].name, peer_families[f].type);
+        for (int i = 0; i < count; i++) {
+            metrics_peer_t *p = &metrics.peers[i];
+            fprintf(out, "%s{%s,peer=\"%s\"} ", peer_families[f].name, t, p->addr);
+            switch (f) {
+            case 0: fprintf(out, "%llu\n", (unsigned long long)atomic_load(&p->bytes_in)); break;
+            case 1: fprintf(out, "%llu\n", (unsigned long long)atomic_load(&p->bytes_out)); break;
+            case 2: fprintf(out, "%d\n", atomic_load(&p->connected)); break;
+            case 3: fprintf(out, "%d\n", atomic_load(&p->choked)); break;
+            case 4: fprintf(out, "%d\n", atomic_load(&p->requests)); break;
+            case 5: fprintf(out, "%llu\n", (unsigned long long)atomic_load(&p->rate)); break;
+            default: fprintf(out, "%.6f\n", atomic_load(&p->rtt_us) / 1e6); break;
+            }
+        }
+    }
+    fclose(out);
+    return len;
+}
+
+/**
+ * Обслуживает одного клиента: читает запрос (содержимое не важно) и отдаёт метрики
+ *
+ * @param fd сокет клиента
+ */
+static void serve_client(int fd) {
+    char req[1024];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 1000) > 0) {
+        ssize_t n = recv(fd, req, sizeof(req), 0);
+        (void)n;
+    }
+    char *body = NULL;
+    size_t len = render(&body);
+    char head[160];
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (send(fd, head, hlen, MSG_NOSIGNAL) == hlen && len > 0) {
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t n = send(fd, body + sent, len - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+    free(body);
+    close(fd);
+}
+
+static void *metrics_thread(void *arg) {
+    (void)arg;
+    while (!atomic_load(&server.stop)) {
+        struct pollfd pfd = { .fd = server.listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) continue;
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (fd >= 0) serve_client(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Создаёт слушающий сокет по строке endpoint
+ *
+ * @param *endpoint "unix:/path", "/path" или "[host:]port"
+ * @return сокет или -1
+ */
+static int open_listener(const char *endpoint) {
+    int fd = -1;
+    if (strncmp(endpoint, "unix:", 5) == 0 || endpoint[0] == '/' || endpoint[0] == '.') {
+        const char *path = endpoint[0] == 'u' ? endpoint + 5 : endpoint;
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+            LOG_ERROR("Metrics socket path is too long: %s", path);
+            return -1;
+        }
+        strcpy(sa.sun_path, path);
+        unlink(path); // сокет от прошлого запуска
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) goto error;
+        strcpy(server.unix_path, path);
+    } else {
+        char host[256] = "127.0.0.1";
+        const char *port = endpoint;
+        const char *colon = strrchr(endpoint, ':');
+        if (colon) {
+            const char *h = endpoint;
+            size_t hl = (size_t)(colon - endpoint);
+            // IPv6 в квадратных скобках ("[::1]:9100"): getaddrinfo принимает адрес без них
+            if (hl >= 2 && h[0] == '[' && h[hl - 1] == ']') {
+                h++;
+                hl -= 2;
+            }
+            if (hl >= sizeof(host)) return -1;
+            memcpy(host, h, hl);
+            host[hl] = '\0';
+            port = colon + 1;
+        }
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+        struct addrinfo *ai = NULL;
+        if (getaddrinfo(host, port, &hints, &ai) != 0 || !ai) {
+            LOG_ERROR("Invalid metrics address: %s", endpoint);
+            return -1;
+        }
+        fd = socket(ai->ai_family, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int ok = fd >= 0 && bind(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        freeaddrinfo(ai);
+        if (!ok) goto error;
+    }
+    if (listen(fd, 16) < 0) goto error;
+    return fd;
+error:
+    LOG_ERROR("Failed to listen for metrics on %s: %s", endpoint, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/**
+ * Запускает поток, отдающий метрики
+ *
+ * @param *endpoint адрес (см. open_listener)
+ * @param *tor торрент (для меток)
+ * @return 0/-1
+ */
+int metrics_start(const char *endpoint, const torrent_t *tor) {
+    for (int i = 0; i < 20; i++) {
+        sprintf(server.info_hash + i * 2, "%02x", tor->info_hash[i]);
+    }
+    // имя попадает в значение метки - убираем символы, которые пришлось бы экранировать
+    const char *name = tor->name ? tor->name : "";
+    size_t j = 0;
+    for (size_t i = 0; name[i] && j < sizeof(server.name) - 1; i++) {
+        server.name[j++] = (name[i] == '"' || name[i] == '\\' || name[i] == '\n') ? '_' : name[i];
+    }
+    server.name[j] = '\0';
+    server.num_pieces = tor->num_pieces;
+    server.total_length = tor->total_length;
+    atomic_store(&metrics.pieces_left, (int)tor->num_pieces);
+
+    server.listen_fd = open_listener(endpoint);
+    if (server.listen_fd < 0) return -1;
+    atomic_store(&server.stop, 0);
+    if (pthread_create(&server.thread, NULL, metrics_thread, NULL) != 0) {
+        LOG_ERROR("Failed to start metrics thread");
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        return -1;
+    }
+    LOG_INFO("Metrics available at %s", endpoint);
+    return 0;
+}
+
+/**
+ * Останавливает поток метрик и удаляет unix-сокет
+ */
+void metrics_stop(void) {
+    if (server.listen_fd < 0) return;
+    atomic_store(&server.stop, 1);
+    pthread_join(server.thread, NULL);
+    close(server.listen_fd);
+    server.listen_fd = -1;
+    if (server.unix_path[0]) unlink(server.unix_path);
+}
@@ -1,93 +1,203 @@
 #include "network.h"
+#include "metrics.h"
+
+static timer_wheel_t *loop_timers;  // колесо цикла событий (NULL - таймеров нет)
+static int interrupted_sock = -1;   // сокет, ожидание на котором прервал таймер
 
 /**
- * Устанавливает tcp-соединение с таймаутом
- * 
- * @param ip адрес
- * @param port порт
- * @param timeout_ms таймаут
- * @return дескриптор сокета в блокирующем режиме
+ * Заполняет адрес пира из компактной записи трекера: 4 байта IPv4 + порт (peers)
+ * или 16 байт IPv6 + порт (peers6). IPv4-mapped адреса IPv6 приводятся к IPv4.
+ *
+ * @param *p[out] адрес пира
+ * @param *data запись (PEER_COMPACT_V4 или PEER_COMPACT_V6 байт)
+ * @param family AF_INET или AF_INET6
+ * @return 0 - успех, -1 - неизвестное семейство
  */
-int tcp_connect_timeout(uint32_t ip, uint16_t port, int timeout_ms) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return -1;
+int peer_addr_from_compact(peer_t *p, const uint8_t *data, int family) {
+    static const uint8_t v4_mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+    memset(p, 0, sizeof(*p));
+    if (family == AF_INET6 && memcmp(data, v4_mapped, sizeof(v4_mapped)) == 0) {
+        data += sizeof(v4_mapped);
+        family = AF_INET;
     }
-
-    // Устанавливаем неблокирующий режим для connect с таймаутом
-    int flags = fcntl(sock, F_GETFL, 0); // Получаем флаги
-    if (flags == -1) {
-        perror("fcntl F_GETFL");
-        close(sock);
-        return -1;
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)&p->sa;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, data, 4);
+        memcpy(&sin->sin_port, data + 4, 2); // уже в сетевом порядке
+        p->len = sizeof(*sin);
+        return 0;
     }
-    if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) { //устанавливаем флаги, переводим в неблокирующий режим
-        perror("fcntl F_SETFL O_NONBLOCK");
-        close(sock);
-        return -1;
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&p->sa;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, data, 16);
+        memcpy(&sin6->sin6_port, data + 16, 2);
+        p->len = sizeof(*sin6);
+        return 0;
     }
-    /* Инициализация адреса */
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = port; 
-    addr.sin_addr.s_addr = ip;
+    return -1;
+}
 
-    int ret = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
-    if (ret < 0 && errno != EINPROGRESS) {
-        perror("connect");
-        close(sock);
-        return -1;
+/**
+ * Заполняет адрес пира из текстового IP (словарная форма ответа трекера).
+ * Имена хостов не разрешаются - они требовали бы блокирующего DNS для каждого пира.
+ *
+ * @param *p[out] адрес пира
+ * @param *ip IPv4 или IPv6 адрес
+ * @param port порт (в порядке хоста)
+ * @return 0 - успех, -1 - не числовой адрес
+ */
+int peer_addr_from_string(peer_t *p, const char *ip, uint16_t port) {
+    uint8_t raw[18];
+    uint16_t nport = htons(port);
+    if (inet_pton(AF_INET, ip, raw) == 1) {
+        memcpy(raw + 4, &nport, 2);
+        return peer_addr_from_compact(p, raw, AF_INET);
+    }
+    if (inet_pton(AF_INET6, ip, raw) == 1) {
+        memcpy(raw + 16, &nport, 2);
+        return peer_addr_from_compact(p, raw, AF_INET6);
     }
+    return -1;
+}
 
-    if (ret == 0) {
-        // Соединение установилось мгновенно
-        // Возвращаем сокет в блокирующий режим
-        fcntl(sock, F_SETFL, flags);
-        return sock;
+/**
+ * Сравнивает адреса пиров (семейство, IP и порт)
+ *
+ * @param *a адрес
+ * @param *b адрес
+ * @return 1 - совпадают, 0 - нет
+ */
+int peer_addr_equal(const peer_t *a, const peer_t *b) {
+    if (a->sa.ss_family != b->sa.ss_family) return 0;
+    if (a->sa.ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in*)&a->sa, *y = (const struct sockaddr_in*)&b->sa;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
     }
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6*)&a->sa, *y = (const struct sockaddr_in6*)&b->sa;
+    return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, 16) == 0;
+}
 
-    // Ждём завершения соединения с помощью poll
-    struct pollfd pfd;
-    pfd.fd = sock;
-    pfd.events = POLLOUT;
+/**
+ * Форматирует адрес пира: "1.2.3.4:6881" или "[2001:db8::1]:6881"
+ *
+ * @param *p адрес пира
+ * @param *buf буфер (PEER_ADDR_STRLEN байт достаточно)
+ * @param len размер буфера
+ * @return buf
+ */
+char *peer_addr_str(const peer_t *p, char *buf, size_t len) {
+    char ip[INET6_ADDRSTRLEN] = "?";
+    if (p->sa.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)&p->sa;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+        snprintf(buf, len, "[%s]:%u", ip, ntohs(sin6->sin6_port));
+    } else {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)&p->sa;
+        inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        snprintf(buf, len, "%s:%u", ip, ntohs(sin->sin_port));
+    }
+    return buf;
+}
 
-    int poll_ret = poll(&pfd, 1, timeout_ms);
-    if (poll_ret <= 0) {
-        if (poll_ret == 0) {
-            LOG_ERROR("Connection timeout to %s:%d", inet_ntoa(addr.sin_addr), ntohs(port));
-        } else {
-            perror("poll");
-        }
-        close(sock);
+/**
+ * Создаёт неблокирующий сокет нужного семейства и начинает connect
+ *
+ * @param *peer адрес пира
+ * @param *done[out] 1 - соединение установилось сразу
+ * @return дескриптор (в неблокирующем режиме) или -1
+ */
+int tcp_connect_start(const peer_t *peer, int *done) {
+    int sock = socket(peer->sa.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        LOG_DEBUG("socket: %s", strerror(errno)); // например, IPv6 отключён на хосте
         return -1;
     }
-
-    // Проверяем, есть ли ошибка на сокете
-    int so_error;
-    socklen_t len = sizeof(so_error);
-    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0) {
-        perror("getsockopt");
+    // Неблокирующий режим для connect с таймаутом
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl O_NONBLOCK");
         close(sock);
         return -1;
     }
-    if (so_error != 0) {
-        LOG_ERROR("Connection error: %s", strerror(so_error));
+    int ret = connect(sock, (const struct sockaddr*)&peer->sa, peer->len);
+    if (ret < 0 && errno != EINPROGRESS) {
+        char addr[PEER_ADDR_STRLEN];
+        LOG_DEBUG("connect %s: %s", peer_addr_str(peer, addr, sizeof(addr)), strerror(errno));
         close(sock);
         return -1;
     }
-
-    /* Возвращаем сокет в блокирующий режим
-       Перевод в неблокирующий режим только для connect необходим, 
-       так как стандартный блокирующий connect может висеть минутами. 
-       После установки соединения сокет возвращается в блокирующий режим, 
-       чтобы упростить последующие операции (не нужно обрабатывать EAGAIN).*/
-     
-    fcntl(sock, F_SETFL, flags);
+    *done = ret == 0;
     return sock;
 }
 
+/**
+ * Возвращает сокет в блокирующий режим.
+ * Перевод в неблокирующий режим только для connect необходим, так как стандартный
+ * блокирующий connect может висеть минутами. После установки соединения сокет
+ * возвращается в блокирующий режим, чтобы упростить последующие операции (не нужно обрабатывать EAGAIN).
+ *
+ * @param sock дескриптор
+ */
+static void set_blocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags != -1) fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/**
+ * Завершает неблокирующий connect после события poll на сокете
+ *
+ * @param sock дескриптор из tcp_connect_start
+ * @return 0 - соединение установлено (сокет переведён в блокирующий режим), иначе код ошибки (errno)
+ */
+int tcp_connect_finish(int sock) {
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0) return errno;
+    if (so_error == 0) set_blocking(sock);
+    return so_error;
+}
+
+void net_set_timers(timer_wheel_t *tw) {
+    loop_timers = tw;
+    interrupted_sock = -1;
+}
+
+void net_interrupt(int sock) {
+    interrupted_sock = sock;
+}
+
+/**
+ * Ждёт данных на сокете не дольше timeout_ms, попутно выполняя наступившие таймеры
+ *
+ * @param sock номер сокета
+ * @param timeout_ms таймаут ожидания
+ * @return 1 - данные есть, 0 - таймаут, -1 - ошибка или ожидание прервано таймером
+ */
+static int wait_readable(int sock, int timeout_ms) {
+    double deadline = monotonic_ms() + timeout_ms;
+    while (running) {
+        double now = monotonic_ms();
+        int wait = now < deadline ? (int)(deadline - now) + 1 : 0;
+        if (loop_timers) wait = tw_next_timeout(loop_timers, now, wait);
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ret = poll(&pfd, 1, wait);
+        if (ret == -1 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (loop_timers) tw_advance(loop_timers, monotonic_ms());
+        if (interrupted_sock == sock) {
+            interrupted_sock = -1;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (ret > 0) return 1;
+        if (monotonic_ms() >= deadline) return 0;
+    }
+    return -1;
+}
 
 /**
  * Отправляет len байт из буфера c заданным таймаутом
@@ -122,6 +232,7 @@ int send_full_timeout(int sock, const void *buf, size_t len, int timeout_ms) {
             return -1;
         }
         sent += n;
+        metrics_sock_io(sock, 0, (size_t)n);
     }
     return running ? 0 : -1; //если цикл завершен из-за running (устанваливается в обработчике сигналов), возвращаем -1
 }
@@ -138,13 +249,8 @@ int send_full_timeout(int sock, const void *buf, size_t len, int timeout_ms) {
 int recv_full_timeout(int sock, void *buf, size_t len, int timeout_ms) {
     size_t received = 0; //счетчик полученных байт
     while (received < len && running) {
-        struct pollfd pfd = { .fd = sock, .events = POLLIN };
-        int ret = poll(&pfd, 1, timeout_ms);
-        if (ret == -1) {
-            if (errno == EINTR) continue;
-            perror("poll");
-            return -1;
-        }
+        int ret = wait_readable(sock, timeout_ms);
+        if (ret < 0) return -1;
         if (ret == 0) {
             LOG_ERROR("Receive timeout");
             return -1;
@@ -159,6 +265,7 @@ int recv_full_timeout(int sock, void *buf, size_t len, int timeout_ms) {
             return -1;
         }
         received += n;
+        metrics_sock_io(sock, (size_t)n, 0);
     }
     return running ? 0 : -1;
 }
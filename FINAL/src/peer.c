@@ -2,21 +2,26 @@
 
 /**
  * Выполняет handshake с пиром. Отправляет рукопожатие и проверяет ответ
- * @param sock номер сокета
+ * @param *peer соединение с пиром (заполняется флаг fast)
  * @param *tor указатель на структуру с данными торрента (info_hash)
  * @param *my_peer_id указатель на наш peer_id
  * @param *peer_id_out укзатель на peer_id удаленного узла (заполняется после успешного handshake)
  * @return успех/ошибка (0/-1)
  */ 
 
-int peer_handshake(int sock, const torrent_t *tor, const uint8_t *my_peer_id, uint8_t *peer_id_out) {
+int peer_handshake(peer_connection_t *peer, const torrent_t *tor, const uint8_t *my_peer_id, uint8_t *peer_id_out) {
+    int sock = peer->sock;
     uint8_t hs_out[HANDSHAKE_SIZE];
     uint8_t hs_in[HANDSHAKE_SIZE];
 
     memset(hs_out, 0, sizeof(hs_out));
     hs_out[0] = BT_PROTOCOL_LEN;
     memcpy(hs_out + 1, BT_PROTOCOL, BT_PROTOCOL_LEN);
-    // 8 зарезервированных байт оставляем нулями (можно установить биты расширений позже)
+    // 8 зарезервированных байт: fast extension и поддержка v2, если у торрента есть merkle-хеши
+    hs_out[20 + RESERVED_FAST_BYTE] |= RESERVED_FAST_BIT;
+    if (torrent_has_v2(tor)) {
+        hs_out[20 + RESERVED_V2_BYTE] |= RESERVED_V2_BIT;
+    }
     memcpy(hs_out + 28, tor->info_hash, 20);
     memcpy(hs_out + 48, my_peer_id, 20);
 
@@ -47,6 +52,16 @@ int peer_handshake(int sock, const torrent_t *tor, const uint8_t *my_peer_id, ui
         memcpy(peer_id_out, hs_in + 48, 20);
     }
 
+    // fast extension включается, только если её поддерживают обе стороны
+    peer->fast = (hs_in[20 + RESERVED_FAST_BYTE] & RESERVED_FAST_BIT) != 0;
+    // hash request (BEP 52) отправляем только пиру, объявившему поддержку v2
+    peer->v2 = (hs_in[20 + RESERVED_V2_BYTE] & RESERVED_V2_BIT) != 0;
+    peer->num_pieces = tor->num_pieces;
+    // пока пир не прислал bitfield - нет информации, считаем, что куски есть
+    bitfield_free(&peer->have);
+    bitfield_init(&peer->have, tor->num_pieces);
+    bitfield_set_all(&peer->have);
+
     return 0;
 handshake_error:
     return -1;
@@ -61,6 +76,17 @@ int peer_send_interested(int sock) {
     return send_full_timeout(sock, msg, 5, PEER_SEND_TIMEOUT);
 }
 
+/**
+ * Отправляет have none (ID 15, BEP 6). При включённой fast extension пир обязан
+ * первым сообщением сообщить о своих кусках, у нас их нет.
+ * @param sock - сокет
+ * @return успех/ошибка (0/-1)
+ */
+int peer_send_have_none(int sock) {
+    uint8_t msg[] = {0,0,0,1, MSG_HAVE_NONE};
+    return send_full_timeout(sock, msg, 5, PEER_SEND_TIMEOUT);
+}
+
 /**
  * Запросить блок данных у пира. Сообщение request (ID 6).
  *
@@ -85,6 +111,74 @@ int peer_send_request(int sock, uint32_t index, uint32_t begin, uint32_t length)
     return send_full_timeout(sock, msg, 17, PEER_SEND_TIMEOUT);
 }
 
+/**
+ * Отправляет keep-alive: 4 нулевых байта длины без ID
+ *
+ * @param sock номер сокета
+ * @return успех/ошибка (0/-1)
+ */
+int peer_send_keepalive(int sock) {
+    uint8_t msg[4] = {0};
+    return send_full_timeout(sock, msg, 4, PEER_SEND_TIMEOUT);
+}
+
+/**
+ * Таймер keep-alive: мы ничего не отправляли PEER_KEEPALIVE_INTERVAL, без сообщения
+ * пир закроет соединение (ожидание unchoke может длиться долго)
+ */
+static void keepalive_expired(void *arg) {
+    peer_connection_t *peer = arg;
+    if (peer_send_keepalive(peer->sock) < 0) {
+        LOG_DEBUG("Failed to send keep-alive");
+        return;
+    }
+    metrics_add(&metrics.keepalives_sent, 1);
+    tw_schedule(peer->timers, &peer->keepalive, monotonic_ms(), PEER_KEEPALIVE_INTERVAL);
+}
+
+/**
+ * Таймер запроса: ответа на request нет дольше PEER_REQUEST_TIMEOUT
+ */
+static void request_expired(void *arg) {
+    peer_connection_t *peer = arg;
+    peer->request_expired = 1;
+    net_interrupt(peer->sock);
+}
+
+/**
+ * Взводит таймеры соединения. Вызывается после handshake, когда сокет уже обменивается сообщениями.
+ *
+ * @param *peer указатель на структуру с данными о пире
+ * @param *tw колесо цикла событий
+ */
+void peer_timers_start(peer_connection_t *peer, timer_wheel_t *tw) {
+    peer->timers = tw;
+    tw_timer_init(&peer->keepalive, keepalive_expired, peer);
+    tw_timer_init(&peer->request_timer, request_expired, peer);
+    tw_schedule(tw, &peer->keepalive, monotonic_ms(), PEER_KEEPALIVE_INTERVAL);
+}
+
+/**
+ * Отправляет request и взводит срок ответа. Отправка сдвигает keep-alive:
+ * пока идут запросы, отдельные keep-alive не нужны.
+ *
+ * @param *peer указатель на структуру с данными о пире
+ * @param index индекс куска
+ * @param begin смещение внутри куска
+ * @param length длина блока
+ * @return успех/ошибка (0/-1)
+ */
+int peer_request_block(peer_connection_t *peer, uint32_t index, uint32_t begin, uint32_t length) {
+    if (peer_send_request(peer->sock, index, begin, length) < 0) return -1;
+    if (peer->timers) {
+        double now = monotonic_ms();
+        peer->request_expired = 0;
+        tw_schedule(peer->timers, &peer->keepalive, now, PEER_KEEPALIVE_INTERVAL);
+        tw_schedule(peer->timers, &peer->request_timer, now, PEER_REQUEST_TIMEOUT);
+    }
+    return 0;
+}
+
 
 /**
  * Прочитать следующее сообщение от пира. Возвращает идентификатор сообщения и динамически выделенный буфер с payload (включая данные после ID). 
@@ -173,14 +267,96 @@ int peer_receive_piece(int sock, uint32_t expected_index, uint8_t *buffer, size_
     }
 }
 /**
- * Функция ожидания unchoke с обработкой промежуточных сообщений (bitfield, have и т.д.)
+ * Добавляет номер куска в список (allowed fast, suggest), пропуская дубликаты
+ *
+ * @param **list указатель на массив
+ * @param *count количество элементов
+ * @param index номер куска
+ */
+static void piece_list_add(uint32_t **list, size_t *count, uint32_t index) {
+    for (size_t i = 0; i < *count; i++) {
+        if ((*list)[i] == index) return;
+    }
+    *list = xrealloc(*list, (*count + 1) * sizeof(uint32_t));
+    (*list)[(*count)++] = index;
+}
+
+/**
+ * Обрабатывает служебные сообщения пира: choke, unchoke, have, bitfield
+ * и сообщения fast extension (have all/none, suggest, allowed fast).
+ * Сообщения piece и reject обрабатываются вызывающей функцией.
+ *
+ * @param *peer указатель на струкутуру с данными о пире
+ * @param msg_id идентификатор сообщения
+ * @param *payload данные сообщения
+ * @param payload_len длина данных
+ */
+void peer_process_message(peer_connection_t *peer, uint8_t msg_id, const uint8_t *payload, size_t payload_len) {
+    uint32_t index = 0;
+    if (payload_len >= 4) {
+        memcpy(&index, payload, 4);
+        index = ntohl(index);
+    }
+    switch (msg_id) {
+    case 0: // choke
+        peer->choked = 1;
+        if (metrics_peer(peer->metrics_slot)) atomic_store(&metrics_peer(peer->metrics_slot)->choked, 1);
+        LOG_DEBUG("Received choke");
+        break;
+    case 1: // unchoke
+        peer->choked = 0;
+        if (metrics_peer(peer->metrics_slot)) atomic_store(&metrics_peer(peer->metrics_slot)->choked, 0);
+        LOG_DEBUG("Received unchoke");
+        break;
+    case 4: // have
+        if (payload_len >= 4) {
+            if (index < peer->have.nbits) {
+                bitfield_set(&peer->have, index);
+            } else {
+                LOG_DEBUG("RECIEVED \"HAVE\" for a piece %u beyond current bitfield", index);
+            }
+        }
+        break;
+    case 5: // bitfield
+        bitfield_from_bytes(&peer->have, payload, payload_len);
+        LOG_DEBUG("Received bitfield (%zu bytes)", payload_len);
+        break;
+    case MSG_HAVE_ALL:
+        bitfield_set_all(&peer->have);
+        LOG_DEBUG("Received have all");
+        break;
+    case MSG_HAVE_NONE:
+        bitfield_clear_all(&peer->have);
+        LOG_DEBUG("Received have none");
+        break;
+    case MSG_SUGGEST_PIECE:
+        if (payload_len >= 4 && index < peer->num_pieces) {
+            piece_list_add(&peer->suggested, &peer->suggested_count, index);
+            LOG_DEBUG("Peer suggests piece %u", index);
+        }
+        break;
+    case MSG_ALLOWED_FAST:
+        if (payload_len >= 4 && index < peer->num_pieces) {
+            piece_list_add(&peer->allowed_fast, &peer->allowed_fast_count, index);
+            LOG_DEBUG("Piece %u is allowed fast", index);
+        }
+        break;
+    default:
+        LOG_DEBUG("Ignored message id %d", msg_id);
+        break;
+    }
+}
+
+/**
+ * Функция ожидания unchoke с обработкой промежуточных сообщений (bitfield, have и т.д.).
+ * С fast extension выходит раньше, если пир разрешил качать куски без unchoke (allowed fast).
  *
  * @param *peer указатель на струкутуру с данными о пире
  * @param timeout_ms таймаут
- * @return успех/ошибка (0/-1)
+ * @return 0 - unchoked, 1 - choked, но есть allowed fast куски, -1 - ошибка
  */
 int peer_wait_for_unchoke(peer_connection_t *peer, int timeout_ms) {
-    while (running && peer->choked) {
+    while (running && peer->choked && peer->allowed_fast_count == 0) {
         uint8_t msg_id;
         uint8_t *payload;
         size_t payload_len;
@@ -190,80 +366,34 @@ int peer_wait_for_unchoke(peer_connection_t *peer, int timeout_ms) {
             free(payload);
             continue;
         }
-        // Обработка различных сообщений
-        switch (msg_id) {
-        case 0: // choke
-            peer->choked = 1;
-            LOG_DEBUG("Received choke");
-            break;
-        case 1: // unchoke
-            peer->choked = 0;
-            LOG_DEBUG("Received unchoke");
-            break;
-        case 4: // have
-            if (payload_len >= 4) {
-                uint32_t index = ntohl(*(uint32_t*)payload);
-                if (peer->bitfield) {
-                    size_t byte = index / 8;
-                    if (byte < peer->bitfield_len) {
-                        peer->bitfield[byte] |= 1 << (7 - (index % 8));
-                    } else {
-                        // У пира появились новые данные, можно расширить битовое поле
-                        LOG_DEBUG("RECIEVED \"HAVE\" for a piece %u beyond current bitfield", index);
-                    }
-                }
-            }
-         break;
-        case 5: // bitfield
-            // Сохраняем битовое поле (копируем)
-            peer->bitfield = xmalloc(payload_len);
-            memcpy(peer->bitfield, payload, payload_len);
-            peer->bitfield_len = payload_len;
-            LOG_DEBUG("Received bitfield (%zu bytes)", payload_len);
-            break;
-        default:
-            LOG_DEBUG("Ignored message id %d", msg_id);
-            break;
-        }
+        peer_process_message(peer, msg_id, payload, payload_len);
         free(payload);
-        if (!peer->choked) break; // выходим, если мы больше не chocked 
     }
-    return peer->choked ? -1 : 0;
-}
-
-/**
- * Проверяет, есть ли у пира кусок с данным индексом. 
- * 
- * @param *peer указатель на структуру с данными о пире
- * @param index индекс куска данных
- * @return 1/0 есть/нет (бит из bitfield)
- */
-int peer_has_piece(peer_connection_t *peer, uint32_t index) {
-    if (!peer->bitfield) return 1; // нет информации - считаем, что есть
-    size_t byte = index / 8;
-    if (byte >= peer->bitfield_len) return 0;
-    return (peer->bitfield[byte] >> (7 - (index % 8))) & 1;
+    if (!peer->choked) return 0;
+    return (running && peer->allowed_fast_count > 0) ? 1 : -1;
 }
 
 /**
  * Ожидаетт и получает блок данных, соответствующий ранее отправленному request. 
- * Функция игнорирует сообщения других блоков и обрабатывает возможные choke.
+ * Функция игнорирует блоки других запросов и обрабатывает служебные сообщения.
+ * С fast extension пир явно отклоняет запрос (reject request), без неё - choke
+ * означает, что ответа не будет.
  *
- * @param sock номер сокета
+ * @param *peer указатель на структуру с данными о пире
  * @param expected_index ожидаемый индекс куска
  * @param expected_begin ожидаемое начало куска (смещение)
  * @param *buffer указатель на буфер для записи данных
  * @param length ожидаема длина данных
  * @param timeout_ms таймаут
- * @return успех/ошибка (0/-1)
+ * @return успех/ошибка/отказ (0/-1/PEER_BLOCK_REJECTED)
  */
-int peer_receive_block(int sock, uint32_t expected_index, uint32_t expected_begin, uint8_t *buffer, size_t length, int timeout_ms) {
+static int receive_block(peer_connection_t *peer, uint32_t expected_index, uint32_t expected_begin, uint8_t *buffer, size_t length, int timeout_ms) {
     uint8_t *payload;
     size_t payload_len;
     uint8_t msg_id;
 
     while (1) {
-        if (peer_read_message(sock, &msg_id, &payload, &payload_len, timeout_ms) < 0) {
+        if (peer_read_message(peer->sock, &msg_id, &payload, &payload_len, timeout_ms) < 0) {
             LOG_ERROR("Peer read message failed...");
             return -1;
         }
@@ -271,8 +401,8 @@ int peer_receive_block(int sock, uint32_t expected_index, uint32_t expected_begi
             free(payload);
             continue;
         }
-        if (msg_id == 7) { // piece
-            if (payload_len < 8) {
+        if (msg_id == 7 || msg_id == MSG_REJECT_REQUEST) { // piece / reject request
+            if (payload_len < 8 || (msg_id == MSG_REJECT_REQUEST && payload_len < 12)) {
                 free(payload);
                 return -1;
             }
@@ -281,8 +411,17 @@ int peer_receive_block(int sock, uint32_t expected_index, uint32_t expected_begi
             memcpy(&begin, payload + 4, 4);
             index = ntohl(index);
             begin = ntohl(begin);
-            size_t block_len = payload_len - 8;
 
+            if (msg_id == MSG_REJECT_REQUEST) {
+                free(payload);
+                if (index == expected_index && begin == expected_begin) {
+                    LOG_DEBUG("Peer rejected request %u:%u", index, begin);
+                    return PEER_BLOCK_REJECTED;
+                }
+                continue;
+            }
+
+            size_t block_len = payload_len - 8;
             if (index == expected_index && begin == expected_begin && block_len == length) {
                 memcpy(buffer, payload + 8, block_len);
                 free(payload);
@@ -294,26 +433,157 @@ int peer_receive_block(int sock, uint32_t expected_index, uint32_t expected_begi
                 // Продолжаем ждать нужный
             }
         } else {
-            LOG_DEBUG("Received msg_id=%d while waiting for block", msg_id);
-            // Обрабатываем другие сообщения: choke, unchoke, have, keep-alive
-            // Если получили choke — возможно, пир нас задушил, надо выйти с ошибкой
-            if (msg_id == 0) { // choke
+            peer_process_message(peer, msg_id, payload, payload_len);
+            free(payload);
+            // Без fast extension choke отменяет все запросы - ответа не будет.
+            // С fast extension пир пришлёт reject для каждого отброшенного запроса.
+            if (msg_id == 0 && !peer->fast) {
                 LOG_DEBUG("Received choke while waiting for block");
-                free(payload);
-                return -1; // Пир задушил, прерываем
+                return -1;
             }
-            LOG_DEBUG("Ignored message id %d while waiting for block", msg_id);
-            free(payload);
         }
     }
 }
 
+/**
+ * Ожидает блок (см. receive_block) со сроком ответа из peer_request_block:
+ * по истечении срока ожидание прерывается и соединение считается сломанным
+ *
+ * @return успех/ошибка/отказ (0/-1/PEER_BLOCK_REJECTED)
+ */
+int peer_receive_block(peer_connection_t *peer, uint32_t expected_index, uint32_t expected_begin, uint8_t *buffer, size_t length, int timeout_ms) {
+    int ret = receive_block(peer, expected_index, expected_begin, buffer, length, timeout_ms);
+    if (peer->timers) tw_cancel(peer->timers, &peer->request_timer);
+    if (ret == -1 && peer->request_expired) {
+        LOG_WARN("Request %u:%u timed out", expected_index, expected_begin);
+        metrics_add(&metrics.requests_timed_out, 1);
+    }
+    peer->request_expired = 0;
+    return ret;
+}
+
+/**
+ * Обновляет скользящие средние скорости и RTT после получения блока.
+ * Первый замер берётся как есть, дальше - EWMA с весом PEER_EWMA_ALPHA.
+ *
+ * @param *peer указатель на структуру с данными о пире
+ * @param len длина блока
+ * @param elapsed_ms время от отправки request до получения блока
+ */
+void peer_stats_block(peer_connection_t *peer, size_t len, double elapsed_ms) {
+    peer_stats_t *st = &peer->stats;
+    if (elapsed_ms < 0.001) elapsed_ms = 0.001;
+    double rate = len * 1000.0 / elapsed_ms;
+    if (st->blocks == 0) {
+        st->rate_ewma = rate;
+        st->rtt_ewma_ms = elapsed_ms;
+    } else {
+        st->rate_ewma += PEER_EWMA_ALPHA * (rate - st->rate_ewma);
+        st->rtt_ewma_ms += PEER_EWMA_ALPHA * (elapsed_ms - st->rtt_ewma_ms);
+    }
+    st->blocks++;
+    st->bytes_in += len;
+
+    metrics_peer_t *m = metrics_peer(peer->metrics_slot);
+    if (m) {
+        atomic_store_explicit(&m->rate, (uint64_t)st->rate_ewma, memory_order_relaxed);
+        atomic_store_explicit(&m->rtt_us, (uint64_t)(st->rtt_ewma_ms * 1000.0), memory_order_relaxed);
+    }
+}
+
 /**
  * Закрыть соединение с пиром
  * @param *peer указатель на структуру с данными о пире
  */
 void peer_close(peer_connection_t *peer) {
+    if (peer->timers) {
+        tw_cancel(peer->timers, &peer->keepalive);
+        tw_cancel(peer->timers, &peer->request_timer);
+    }
     if (peer->sock >= 0) close(peer->sock);
-    free(peer->bitfield);
+    bitfield_free(&peer->have);
+    free(peer->allowed_fast);
+    free(peer->suggested);
     memset(peer, 0, sizeof(*peer));
 }
+
+/**
+ * Запрашивает у пира хеши листьев куска (hash request, BEP 52) и ждёт ответ hashes.
+ * Полученные хеши проверяются по слою кусков из торрента, поэтому после успешного
+ * возврата по ним можно проверять каждый блок отдельно.
+ *
+ * @param *peer указатель на структуру с данными о пире
+ * @param *tor указатель на торрент (v2 или гибридный)
+ * @param index номер куска
+ * @param **leaves[out] хеши листьев (32 байта на блок), освобождает вызывающий
+ * @param timeout_ms таймаут
+ * @return количество хешей или -1 при ошибке/отказе пира
+ */
+int peer_request_leaf_hashes(peer_connection_t *peer, const torrent_t *tor, uint32_t index, uint8_t **leaves, int timeout_ms) {
+    int sock = peer->sock;
+    uint32_t k;
+    const file_t *f = piece_file(tor, index, &k);
+    if (!f || !f->has_root) return -1;
+
+    // лист = блок 16 KiB; запрашиваем поддерево куска (или всё дерево маленького файла)
+    uint32_t count, first;
+    if (f->layer_count == 0) {
+        count = merkle_width((f->length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+        first = 0;
+    } else {
+        count = tor->piece_length / MERKLE_BLOCK_SIZE;
+        first = k * count;
+    }
+    if (count < 2 || count > HASH_REQUEST_MAX) return -1; // лист и есть хеш куска или запрос слишком велик
+
+    uint8_t msg[4 + 1 + MERKLE_HASH_LEN + 16];
+    uint32_t v = htonl(sizeof(msg) - 4);
+    memcpy(msg, &v, 4);
+    msg[4] = MSG_HASH_REQUEST;
+    memcpy(msg + 5, f->pieces_root, MERKLE_HASH_LEN);
+    uint32_t fields[4] = { htonl(0), htonl(first), htonl(count), htonl(0) }; // base layer, index, length, proof layers
+    memcpy(msg + 5 + MERKLE_HASH_LEN, fields, sizeof(fields));
+    if (send_full_timeout(sock, msg, sizeof(msg), PEER_SEND_TIMEOUT) < 0) return -1;
+
+    while (running) {
+        uint8_t msg_id;
+        uint8_t *payload;
+        size_t payload_len;
+        if (peer_read_message(sock, &msg_id, &payload, &payload_len, timeout_ms) < 0) return -1;
+        if (msg_id == MSG_HASH_REJECT) {
+            LOG_DEBUG("Peer rejected hash request for piece %u", index);
+            free(payload);
+            return -1;
+        }
+        if (msg_id == 0xFF) { // keep-alive
+            continue;
+        }
+        if (msg_id != MSG_HASHES) {
+            peer_process_message(peer, msg_id, payload, payload_len);
+            free(payload);
+            continue;
+        }
+        if (payload_len < MERKLE_HASH_LEN + 16 || memcmp(payload, f->pieces_root, MERKLE_HASH_LEN) != 0) {
+            free(payload);
+            continue;
+        }
+        uint32_t hdr[4];
+        memcpy(hdr, payload + MERKLE_HASH_LEN, sizeof(hdr));
+        if (ntohl(hdr[0]) != 0 || ntohl(hdr[1]) != first || ntohl(hdr[2]) != count
+            || payload_len < MERKLE_HASH_LEN + 16 + (size_t)count * MERKLE_HASH_LEN) {
+            free(payload);
+            continue;
+        }
+        *leaves = xmalloc((size_t)count * MERKLE_HASH_LEN);
+        memcpy(*leaves, payload + MERKLE_HASH_LEN + 16, (size_t)count * MERKLE_HASH_LEN);
+        free(payload);
+        if (!verify_piece_leaves(tor, index, *leaves, count)) {
+            LOG_WARN("Peer sent hashes that do not match piece layer for piece %u", index);
+            free(*leaves);
+            *leaves = NULL;
+            return -1;
+        }
+        return (int)count;
+    }
+    return -1;
+}
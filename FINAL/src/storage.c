@@ -28,6 +28,130 @@ static int mkdir_p(const char *path) {
     return 0;
 }
 
+/**
+ * Строит путь к файлу торрента на диске: файл -o, либо путь внутри директории -O
+ * (без -O - относительно текущей директории)
+ *
+ * @param *cfg - указатель на конфигурацию
+ * @param *tf - файл торрента
+ * @return char* - путь (выделяется динамически, освобождает вызывающий)
+ */
+char *storage_file_path(const config_t *cfg, const file_t *tf) {
+    if (cfg->output_file) {
+        return strdup(cfg->output_file);
+    }
+    char full_path[PATH_LEN] = {0};
+    if (cfg->extract_dir) {
+        strncpy(full_path, cfg->extract_dir, sizeof(full_path) - 1);
+        strncat(full_path, "/", sizeof(full_path) - strlen(full_path) - 1);
+    }
+    // path_len - количество компонентов пути (directory, file name и т.д.)
+    for (size_t j = 0; j < tf->path_len; j++) {
+        strncat(full_path, tf->path[j], sizeof(full_path) - strlen(full_path) - 1);
+        if (j < tf->path_len - 1) {
+            strncat(full_path, "/", sizeof(full_path) - strlen(full_path) - 1);
+        }
+    }
+    return strdup(full_path);
+}
+
+/**
+ * Директория файла ("." для пути без '/')
+ *
+ * @param *path - путь к файлу
+ * @param *dir[out] - буфер на PATH_LEN байт
+ */
+static void parent_dir(const char *path, char *dir) {
+    snprintf(dir, PATH_LEN, "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) dir[1] = '\0';
+    else if (slash) *slash = '\0';
+    else snprintf(dir, PATH_LEN, ".");
+}
+
+/**
+ * Проверяет, хватит ли места под файлы до начала загрузки. Место считается по файловым
+ * системам (st_dev директорий), уже существующие файлы будут перезаписаны - их размер вычитается.
+ *
+ * @param *st - хранилище (созданы директории, заполнены full_path)
+ * @param *need_file - нужно ли место под файл (1 - файл создаётся целиком)
+ * @return 0 - места достаточно, -1 - нет
+ */
+static int check_free_space(const storage_t *st, const uint8_t *need_file) {
+    dev_t *devs = xcalloc(st->file_count ? st->file_count : 1, sizeof(dev_t));
+    uint64_t *need = xcalloc(st->file_count ? st->file_count : 1, sizeof(uint64_t));
+    size_t *first = xcalloc(st->file_count ? st->file_count : 1, sizeof(size_t));
+    size_t ndev = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < st->file_count; i++) {
+        const file_info_t *fi = &st->files[i];
+        if (!fi->full_path || !need_file[i]) continue;
+        struct stat sb;
+        uint64_t have = 0;
+        if (stat(fi->full_path, &sb) == 0) {
+            if (!S_ISREG(sb.st_mode)) continue; // -o /dev/null и т.п.
+            have = (uint64_t)sb.st_size;
+        }
+        char dir[PATH_LEN];
+        parent_dir(fi->full_path, dir);
+        if (stat(dir, &sb) != 0) continue;
+
+        size_t d = 0;
+        while (d < ndev && devs[d] != sb.st_dev) d++;
+        if (d == ndev) {
+            devs[ndev] = sb.st_dev;
+            first[ndev++] = i;
+        }
+        if (fi->length > have) need[d] += fi->length - have;
+    }
+
+    for (size_t d = 0; d < ndev && ret == 0; d++) {
+        char dir[PATH_LEN];
+        parent_dir(st->files[first[d]].full_path, dir);
+        struct statvfs vfs;
+        if (statvfs(dir, &vfs) != 0) continue;
+        uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+        if (need[d] > avail) {
+            LOG_ERROR("Not enough free space in %s: need %llu bytes, available %llu",
+                      dir, (unsigned long long)need[d], (unsigned long long)avail);
+            ret = -1;
+        }
+    }
+    free(devs);
+    free(need);
+    free(first);
+    return ret;
+}
+
+/**
+ * Выделяет место под открытый файл согласно режиму --alloc
+ *
+ * @param *fi - файл хранилища (fp открыт)
+ * @param mode - режим выделения
+ * @return 0 - успех, -1 - ошибка
+ */
+static int allocate_file(const file_info_t *fi, alloc_mode_t mode) {
+    int fd = fileno(fi->fp);
+    struct stat sb;
+    if (mode == ALLOC_NONE || !fi->length || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) return 0;
+    if (mode == ALLOC_SPARSE) {
+        // размер сразу итоговый, блоки выделяются при записи (дыры до прихода кусков)
+        if (ftruncate(fd, (off_t)fi->length) != 0) {
+            LOG_ERROR("Failed to resize %s: %s", fi->full_path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    // ALLOC_FULL: блоки резервируются заранее - файл меньше фрагментирован и ENOSPC невозможен при записи
+    int err = posix_fallocate(fd, 0, (off_t)fi->length);
+    if (err) {
+        LOG_ERROR("Failed to preallocate %s: %s", fi->full_path, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Создает и инициализирует объект хранилища 
  * 
@@ -47,6 +171,12 @@ storage_t *storage_open(const config_t *cfg, const torrent_t *tor) {
     st->piece_length = tor->piece_length;
     st->extract_dir = cfg->extract_dir; // может быть NULL
 
+    // Невыбранные (--files) файлы создаются, только если делят крайний кусок с выбранным:
+    // туда попадёт лишь часть этого куска
+    uint8_t *prio = xmalloc(tor->num_pieces ? tor->num_pieces : 1);
+    uint8_t *selected = xcalloc(tor->file_count ? tor->file_count : 1, 1);
+    torrent_piece_priorities(tor, prio);
+
     uint64_t current_offset = 0;
     for (size_t i = 0; i < tor->file_count; i++) {
         file_info_t *fi = &st->files[i];
@@ -54,24 +184,18 @@ storage_t *storage_open(const config_t *cfg, const torrent_t *tor) {
          // offset - конец предыдущего файла
         fi->offset = current_offset;
         fi->length = tf->length;
-
-        // Построение полного пути
-        // Используем динамический буфер
-        char full_path[PATH_LEN] = {0};
-        if (st->extract_dir) {
-            strncpy(full_path, st->extract_dir, sizeof(full_path) - 1);
-            strncat(full_path, "/", sizeof(full_path) - strlen(full_path) - 1);
-        }
-        // path_len - количество компонентов пути (directory, file name и т.д.)
-        for (size_t j = 0; j < tf->path_len; j++) {
-            strncat(full_path, tf->path[j], sizeof(full_path) - strlen(full_path) - 1);
-            if (j < tf->path_len - 1) {
-                strncat(full_path, "/", sizeof(full_path) - strlen(full_path) - 1);
-            }
+        current_offset += fi->length;
+        if (tf->is_pad) continue; // padding-файлы (BEP 47) не создаются, fp остаётся NULL
+        if (tf->priority == FILE_PRIO_SKIP) {
+            if (!fi->length) continue;
+            uint64_t first = fi->offset / st->piece_length;
+            uint64_t last = (current_offset - 1) / st->piece_length;
+            if ((first >= tor->num_pieces || !prio[first]) && (last >= tor->num_pieces || !prio[last])) continue;
+        } else {
+            selected[i] = 1;
         }
 
-        fi->full_path = xmalloc(strlen(full_path) + 1);
-        strcpy(fi->full_path, full_path);
+        fi->full_path = storage_file_path(cfg, tf);
 
         // Создаём директории для этого файла (если нужно)
         char *last_slash = strrchr(fi->full_path, '/');
@@ -81,23 +205,41 @@ storage_t *storage_open(const config_t *cfg, const torrent_t *tor) {
                 LOG_ERROR("Failed to create directory %s", fi->full_path);
                 // Восстанавливаем slash для дальнейшего использования
                 *last_slash = '/';
-                storage_close(st);
-                return NULL;
+                goto open_error;
             }
             *last_slash = '/';
         }
+    }
+
+    // Место проверяем до создания файлов: лучше отказать сразу, чем на середине загрузки
+    if (check_free_space(st, selected) != 0) goto open_error;
 
-        // Открываем файл на запись (создаём или перезаписываем)
-        fi->fp = fopen(fi->full_path, "wb");
+    for (size_t i = 0; i < st->file_count; i++) {
+        file_info_t *fi = &st->files[i];
+        if (!fi->full_path) continue;
+        // Выбранный файл перезаписывается, как раньше "wb" (O_TRUNC не действует на устройства и FIFO).
+        // Невыбранный открывается без O_TRUNC: он мог быть скачан раньше, в него пишется только крайний кусок
+        int fd = open(fi->full_path, O_RDWR | O_CREAT | (selected[i] ? O_TRUNC : 0), 0644);
+        if (fd >= 0) {
+            fi->fp = fdopen(fd, "r+b");
+            if (!fi->fp) close(fd);
+        }
         if (!fi->fp) {
             LOG_ERROR("Failed to open file %s: %s", fi->full_path, strerror(errno));
-            storage_close(st);
-            return NULL;
+            goto open_error;
         }
-
-        current_offset += fi->length;
+        // место под невыбранный файл не выделяем
+        if (selected[i] && allocate_file(fi, cfg->alloc_mode) != 0) goto open_error;
     }
+    free(prio);
+    free(selected);
     return st;
+
+open_error:
+    free(prio);
+    free(selected);
+    storage_close(st);
+    return NULL;
 }
 
 /**
@@ -114,6 +256,7 @@ void storage_write(storage_t *st, uint32_t piece_index, const uint8_t *data, uin
     // проходимся по всему массиву файлов
     for (size_t i = 0; i < st->file_count; i++) {
         file_info_t *fi = &st->files[i];
+        if (!fi->fp) continue; // padding или невыбранный файл
         uint64_t file_start = fi->offset;
         uint64_t file_end = fi->offset + fi->length;
 
@@ -0,0 +1,177 @@
+#include "swarm.h"
+
+/**
+ * Добавляет индекс кандидата в конец очереди
+ *
+ * @param *sw пул кандидатов
+ * @param cand индекс кандидата
+ */
+static void queue_push(swarm_t *sw, size_t cand) {
+    if (sw->queue_len == sw->queue_cap) {
+        size_t new_cap = sw->queue_cap ? sw->queue_cap * 2 : 16;
+        size_t *q = xmalloc(new_cap * sizeof(size_t));
+        for (size_t i = 0; i < sw->queue_len; i++) {
+            q[i] = sw->queue[(sw->queue_head + i) % sw->queue_cap];
+        }
+        free(sw->queue);
+        sw->queue = q;
+        sw->queue_cap = new_cap;
+        sw->queue_head = 0;
+    }
+    sw->queue[(sw->queue_head + sw->queue_len) % sw->queue_cap] = cand;
+    sw->queue_len++;
+}
+
+/**
+ * Сравнение для qsort
+ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Создаёт пул кандидатов: все пиры трекера в исходном порядке
+ *
+ * @param *peers массив пиров
+ * @param peer_count количество пиров
+ * @return swarm_t* - пул кандидатов
+ */
+swarm_t *swarm_create(const peer_t *peers, int peer_count) {
+    swarm_t *sw = xcalloc(1, sizeof(swarm_t));
+    sw->count = peer_count > 0 ? (size_t)peer_count : 0;
+    sw->cands = xcalloc(sw->count ? sw->count : 1, sizeof(candidate_t));
+    for (size_t i = 0; i < sw->count; i++) {
+        sw->cands[i].addr = peers[i];
+        queue_push(sw, i);
+    }
+    return sw;
+}
+
+/**
+ * Добавляет в пул пиров из повторного ответа трекера. Уже известные адреса
+ * (в том числе забаненные и исчерпавшие попытки) не добавляются.
+ *
+ * @param *sw пул кандидатов
+ * @param *peers массив пиров
+ * @param peer_count количество пиров
+ * @return количество новых кандидатов
+ */
+int swarm_add(swarm_t *sw, const peer_t *peers, int peer_count) {
+    int added = 0;
+    for (int i = 0; i < peer_count; i++) {
+        size_t k = 0;
+        while (k < sw->count && !peer_addr_equal(&sw->cands[k].addr, &peers[i])) k++;
+        if (k < sw->count) continue;
+        sw->cands = xrealloc(sw->cands, (sw->count + 1) * sizeof(candidate_t));
+        memset(&sw->cands[sw->count], 0, sizeof(candidate_t));
+        sw->cands[sw->count].addr = peers[i];
+        queue_push(sw, sw->count);
+        sw->count++;
+        added++;
+    }
+    return added;
+}
+
+/**
+ * Извлекает следующего кандидата, пропуская забаненных
+ *
+ * @param *sw пул кандидатов
+ * @return индекс кандидата или -1
+ */
+int swarm_next(swarm_t *sw) {
+    while (sw->queue_len > 0) {
+        size_t cand = sw->queue[sw->queue_head];
+        sw->queue_head = (sw->queue_head + 1) % sw->queue_cap;
+        sw->queue_len--;
+        if (sw->cands[cand].banned) continue;
+        sw->cands[cand].attempts++;
+        return (int)cand;
+    }
+    return -1;
+}
+
+/**
+ * Возвращает кандидата в конец очереди после паузы (неудачный connect); попытка не засчитывается
+ *
+ * @param *sw пул кандидатов
+ * @param cand индекс кандидата
+ */
+void swarm_retry(swarm_t *sw, int cand) {
+    if (cand < 0 || (size_t)cand >= sw->count) return;
+    if (sw->cands[cand].attempts > 0) sw->cands[cand].attempts--;
+    queue_push(sw, (size_t)cand);
+}
+
+/**
+ * Подводит итог соединения с кандидатом
+ *
+ * @param *sw пул кандидатов
+ * @param cand индекс кандидата
+ * @param *stats статистика соединения
+ * @param evicted 1 - пир вытеснен как медленный и может вернуться позже
+ */
+void swarm_release(swarm_t *sw, int cand, const peer_stats_t *stats, int evicted) {
+    if (cand < 0 || (size_t)cand >= sw->count) return;
+    candidate_t *c = &sw->cands[cand];
+    c->last_rate = stats->rate_ewma;
+
+    // в историю попадают только пиры с достаточным количеством замеров
+    if (stats->blocks >= SWARM_EVAL_MIN_BLOCKS) {
+        if (sw->rate_count == sw->rate_cap) {
+            sw->rate_cap = sw->rate_cap ? sw->rate_cap * 2 : 16;
+            sw->rates = xrealloc(sw->rates, sw->rate_cap * sizeof(double));
+        }
+        sw->rates[sw->rate_count++] = stats->rate_ewma;
+    }
+
+    if (swarm_should_ban(stats)) {
+        c->banned = 1;
+        return;
+    }
+    if (evicted && c->attempts < SWARM_MAX_ATTEMPTS) {
+        queue_push(sw, cand);
+    }
+}
+
+/**
+ * Сравнивает скорость пира с перцентилем скоростей предыдущих пиров
+ *
+ * @param *sw пул кандидатов
+ * @param *stats статистика текущего соединения
+ * @return 1 - пира стоит заменить, 0 - оставить
+ */
+int swarm_should_evict(const swarm_t *sw, const peer_stats_t *stats) {
+    if (stats->blocks < SWARM_EVAL_MIN_BLOCKS || sw->rate_count < SWARM_EVAL_MIN_SAMPLES) return 0;
+    if (sw->queue_len == 0 && sw->standby == 0) return 0; // заменить некем
+
+    double *sorted = xmalloc(sw->rate_count * sizeof(double));
+    memcpy(sorted, sw->rates, sw->rate_count * sizeof(double));
+    qsort(sorted, sw->rate_count, sizeof(double), cmp_double);
+    double threshold = sorted[(sw->rate_count - 1) * SWARM_EVICT_PERCENTILE / 100];
+    free(sorted);
+    return stats->rate_ewma < threshold;
+}
+
+/**
+ * Решает, банить ли пира
+ *
+ * @param *stats статистика соединения
+ * @return 1/0
+ */
+int swarm_should_ban(const peer_stats_t *stats) {
+    return stats->hash_fails >= SWARM_BAN_HASH_FAILS;
+}
+
+/**
+ * Освобождение пула кандидатов
+ *
+ * @param *sw пул кандидатов
+ */
+void swarm_free(swarm_t *sw) {
+    if (!sw) return;
+    free(sw->cands);
+    free(sw->queue);
+    free(sw->rates);
+    free(sw);
+}
@@ -1,5 +1,13 @@
 #include "tar.h"
 
+#ifdef __linux__
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031 // из <linux/fcntl.h>, без _GNU_SOURCE не объявлен
+#endif
+#endif
+
+static const uint8_t zero_block[TAR_BLOCK_SIZE * 2];
+
 /**
  * Запись значения в восьмеричную строку с завершающим нулём и пробелом (utar)
  *
@@ -8,13 +16,79 @@
  * @param size - размер буфера
  * */
 static void oct_to_str(uint64_t val, char *buf, int size) {
-    char fmt[16];
-    snprintf(fmt, sizeof(fmt), "%%0%do ", size - 2); // например, "%011o " для size=12
-    snprintf(buf, size, fmt, (unsigned int)val);
+    char fmt[24];
+    snprintf(fmt, sizeof(fmt), "%%0%dllo ", size - 2); // например, "%011llo " для size=12
+    snprintf(buf, size, fmt, (unsigned long long)val);
+}
+
+/**
+ * Запись размера в поле size: восьмерично, а если не помещается - в base-256
+ * (расширение GNU: старший бит первого байта, дальше число big-endian)
+ *
+ * @param val - размер
+ * @param *buf - поле size
+ * @param size - длина поля
+ */
+static void size_to_field(uint64_t val, char *buf, int size) {
+    if (val <= TAR_MAX_OCTAL_SIZE) {
+        oct_to_str(val, buf, size);
+        return;
+    }
+    memset(buf, 0, size);
+    for (int i = size - 1; i > 0 && val; i--) {
+        buf[i] = (char)(val & 0xff);
+        val >>= 8;
+    }
+    buf[0] = (char)0x80;
+}
+
+/**
+ * Добавляет запись PAX "<длина> <ключ>=<значение>\n"; длина включает собственные цифры
+ *
+ * @param *out - буфер
+ * @param used - уже занято в буфере
+ * @param cap - размер буфера
+ * @param *key - ключ
+ * @param *value - значение
+ * @return новая занятая длина (cap, если не поместилось)
+ */
+static size_t pax_record(char *out, size_t used, size_t cap, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3; // пробел, '=', '\n'
+    size_t len = base + 1;
+    while (snprintf(NULL, 0, "%zu", len) + base != len) len++;
+    if (used + len >= cap) return cap;
+    snprintf(out + used, cap - used, "%zu %s=%s\n", len, key, value);
+    return used + len;
+}
+
+/**
+ * Делит путь на поля prefix и name ustar
+ *
+ * @param *path - полный путь
+ * @param *hdr - заголовок
+ * @return 1 - путь помещается, 0 - нужна PAX-запись
+ */
+static int split_ustar_path(const char *path, tar_header_t *hdr) {
+    size_t len = strlen(path);
+    if (len <= sizeof(hdr->name)) {
+        memcpy(hdr->name, path, len); // без завершающего нуля, если ровно 100 символов
+        return 1;
+    }
+    // ищем '/' так, чтобы prefix <= 155, а имя <= 100 и не пустое
+    for (size_t i = len - 1; i > 0; i--) {
+        if (path[i] != '/') continue;
+        if (len - i - 1 > sizeof(hdr->name)) break;
+        if (i <= sizeof(hdr->prefix) && len - i - 1 > 0) {
+            memcpy(hdr->prefix, path, i);
+            memcpy(hdr->name, path + i + 1, len - i - 1);
+            return 1;
+        }
+    }
+    return 0;
 }
 
-/** 
- * Вычисление контрольной суммы заголовка 
+/**
+ * Вычисление контрольной суммы заголовка
  *
  * @param *hdr - указатель на заголовок tar_header_t
  * @return - контрольная сумма
@@ -28,126 +102,278 @@ static unsigned int calculate_checksum(const tar_header_t *hdr) {
     return sum;
 }
 
-/** 
- * Запись заголовка для файла с именем path и размером size 
- * 
- * @param *tw - указатель на объект tar_writer_t
+/**
+ * Заполнение контрольной суммы и копирование заголовка в буфер
+ *
+ * @param *hdr - заголовок (поле chksum перезаписывается)
+ * @param *out - буфер на TAR_BLOCK_SIZE байт
+ */
+static void finish_header(tar_header_t *hdr, uint8_t *out) {
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    unsigned int chksum = calculate_checksum(hdr);
+    oct_to_str(chksum, hdr->chksum, sizeof(hdr->chksum));
+    memcpy(out, hdr, TAR_BLOCK_SIZE);
+}
+
+/**
+ * Заполнение общих полей заголовка
+ */
+static void init_header(tar_header_t *hdr, uint64_t size, time_t mtime, char typeflag) {
+    memset(hdr, 0, sizeof(*hdr));
+    oct_to_str(0644, hdr->mode, sizeof(hdr->mode));
+    oct_to_str(0, hdr->uid, sizeof(hdr->uid));
+    oct_to_str(0, hdr->gid, sizeof(hdr->gid));
+    size_to_field(size, hdr->size, sizeof(hdr->size));
+    oct_to_str(mtime, hdr->mtime, sizeof(hdr->mtime));
+    hdr->typeflag = typeflag;
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+}
+
+/**
+ * Формирование заголовка для файла с именем path и размером size.
+ * Если путь не помещается в name/prefix или размер не помещается в 11 восьмеричных
+ * цифр, перед ustar-заголовком выводится расширенный заголовок PAX (typeflag 'x')
+ * с записями path и size - архив остаётся потоковым, без возврата назад.
+ *
+ * @param *e - файл архива (заполняются header и header_len)
  * @param *path - полный путь
  * @param size - размер
+ * @param mtime - время модификации
  * */
-static void write_header(tar_writer_t *tw, const char *path, uint64_t size) {
+static void build_header(tar_entry_t *e, const char *path, uint64_t size, time_t mtime) {
     tar_header_t hdr;
-    memset(&hdr, 0, sizeof(hdr));
+    init_header(&hdr, size, mtime, '0');
+    int path_fits = split_ustar_path(path, &hdr);
 
-    size_t len = strlen(path);
-    if (len < sizeof(hdr.name)) {
-        strcpy(hdr.name, path);
-    } else {
-        memcpy(hdr.name, path, sizeof(hdr.name) - 1);
+    char pax[TAR_PATH_MAX + 64];
+    size_t pax_len = 0;
+    if (!path_fits) {
+        pax_len = pax_record(pax, pax_len, sizeof(pax), "path", path);
+        memcpy(hdr.name, path, sizeof(hdr.name)); // для читателей без PAX - обрезанное имя
+    }
+    if (size > TAR_MAX_OCTAL_SIZE) {
+        char num[24];
+        snprintf(num, sizeof(num), "%llu", (unsigned long long)size);
+        pax_len = pax_record(pax, pax_len, sizeof(pax), "size", num);
     }
 
-    oct_to_str(0644, hdr.mode, sizeof(hdr.mode));
-    oct_to_str(0, hdr.uid, sizeof(hdr.uid));
-    oct_to_str(0, hdr.gid, sizeof(hdr.gid));
-    oct_to_str(size, hdr.size, sizeof(hdr.size));
-    oct_to_str(time(NULL), hdr.mtime, sizeof(hdr.mtime));
-    hdr.typeflag = '0';
-    memcpy(hdr.magic, "ustar", 6);
-    memcpy(hdr.version, "00", 2);
-    memset(hdr.chksum, ' ', sizeof(hdr.chksum));
-    unsigned int chksum = calculate_checksum(&hdr);
-    oct_to_str(chksum, hdr.chksum, sizeof(hdr.chksum));
+    size_t pax_blocks = (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+    e->header_len = (pax_len ? 1 + pax_blocks + 1 : 1) * TAR_BLOCK_SIZE;
+    e->header = xcalloc(1, e->header_len);
+    uint8_t *out = e->header;
+    if (pax_len) {
+        tar_header_t x;
+        init_header(&x, pax_len, mtime, 'x');
+        // имя расширенного заголовка - по соглашению PaxHeaders/<имя файла>
+        const char *base = strrchr(path, '/');
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%.80s", base ? base + 1 : path);
+        finish_header(&x, out);
+        memcpy(out + TAR_BLOCK_SIZE, pax, pax_len);
+        out += (1 + pax_blocks) * TAR_BLOCK_SIZE;
+    }
+    finish_header(&hdr, out);
+}
+
+/**
+ * Выводит накопленную пачку iovec одним или несколькими writev
+ * (с дозаписью после частичной записи)
+ *
+ * @param *tw - указатель на объект tar_writer_t
+ */
+static void flush_iov(tar_writer_t *tw) {
+    struct iovec *iov = tw->iov;
+    int count = tw->iov_count;
+    tw->iov_count = 0;
+    while (count > 0 && !tw->failed) {
+        ssize_t n = writev(tw->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) { // stdout может оказаться неблокирующим
+                struct pollfd pfd = { .fd = tw->fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            LOG_ERROR("Failed to write tar stream: %s", strerror(errno));
+            tw->failed = 1;
+            running = 0; // писать больше некуда - останавливаем загрузку
+            return;
+        }
+        tw->total_written += (uint64_t)n;
+        // пропускаем полностью записанные iovec, остаток первого недописанного сдвигаем
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
 
-    fwrite(&hdr, TAR_BLOCK_SIZE, 1, tw->out);
-    tw->total_written += TAR_BLOCK_SIZE;
+/**
+ * Добавляет фрагмент в пачку (данные должны жить до flush_iov)
+ *
+ * @param *tw - указатель на объект tar_writer_t
+ * @param *data - данные
+ * @param len - длина
+ */
+static void push_iov(tar_writer_t *tw, const void *data, size_t len) {
+    if (len == 0) return;
+    if (tw->iov_count == TAR_IOV_MAX) flush_iov(tw);
+    tw->iov[tw->iov_count].iov_base = (void*)data;
+    tw->iov[tw->iov_count].iov_len = len;
+    tw->iov_count++;
 }
 
 /**
- * Добавляет паддинг до следующей границы 512 байт, если необходимо
+ * Пропускает куски, которые не будут скачаны (только невыбранные файлы или padding):
+ * их не нужно ждать, чтобы продолжить поток
  *
- * @param *tw -указатель на объект tar_writer_t
+ * @param tw - указатель на структуру tar_writer
  */
-static void write_padding(tar_writer_t *tw) {
-    uint64_t mod = tw->total_written % TAR_BLOCK_SIZE;
-    if (mod != 0) {
-        size_t pad = TAR_BLOCK_SIZE - mod;
-        uint8_t zeros[512] = {0};
-        fwrite(zeros, 1, pad, tw->out); //tw->out указатель на выходной поток (файл)
-        tw->total_written += pad;
+static void skip_unwanted(tar_writer_t *tw) {
+    while (tw->next_piece < tw->tor->num_pieces && tw->piece_prio[tw->next_piece] == FILE_PRIO_SKIP) {
+        tw->next_piece++;
     }
 }
 
 /**
- * Создает и заполняет структуру для формирования отслеживания файлов tar- архива
+ * Создает и заполняет структуру для формирования отслеживания файлов tar- архива.
+ * Заголовки всех файлов формируются здесь, при записи данных они только выводятся.
  *
  * @param *out - укзатель на поток вывода
  * @param *tor - указатель на структуру описывающую torrent
  * @return tar_writer_t * - возвращает указатель на структуру для работы с tar-архивом
  */
 tar_writer_t *tar_writer_open(FILE *out, const torrent_t *tor) {
-    tar_writer_t *tw = xmalloc(sizeof(tar_writer_t));
-    memset(tw, 0, sizeof(*tw));
-    tw->out = out;
+    tar_writer_t *tw = xcalloc(1, sizeof(tar_writer_t));
+    fflush(out); // дальше пишем в дескриптор напрямую, минуя буфер stdio
+    tw->fd = fileno(out);
     tw->tor = tor;
-    tw->current_file_index = -1;
+    tw->entries = xcalloc(tor->file_count ? tor->file_count : 1, sizeof(tar_entry_t));
+    tw->pending = xcalloc(tor->num_pieces ? tor->num_pieces : 1, sizeof(uint8_t*));
+    tw->pending_len = xcalloc(tor->num_pieces ? tor->num_pieces : 1, sizeof(uint32_t));
+    tw->piece_prio = xmalloc(tor->num_pieces ? tor->num_pieces : 1);
+    torrent_piece_priorities(tor, tw->piece_prio);
+    skip_unwanted(tw);
+
+    time_t now = time(NULL);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < tor->file_count; i++) {
+        const file_t *f = &tor->files[i];
+        tar_entry_t *e = &tw->entries[i];
+        e->offset = offset;
+        e->length = f->length;
+        e->skip = f->is_pad || f->priority == FILE_PRIO_SKIP;
+        offset += f->length;
+        if (e->skip) continue;
+
+        char full_path[TAR_PATH_MAX] = {0};
+        size_t used = 0;
+        for (size_t k = 0; k < f->path_len && used < sizeof(full_path) - 1; k++) {
+            used += snprintf(full_path + used, sizeof(full_path) - used, k ? "/%s" : "%s", f->path[k]);
+        }
+        build_header(e, full_path, f->length, now);
+    }
+
+#ifdef F_SETPIPE_SZ
+    // больший буфер канала - меньше переключений между нами и читателем (tar x)
+    struct stat sb;
+    if (fstat(tw->fd, &sb) == 0 && S_ISFIFO(sb.st_mode)) {
+        fcntl(tw->fd, F_SETPIPE_SZ, TAR_PIPE_SIZE);
+    }
+#endif
     return tw;
 }
 
 /**
- * Записывает блок данных в поток
+ * Выводит кусок, следующий по порядку: заголовки начинающихся в нём файлов,
+ * данные и выравнивание закончившихся - одной пачкой
  *
- * @param tw - указатель на структуру tar_writer (отслеживает сколько осталось записать, интекс текущего файла и тд.)
- * @param piece_index - номер блока
- * @param *data - указатель на данные блока
- * @param len - длина блока
+ * @param tw - указатель на структуру tar_writer
+ * @param piece_index - номер куска
+ * @param *data - указатель на данные куска
+ * @param len - длина куска
  */
-void tar_writer_write(tar_writer_t *tw, uint32_t piece_index, const uint8_t *data, uint32_t len) {
+static void emit_piece(tar_writer_t *tw, uint32_t piece_index, const uint8_t *data, uint32_t len) {
     uint64_t piece_start = (uint64_t)piece_index * tw->tor->piece_length;
     uint64_t piece_end = piece_start + len;
 
-    uint64_t file_global_offset = 0;
-    //Проходим по всему спику файлов
-    for (size_t i = 0; i < tw->tor->file_count; i++) {
-        //сохраняем указатель на текущее описание файла (путь, размер и т.д.)
-        const file_t *f = &tw->tor->files[i];
-        uint64_t file_start = file_global_offset;
-        uint64_t file_end = file_start + f->length;
-
-        uint64_t overlap_start = piece_start > file_start ? piece_start : file_start;
-        uint64_t overlap_end = piece_end < file_end ? piece_end : file_end;
-
-        if (overlap_start < overlap_end) {
-            uint64_t offset_in_file = overlap_start - file_start;
-            uint64_t offset_in_piece = overlap_start - piece_start;
-            size_t bytes = overlap_end - overlap_start;
-
-            // Если перешли к новому файлу
-            if ((int)i != tw->current_file_index) {
-                // Записываем заголовок нового файла
-                char full_path[4096] = {0};
-                for (size_t k = 0; k < f->path_len; k++) {
-                    strcat(full_path, f->path[k]);
-                    if (k < f->path_len - 1) strcat(full_path, "/");
-                }
-                write_header(tw, full_path, f->length);
-                tw->current_file_index = i;
-                tw->file_bytes_written = 0;
-            }
-
-            // Пишем данные (без выравнивания)
-            fwrite(data + offset_in_piece, 1, bytes, tw->out);
-            tw->total_written += bytes;
-            tw->file_bytes_written += bytes;
+    while (tw->current_file_index < tw->tor->file_count) {
+        tar_entry_t *e = &tw->entries[tw->current_file_index];
+        uint64_t file_end = e->offset + e->length;
+        // пустые файлы выводятся, когда поток доходит до их смещения
+        if (e->offset > piece_end || (e->offset == piece_end && e->length > 0)) break;
 
-            // Если это последний фрагмент текущего файла (достигнут конец файла)
-            if (offset_in_file + bytes == f->length) {
-                write_padding(tw); // выравниваем до 512 после файла
-                // Файл завершён, но current_file_index остаётся прежним до следующего переключения
-            }
+        if (!e->skip && !tw->header_written) {
+            push_iov(tw, e->header, e->header_len);
+            tw->header_written = 1;
+        }
+        uint64_t from = piece_start > e->offset ? piece_start : e->offset;
+        uint64_t to = piece_end < file_end ? piece_end : file_end;
+        if (!e->skip && to > from) {
+            push_iov(tw, data + (from - piece_start), to - from);
         }
+        if (to < file_end) break; // файл продолжается в следующем куске
 
-        file_global_offset += f->length;
+        // файл закончился: выравнивание до 512
+        if (!e->skip) push_iov(tw, zero_block, (TAR_BLOCK_SIZE - e->length % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+        tw->current_file_index++;
+        tw->header_written = 0;
     }
+    flush_iov(tw);
+}
+
+/**
+ * Записывает блок данных в поток. Архив пишется строго по порядку кусков,
+ * поэтому кусок не по очереди сохраняется до прихода предыдущих.
+ *
+ * @param tw - указатель на структуру tar_writer (отслеживает сколько осталось записать, интекс текущего файла и тд.)
+ * @param piece_index - номер блока
+ * @param *data - указатель на данные блока
+ * @param len - длина блока
+ */
+void tar_writer_write(tar_writer_t *tw, uint32_t piece_index, const uint8_t *data, uint32_t len) {
+    if (tw->failed || piece_index >= tw->tor->num_pieces) return;
+    if (piece_index != tw->next_piece) {
+        if (piece_index < tw->next_piece || tw->pending[piece_index]) return; // уже выведен
+        tw->pending[piece_index] = xmalloc(len);
+        memcpy(tw->pending[piece_index], data, len);
+        tw->pending_len[piece_index] = len;
+        tw->pending_count++;
+        LOG_DEBUG("Tar: piece %u held until piece %u arrives", piece_index, tw->next_piece);
+        return;
+    }
+
+    emit_piece(tw, piece_index, data, len);
+    tw->next_piece++;
+    skip_unwanted(tw);
+    // выводим накопившиеся следующие куски
+    while (tw->next_piece < tw->tor->num_pieces && tw->pending[tw->next_piece]) {
+        uint32_t i = tw->next_piece++;
+        emit_piece(tw, i, tw->pending[i], tw->pending_len[i]);
+        free(tw->pending[i]);
+        tw->pending[i] = NULL;
+        tw->pending_count--;
+        skip_unwanted(tw);
+    }
+}
+
+/**
+ * Окно кусков, которые можно скачивать, не превышая TAR_PENDING_MAX ожидающих в памяти
+ *
+ * @param *tw - указатель на структуру tar_writer
+ * @param *first[out] - следующий кусок по порядку потока
+ * @return номер первого куска за окном
+ */
+uint32_t tar_writer_window(const tar_writer_t *tw, uint32_t *first) {
+    uint64_t span = TAR_PENDING_MAX / tw->tor->piece_length;
+    uint64_t end = (uint64_t)tw->next_piece + (span ? span : 1);
+    *first = tw->next_piece;
+    return end < tw->tor->num_pieces ? (uint32_t)end : tw->tor->num_pieces;
 }
 
 /**
@@ -158,20 +384,23 @@ void tar_writer_write(tar_writer_t *tw, uint32_t piece_index, const uint8_t *dat
 void tar_writer_close(tar_writer_t *tw) {
     if (!tw) return;
 
-    // Если последний файл не был завершён 
-    if (tw->current_file_index >= 0) {
-        // Проверяем, нужно ли добавить паддинг для последнего файла
-        // (если он не был добавлен ранее)
-        const file_t *f = &tw->tor->files[tw->current_file_index];
-        if (tw->file_bytes_written < f->length) {
-            // Файл не завершён, добавим паддинг от текущей позиции
-            write_padding(tw);
-        }
+    if (tw->pending_count > 0) {
+        LOG_WARN("Tar: %zu piece(s) never written, piece %u is missing", tw->pending_count, tw->next_piece);
+    }
+    // Если последний файл не был завершён, выравниваем от текущей позиции
+    if (tw->header_written) {
+        push_iov(tw, zero_block, (TAR_BLOCK_SIZE - tw->total_written % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
     }
 
     // Два нулевых блока в конце архива
-    uint8_t zeros[1024] = {0};
-    fwrite(zeros, 1, 1024, tw->out);
-    fflush(tw->out);
+    push_iov(tw, zero_block, sizeof(zero_block));
+    flush_iov(tw);
+
+    for (uint32_t i = 0; i < tw->tor->num_pieces; i++) free(tw->pending[i]);
+    free(tw->pending);
+    free(tw->pending_len);
+    free(tw->piece_prio);
+    for (size_t i = 0; i < tw->tor->file_count; i++) free(tw->entries[i].header);
+    free(tw->entries);
     free(tw);
 }
@@ -0,0 +1,176 @@
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_MAX_DELTA ((UINT64_C(1) << (TW_BITS * TW_LEVELS)) - 1) // дальше - раскладывается повторно
+
+static void list_unlink(tw_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+static void list_append(tw_timer_t *head, tw_timer_t *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/**
+ * Кладёт таймер в слот по расстоянию от текущего тика до срока: уровень l хранит
+ * таймеры, до которых меньше TW_SLOTS^(l+1) тиков
+ *
+ * @param *tw колесо
+ * @param *t таймер (expires заполнен, не взведён)
+ */
+static void place(timer_wheel_t *tw, tw_timer_t *t) {
+    uint64_t expires = t->expires > tw->tick ? t->expires : tw->tick; // просроченный - в текущий слот
+    uint64_t delta = expires - tw->tick;
+    if (delta > TW_MAX_DELTA) {
+        delta = TW_MAX_DELTA;
+        expires = tw->tick + delta;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (UINT64_C(1) << (TW_BITS * (level + 1)))) level++;
+    list_append(&tw->slots[level][(expires >> (TW_BITS * level)) & TW_MASK], t);
+}
+
+/**
+ * Создаёт пустое колесо
+ *
+ * @param *tw колесо
+ * @param now_ms текущее время (monotonic_ms)
+ */
+void tw_init(timer_wheel_t *tw, double now_ms) {
+    for (int l = 0; l < TW_LEVELS; l++) {
+        for (int i = 0; i < TW_SLOTS; i++) {
+            tw->slots[l][i].next = tw->slots[l][i].prev = &tw->slots[l][i];
+        }
+    }
+    tw->tick = 0;
+    tw->start_ms = now_ms;
+    tw->count = 0;
+}
+
+void tw_timer_init(tw_timer_t *t, tw_callback_t cb, void *arg) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->arg = arg;
+}
+
+/**
+ * Взводит таймер; уже взведённый таймер переносится на новый срок.
+ * Срок округляется вверх до тика: таймер не срабатывает раньше времени.
+ *
+ * @param *tw колесо
+ * @param *t таймер
+ * @param now_ms текущее время
+ * @param delay_ms задержка
+ */
+void tw_schedule(timer_wheel_t *tw, tw_timer_t *t, double now_ms, double delay_ms) {
+    if (tw_armed(t)) tw_cancel(tw, t);
+    double rel = now_ms + delay_ms - tw->start_ms;
+    uint64_t expires = rel > 0 ? (uint64_t)((rel + TW_TICK_MS - 1) / TW_TICK_MS) : 0;
+    if (expires <= tw->tick) expires = tw->tick + 1; // срок уже прошёл - ближайший тик
+    t->expires = expires;
+    place(tw, t);
+    tw->count++;
+}
+
+void tw_cancel(timer_wheel_t *tw, tw_timer_t *t) {
+    if (!tw_armed(t)) return;
+    list_unlink(t);
+    tw->count--;
+}
+
+/**
+ * Раскладывает слот старшего уровня по младшим относительно текущего тика
+ *
+ * @param *tw колесо
+ * @param level уровень
+ * @param slot номер слота
+ */
+static void cascade(timer_wheel_t *tw, int level, size_t slot) {
+    tw_timer_t *head = &tw->slots[level][slot];
+    tw_timer_t moved;
+    moved.next = moved.prev = &moved;
+    while (head->next != head) {
+        tw_timer_t *t = head->next;
+        list_unlink(t);
+        list_append(&moved, t);
+    }
+    while (moved.next != &moved) {
+        tw_timer_t *t = moved.next;
+        list_unlink(t);
+        place(tw, t);
+    }
+}
+
+/**
+ * Проходит тики от последнего обработанного до текущего: на границе оборота
+ * младшего кольца раскладывает слоты старших, затем снимает наступившие таймеры
+ * слота уровня 0 во временный список и вызывает обработчики. Обработчик может
+ * взвести таймер заново, в том числе свой.
+ *
+ * @param *tw колесо
+ * @param now_ms текущее время
+ * @return количество сработавших таймеров
+ */
+int tw_advance(timer_wheel_t *tw, double now_ms) {
+    // последний полностью прошедший тик
+    uint64_t now = now_ms > tw->start_ms ? (uint64_t)((now_ms - tw->start_ms) / TW_TICK_MS) : 0;
+    int n = 0;
+    while (tw->tick < now) {
+        uint64_t t = ++tw->tick;
+        for (int l = TW_LEVELS - 1; l > 0; l--) {
+            if ((t & ((UINT64_C(1) << (TW_BITS * l)) - 1)) == 0) {
+                cascade(tw, l, (t >> (TW_BITS * l)) & TW_MASK);
+            }
+        }
+        tw_timer_t *head = &tw->slots[0][t & TW_MASK];
+        if (head->next == head) continue;
+
+        tw_timer_t fired;
+        fired.next = fired.prev = &fired;
+        for (tw_timer_t *x = head->next, *next; x != head; x = next) {
+            next = x->next;
+            if (x->expires > t) continue;
+            list_unlink(x);
+            list_append(&fired, x);
+            tw->count--;
+        }
+        while (fired.next != &fired) {
+            tw_timer_t *x = fired.next;
+            list_unlink(x);
+            x->cb(x->arg);
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Оценивает время до ближайшего таймера: следующий непустой слот уровня 0 в пределах
+ * оборота, иначе - граница оборота, на которой старший уровень будет разложен
+ * (раннее пробуждение, но не пропуск)
+ *
+ * @param *tw колесо
+ * @param now_ms текущее время
+ * @param max_ms верхняя граница ожидания (-1 - без границы)
+ * @return мс ожидания, -1 - таймеров нет и граница не задана
+ */
+int tw_next_timeout(const timer_wheel_t *tw, double now_ms, int max_ms) {
+    if (!tw->count) return max_ms;
+    uint64_t next = (tw->tick | TW_MASK) + 1; // ближайший каскад
+    for (uint64_t t = tw->tick + 1; t < next; t++) {
+        const tw_timer_t *head = &tw->slots[0][t & TW_MASK];
+        if (head->next != head) {
+            next = t;
+            break;
+        }
+    }
+    double wait = tw->start_ms + (double)next * TW_TICK_MS - now_ms;
+    int ms = wait > 0 ? (int)wait + 1 : 0;
+    return max_ms >= 0 && ms > max_ms ? max_ms : ms;
+}
@@ -5,6 +5,10 @@
 #include <string.h>
 #include <openssl/sha.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <fnmatch.h>
+
+#define V2_MAX_TREE_DEPTH 64 // ограничение глубины дерева файлов v2
 
 /**
  * Вспомогательная функция для освобождения массива строк
@@ -26,6 +30,7 @@ static void free_str_array(char **arr, size_t len) {
 static void free_file(file_t *f) {
     if (!f) return;
     free_str_array(f->path, f->path_len);
+    free(f->piece_layer);
 }
 
 /**
@@ -80,6 +85,224 @@ static char **parse_path_list(const ben_obj_t *list, size_t *out_len) {
     *out_len = count;
     return path;
 }
+
+/**
+ * Проверяет атрибуты файла (BEP 47): "p" - padding-файл
+ *
+ * @param *file_dict словарь файла
+ * @return 1 - padding-файл, 0 - обычный
+ */
+static int is_pad_file(const ben_obj_t *file_dict) {
+    ben_obj_t *attr = bencode_dict_get(file_dict, "attr");
+    size_t len;
+    const uint8_t *data = bencode_string_data(attr, &len);
+    return data && memchr(data, 'p', len) != NULL;
+}
+
+/**
+ * Сравнение путей двух файлов
+ *
+ * @param *a первый файл
+ * @param *b второй файл
+ * @return 1 - пути совпадают, 0 - различаются
+ */
+static int same_path(const file_t *a, const file_t *b) {
+    if (a->path_len != b->path_len) return 0;
+    for (size_t i = 0; i < a->path_len; i++) {
+        if (strcmp(a->path[i], b->path[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Добавляет файл в динамический массив
+ *
+ * @param **files указатель на массив
+ * @param *count количество элементов
+ * @param *cap ёмкость массива
+ * @return указатель на новый (обнулённый) элемент
+ */
+static file_t *push_file(file_t **files, size_t *count, size_t *cap) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *files = xrealloc(*files, *cap * sizeof(file_t));
+    }
+    file_t *f = &(*files)[(*count)++];
+    memset(f, 0, sizeof(*f));
+    return f;
+}
+
+/**
+ * Рекурсивный обход дерева файлов v2 (BEP 52). Лист - ключ "" со словарём {length, pieces root},
+ * путь к листу - последовательность ключей от корня.
+ *
+ * @param *node текущий узел (словарь)
+ * @param **prefix компоненты пути до текущего узла
+ * @param depth глубина (количество компонентов в prefix)
+ * @param **files массив найденных файлов
+ * @param *count количество файлов
+ * @param *cap ёмкость массива
+ * @return успех/ошибка (0/-1)
+ */
+static int parse_file_tree(const ben_obj_t *node, char **prefix, size_t depth,
+                           file_t **files, size_t *count, size_t *cap) {
+    if (!node || node->type != BEN_DICT || depth >= V2_MAX_TREE_DEPTH) return -1;
+    for (size_t i = 0; i < node->value.dict.count; i++) {
+        const ben_pair_t *pair = &node->value.dict.pairs[i];
+        if (pair->key_len == 0) {
+            // лист: свойства файла
+            ben_obj_t *len_obj = bencode_dict_get(pair->value, "length");
+            if (!len_obj || len_obj->type != BEN_INT || depth == 0) return -1;
+            file_t *f = push_file(files, count, cap);
+            f->length = bencode_int_value(len_obj);
+            f->path_len = depth;
+            f->path = xcalloc(depth + 1, sizeof(char*));
+            for (size_t j = 0; j < depth; j++) f->path[j] = strdup(prefix[j]);
+
+            size_t root_len;
+            const uint8_t *root = bencode_string_data(bencode_dict_get(pair->value, "pieces root"), &root_len);
+            if (root && root_len == MERKLE_HASH_LEN) {
+                memcpy(f->pieces_root, root, MERKLE_HASH_LEN);
+                f->has_root = 1;
+            } else if (f->length > 0) {
+                return -1; // непустой файл обязан иметь корень
+            }
+            continue;
+        }
+        prefix[depth] = pair->key;
+        if (parse_file_tree(pair->value, prefix, depth + 1, files, count, cap) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Копирует слой кусков (piece layers) для файлов больше одного куска
+ *
+ * @param *layers словарь "piece layers" (ключ - pieces root)
+ * @param *f файл v2
+ * @param piece_length размер куска
+ * @return успех/ошибка (0/-1)
+ */
+static int load_piece_layer(const ben_obj_t *layers, file_t *f, uint32_t piece_length) {
+    if (!f->has_root || f->length <= piece_length) return 0; // корень файла и есть хеш куска
+    size_t expected = (f->length + piece_length - 1) / piece_length;
+    ben_obj_t *layer = bencode_dict_get_bin(layers, f->pieces_root, MERKLE_HASH_LEN);
+    size_t len;
+    const uint8_t *data = bencode_string_data(layer, &len);
+    if (!data || len != expected * MERKLE_HASH_LEN) return -1;
+    f->piece_layer = xmalloc(len);
+    memcpy(f->piece_layer, data, len);
+    f->layer_count = expected;
+
+    // слой должен сходиться к pieces root
+    uint8_t root[MERKLE_HASH_LEN];
+    uint8_t pad[MERKLE_HASH_LEN];
+    size_t leaves_per_piece = piece_length / MERKLE_BLOCK_SIZE;
+    merkle_pad_hash(leaves_per_piece, pad);
+    size_t width = merkle_width(expected);
+    uint8_t *padded = xmalloc(width * MERKLE_HASH_LEN);
+    memcpy(padded, f->piece_layer, len);
+    for (size_t i = expected; i < width; i++) memcpy(padded + i * MERKLE_HASH_LEN, pad, MERKLE_HASH_LEN);
+    merkle_root(padded, width, width, root);
+    free(padded);
+    return memcmp(root, f->pieces_root, MERKLE_HASH_LEN) == 0 ? 0 : -1;
+}
+
+/**
+ * Разбор метаданных v2: дерево файлов и слои кусков. Для гибридного торрента хеши
+ * привязываются к уже разобранным файлам v1, для чистого v2 список файлов строится
+ * из дерева с выравниванием каждого файла на границу куска.
+ *
+ * @param *root корневой словарь торрента
+ * @param *info info-словарь
+ * @param *tor заполняемый торрент
+ * @return успех/ошибка (0/-1)
+ */
+static int parse_v2(const ben_obj_t *root, const ben_obj_t *info, torrent_t *tor) {
+    ben_obj_t *tree = bencode_dict_get(info, "file tree");
+    ben_obj_t *layers = bencode_dict_get(root, "piece layers");
+    if (!tree || tor->piece_length < MERKLE_BLOCK_SIZE) return -1;
+
+    char *prefix[V2_MAX_TREE_DEPTH];
+    file_t *v2 = NULL;
+    size_t count = 0, cap = 0;
+    int ret = parse_file_tree(tree, prefix, 0, &v2, &count, &cap);
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        ret = load_piece_layer(layers, &v2[i], tor->piece_length);
+    }
+    if (ret < 0) {
+        free_files(v2, count);
+        return -1;
+    }
+
+    if (tor->files) {
+        // гибридный торрент: переносим хеши v2 в файлы v1 с тем же путём
+        size_t cursor = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!v2[i].has_root) continue;
+            file_t *dst = NULL;
+            for (size_t j = cursor; j < tor->file_count && !dst; j++) {
+                if (!tor->files[j].is_pad && same_path(&tor->files[j], &v2[i])) {
+                    dst = &tor->files[j];
+                    cursor = j + 1;
+                }
+            }
+            if (!dst || dst->length != v2[i].length) {
+                LOG_WARN("v2 file tree does not match v1 file list, merkle verification disabled for a file");
+                continue;
+            }
+            dst->has_root = 1;
+            memcpy(dst->pieces_root, v2[i].pieces_root, MERKLE_HASH_LEN);
+            dst->piece_layer = v2[i].piece_layer;
+            dst->layer_count = v2[i].layer_count;
+            v2[i].piece_layer = NULL;
+        }
+        free_files(v2, count);
+        return 0;
+    }
+
+    // чистый v2: каждый файл начинается с нового куска, между файлами вставляем padding
+    file_t *files = NULL;
+    size_t n = 0, ncap = 0;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t tail = offset % tor->piece_length;
+        if (tail && v2[i].length > 0) {
+            file_t *pad = push_file(&files, &n, &ncap);
+            pad->is_pad = 1;
+            pad->length = tor->piece_length - tail;
+            pad->path_len = 2;
+            pad->path = xcalloc(3, sizeof(char*));
+            pad->path[0] = strdup(".pad");
+            pad->path[1] = strdup("v2");
+            offset += pad->length;
+        }
+        *push_file(&files, &n, &ncap) = v2[i];
+        offset += v2[i].length;
+    }
+    free(v2); // содержимое перенесено в files
+    tor->files = files;
+    tor->file_count = n;
+    tor->total_length = offset;
+    tor->num_pieces = (offset + tor->piece_length - 1) / tor->piece_length;
+    return 0;
+}
+/**
+ * Строит таблицу начал файлов в потоке: piece_file ищет по ней двоичным поиском,
+ * а не перебором всех файлов на каждый кусок
+ *
+ * @param *tor торрент с заполненным списком файлов
+ */
+static void index_files(torrent_t *tor) {
+    tor->file_offset = xmalloc((tor->file_count + 1) * sizeof(uint64_t));
+    uint64_t offset = 0;
+    for (size_t i = 0; i < tor->file_count; i++) {
+        tor->file_offset[i] = offset;
+        offset += tor->files[i].length;
+    }
+    tor->file_offset[tor->file_count] = offset;
+}
+
 /**
  * Основная функция загрузки. Заполняет структуру torrent_t *tor данными из torrent-файла
  *
@@ -127,8 +350,14 @@ int torrent_load_from_memory(const uint8_t *data, size_t size, torrent_t *tor) {
         goto load_failure_tor;
     }
     SHA1(info_enc, info_enc_len, tor->info_hash);
+    SHA256(info_enc, info_enc_len, tor->info_hash_v2);
     free(info_enc); // нам больше не нужен
 
+    // Извлекаем meta version (2 - BitTorrent v2 или гибридный торрент)
+    tor->meta_version = 1;
+    ben_obj_t *mv = bencode_dict_get(info, "meta version");
+    if (mv && mv->type == BEN_INT) tor->meta_version = (int)bencode_int_value(mv);
+
     // Извлекаем name
     ben_obj_t *name = bencode_dict_get(info, "name");
     if (name) tor->name = str_from_bencode(name);
@@ -188,12 +417,12 @@ int torrent_load_from_memory(const uint8_t *data, size_t size, torrent_t *tor) {
             }
             tor->files[i].path = path;
             tor->files[i].path_len = path_len;
+            tor->files[i].is_pad = is_pad_file(file_dict);
         }
-    } else {
+    } else if (bencode_dict_get(info, "length")) {
         // Single-file режим: используем ключи "length" и "name" (name уже есть)
         ben_obj_t *len_obj = bencode_dict_get(info, "length");
-        if (!len_obj || len_obj->type != BEN_INT) {
-            // Нет ни files, ни length — ошибочный торрент
+        if (len_obj->type != BEN_INT) {
             goto load_failure_tor;
         }
         tor->file_count = 1;
@@ -206,8 +435,25 @@ int torrent_load_from_memory(const uint8_t *data, size_t size, torrent_t *tor) {
         tor->files[0].path = xmalloc(sizeof(char*) * 2);
         tor->files[0].path[0] = tor->name ? strdup(tor->name) : strdup("unknown");
         tor->files[0].path[1] = NULL;
+    } else if (tor->meta_version < 2) {
+        // Нет ни files, ни length — ошибочный торрент
+        goto load_failure_tor;
     }
 
+    if (tor->meta_version >= 2) {
+        if (parse_v2(root, info, tor) != 0) {
+            LOG_ERROR("Invalid v2 metadata (file tree / piece layers)");
+            goto load_failure_tor;
+        }
+        // у чистого v2 торрента в рое используется усечённый SHA-256
+        if (!tor->pieces) memcpy(tor->info_hash, tor->info_hash_v2, 20);
+    }
+    if (!tor->files || (!tor->pieces && !torrent_has_v2(tor))) {
+        goto load_failure_tor;
+    }
+    index_files(tor);
+    for (size_t i = 0; i < tor->file_count; i++) tor->files[i].priority = FILE_PRIO_NORMAL;
+
     bencode_free(root);
     return 0;
 
@@ -247,6 +493,7 @@ void torrent_free(torrent_t *tor) {
     if (tor->name) free(tor->name);
     if (tor->pieces) free(tor->pieces);
     if (tor->files) free_files(tor->files, tor->file_count);
+    free(tor->file_offset);
     memset(tor, 0, sizeof(torrent_t));
 }
 
@@ -258,13 +505,23 @@ void torrent_free(torrent_t *tor) {
  * @return размер куска данных 
  */
 uint32_t piece_size(const torrent_t *tor, uint32_t index) {
+    uint32_t size = 0;
     if (index < tor->num_pieces - 1) {
-        return tor->piece_length;
+        size = tor->piece_length;
     } else if (index == tor->num_pieces - 1) {
         uint32_t last = tor->total_length % tor->piece_length;
-        return last ? last : tor->piece_length;
+        size = last ? last : tor->piece_length;
     }
-    return 0;
+    if (size && !tor->pieces) {
+        // чистый v2: последний кусок файла короче, выравнивание по сети не передаётся
+        uint32_t k;
+        const file_t *f = piece_file(tor, index, &k);
+        if (f) {
+            uint64_t rest = f->length - (uint64_t)k * tor->piece_length;
+            if (rest < size) size = (uint32_t)rest;
+        }
+    }
+    return size;
 }
 
 /**
@@ -277,7 +534,248 @@ uint32_t piece_size(const torrent_t *tor, uint32_t index) {
  */
 int verify_piece(const torrent_t *tor, uint32_t index, const uint8_t *data) {
     if (index >= tor->num_pieces) return 0;
-    uint8_t hash[20];
-    SHA1(data, piece_size(tor, index), hash);
-    return memcmp(hash, tor->pieces + index * 20, 20) == 0;
+    uint32_t len = piece_size(tor, index);
+    if (tor->pieces) {
+        uint8_t hash[20];
+        SHA1(data, len, hash);
+        if (memcmp(hash, tor->pieces + index * 20, 20) != 0) return 0;
+    }
+    return verify_piece_v2(tor, index, data, len);
+}
+
+/**
+ * Проверяет, содержит ли торрент merkle-хеши v2
+ *
+ * @param *tor указатель на торрент
+ * @return 1/0
+ */
+int torrent_has_v2(const torrent_t *tor) {
+    if (tor->meta_version < 2) return 0;
+    for (size_t i = 0; i < tor->file_count; i++) {
+        if (tor->files[i].has_root) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Находит файл, в котором начинается кусок. В v2 файлы выровнены по кускам,
+ * поэтому кусок целиком принадлежит одному файлу (хвост - выравнивание)
+ *
+ * @param *tor указатель на торрент
+ * @param index номер куска
+ * @param *piece_in_file[out] номер куска внутри файла
+ * @return файл или NULL (кусок попадает на padding)
+ */
+const file_t *piece_file(const torrent_t *tor, uint32_t index, uint32_t *piece_in_file) {
+    uint64_t piece_start = (uint64_t)index * tor->piece_length;
+    if (!tor->file_count || piece_start >= tor->file_offset[tor->file_count]) return NULL;
+    // последний файл, начинающийся не позже куска: у пустых файлов начало совпадает
+    // со следующим, поэтому найденный файл всегда непустой
+    size_t lo = 0, hi = tor->file_count - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (tor->file_offset[mid] <= piece_start) lo = mid;
+        else hi = mid - 1;
+    }
+    const file_t *f = &tor->files[lo];
+    if (f->is_pad) return NULL;
+    if (piece_in_file) *piece_in_file = (piece_start - tor->file_offset[lo]) / tor->piece_length;
+    return f;
+}
+
+/**
+ * Разбирает уровень приоритета элемента --files
+ *
+ * @param *name имя уровня
+ * @return file_priority_t или -1
+ */
+static int priority_parse(const char *name) {
+    static const char *names[FILE_PRIO_LEVELS] = { "skip", "low", "normal", "high" };
+    for (int i = 0; i < FILE_PRIO_LEVELS; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Разбирает номер или диапазон номеров файлов ("3", "2-5")
+ *
+ * @param *item элемент списка
+ * @param *first[out] первый номер
+ * @param *last[out] последний номер (включительно)
+ * @return 1 - это номер/диапазон, 0 - шаблон
+ */
+static int parse_index_range(const char *item, size_t *first, size_t *last) {
+    char *end;
+    if (!isdigit((unsigned char)*item)) return 0;
+    unsigned long long a = strtoull(item, &end, 10), b = a;
+    if (*end == '-' && isdigit((unsigned char)end[1])) b = strtoull(end + 1, &end, 10);
+    if (*end || b < a) return 0;
+    *first = (size_t)a;
+    *last = (size_t)b;
+    return 1;
+}
+
+/**
+ * Применяет выбор файлов: список через запятую из номеров (с 0, как в выводе -v),
+ * диапазонов и glob-шаблонов по пути внутри торрента, у каждого - необязательный
+ * уровень ":skip|low|normal|high". Не упомянутые файлы не скачиваются,
+ * при нескольких совпадениях действует последний элемент.
+ *
+ * @param *tor торрент
+ * @param *spec список (NULL - оставить все файлы с обычным приоритетом)
+ * @return количество выбранных файлов или -1 (ошибка в списке или ничего не выбрано)
+ */
+int torrent_select_files(torrent_t *tor, const char *spec) {
+    if (!spec) return (int)tor->file_count;
+    for (size_t i = 0; i < tor->file_count; i++) tor->files[i].priority = FILE_PRIO_SKIP;
+
+    char *copy = strdup(spec);
+    char *save = NULL;
+    int ret = 0;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(item, ':');
+        int prio = colon ? priority_parse(colon + 1) : -1;
+        if (prio >= 0) *colon = '\0';
+        else prio = FILE_PRIO_NORMAL; // уровня нет или двоеточие - часть шаблона
+
+        size_t first, last, matched = 0;
+        int by_index = parse_index_range(item, &first, &last);
+        for (size_t i = 0; i < tor->file_count; i++) {
+            file_t *f = &tor->files[i];
+            int hit;
+            if (by_index) {
+                hit = i >= first && i <= last;
+            } else {
+                char path[TORRENT_PATH_LEN] = {0};
+                for (size_t k = 0; k < f->path_len; k++) {
+                    if (k) strncat(path, "/", sizeof(path) - strlen(path) - 1);
+                    strncat(path, f->path[k], sizeof(path) - strlen(path) - 1);
+                }
+                hit = fnmatch(item, path, 0) == 0;
+            }
+            if (!hit || f->is_pad) continue;
+            f->priority = prio;
+            matched++;
+        }
+        if (!matched) LOG_WARN("--files: '%s' matches no files", item);
+    }
+    free(copy);
+
+    for (size_t i = 0; i < tor->file_count; i++) {
+        if (tor->files[i].priority != FILE_PRIO_SKIP) ret++;
+    }
+    if (!ret) {
+        LOG_ERROR("--files: no files selected");
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * Считает приоритет кусков за один проход по файлам: кусок получает наибольший
+ * приоритет из файлов, с которыми пересекается. Куски только из padding-файлов - FILE_PRIO_SKIP.
+ *
+ * @param *tor торрент
+ * @param *out[out] приоритеты (num_pieces байт)
+ */
+void torrent_piece_priorities(const torrent_t *tor, uint8_t *out) {
+    memset(out, FILE_PRIO_SKIP, tor->num_pieces);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < tor->file_count; i++) {
+        const file_t *f = &tor->files[i];
+        uint64_t start = offset;
+        offset += f->length;
+        if (f->is_pad || !f->length || !tor->piece_length) continue;
+        uint64_t first = start / tor->piece_length;
+        uint64_t last = (offset - 1) / tor->piece_length;
+        for (uint64_t p = first; p <= last && p < tor->num_pieces; p++) {
+            if (out[p] < f->priority) out[p] = (uint8_t)f->priority;
+        }
+    }
+}
+
+/**
+ * Определяет ожидаемый merkle-хеш куска и параметры поддерева
+ *
+ * @param *tor указатель на торрент
+ * @param index номер куска
+ * @param *data_len[out] сколько байт куска принадлежит файлу
+ * @param *width[out] ширина поддерева в листьях
+ * @param *expected[out] ожидаемый корень поддерева
+ * @return 1 - хеш найден, 0 - v2 для куска неприменим
+ */
+static int piece_v2_target(const torrent_t *tor, uint32_t index, uint64_t *data_len,
+                           size_t *width, uint8_t expected[MERKLE_HASH_LEN]) {
+    uint32_t k;
+    const file_t *f = piece_file(tor, index, &k);
+    if (!f || !f->has_root) return 0;
+
+    uint64_t rest = f->length - (uint64_t)k * tor->piece_length;
+    *data_len = rest < tor->piece_length ? rest : tor->piece_length;
+    if (f->layer_count == 0) {
+        // файл не больше куска: корень файла покрывает его целиком
+        *width = merkle_width((f->length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+        memcpy(expected, f->pieces_root, MERKLE_HASH_LEN);
+    } else {
+        if (k >= f->layer_count) return 0;
+        *width = tor->piece_length / MERKLE_BLOCK_SIZE;
+        memcpy(expected, f->piece_layer + (size_t)k * MERKLE_HASH_LEN, MERKLE_HASH_LEN);
+    }
+    return 1;
+}
+
+/**
+ * Проверка куска по merkle-дереву v2
+ *
+ * @param *tor указатель на торрент
+ * @param index номер куска
+ * @param *data данные куска
+ * @param len длина данных
+ * @return 1 - кусок корректен (или v2-хеша нет у гибридного торрента), 0 - ошибка
+ */
+int verify_piece_v2(const torrent_t *tor, uint32_t index, const uint8_t *data, uint32_t len) {
+    uint64_t data_len;
+    size_t width;
+    uint8_t expected[MERKLE_HASH_LEN];
+    if (!piece_v2_target(tor, index, &data_len, &width, expected)) {
+        return tor->pieces != NULL; // для чистого v2 проверить нечем - ошибка
+    }
+    if (data_len > len) return 0;
+    uint8_t root[MERKLE_HASH_LEN];
+    merkle_root_of_data(data, data_len, width, root);
+    return memcmp(root, expected, MERKLE_HASH_LEN) == 0;
+}
+
+/**
+ * Проверка хешей листьев куска, присланных пиром (hashes, BEP 52), по слою кусков
+ *
+ * @param *tor указатель на торрент
+ * @param index номер куска
+ * @param *leaves хеши листьев (count * 32 байт)
+ * @param count количество листьев
+ * @return 1/0 - хеши подтверждены/нет
+ */
+int verify_piece_leaves(const torrent_t *tor, uint32_t index, const uint8_t *leaves, size_t count) {
+    uint64_t data_len;
+    size_t width;
+    uint8_t expected[MERKLE_HASH_LEN];
+    if (!piece_v2_target(tor, index, &data_len, &width, expected) || count > width) return 0;
+    uint8_t root[MERKLE_HASH_LEN];
+    merkle_root(leaves, count, width, root);
+    return memcmp(root, expected, MERKLE_HASH_LEN) == 0;
+}
+
+/**
+ * Проверка одного блока по хешу листа
+ *
+ * @param *leaf проверенный хеш листа
+ * @param *data данные блока
+ * @param len длина блока
+ * @return 1/0 - блок корректен/повреждён
+ */
+int verify_block_v2(const uint8_t *leaf, const uint8_t *data, uint32_t len) {
+    uint8_t hash[MERKLE_HASH_LEN];
+    merkle_hash_block(data, len, hash);
+    return memcmp(hash, leaf, MERKLE_HASH_LEN) == 0;
 }
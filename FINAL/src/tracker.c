@@ -58,14 +58,84 @@ void generate_peer_id(uint8_t *peer_id) {
     LOG_DEBUG("Client_peer_id: %s", peer_id);
 }
 
+/**
+ * Разбирает список пиров из ответа трекера: компактную строку (record байт на пира)
+ * или словарную форму - список словарей с ключами "ip" и "port"
+ *
+ * @param *obj значение ключа peers/peers6 (может быть NULL)
+ * @param record размер компактной записи (PEER_COMPACT_V4/PEER_COMPACT_V6)
+ * @param family семейство адресов компактной записи
+ * @param **out[out] массив адресов (освобождает вызывающий)
+ * @param *count[out] количество адресов
+ * @return 0 - успех, -1 - неверный формат
+ */
+static int parse_peer_list(const ben_obj_t *obj, size_t record, int family, peer_t **out, size_t *count) {
+    *out = NULL;
+    *count = 0;
+    if (!obj) return 0;
+    if (obj->type == BEN_STRING) {
+        size_t len;
+        const uint8_t *data = bencode_string_data(obj, &len);
+        if (len % record != 0) {
+            LOG_ERROR("Invalid peers length: %zu (should be multiple of %zu)", len, record);
+            return -1;
+        }
+        *out = xmalloc((len / record ? len / record : 1) * sizeof(peer_t));
+        for (size_t i = 0; i < len / record; i++) {
+            // данные уже в сетевом порядке: адрес, затем 2 байта порта
+            if (peer_addr_from_compact(&(*out)[*count], data + i * record, family) == 0) (*count)++;
+        }
+        return 0;
+    }
+    if (obj->type == BEN_LIST) {
+        size_t n = obj->value.list.count;
+        *out = xmalloc((n ? n : 1) * sizeof(peer_t));
+        for (size_t i = 0; i < n; i++) {
+            const ben_obj_t *d = &obj->value.list.items[i];
+            if (d->type != BEN_DICT) continue;
+            ben_obj_t *ip_obj = bencode_dict_get(d, "ip");
+            ben_obj_t *port_obj = bencode_dict_get(d, "port");
+            if (!ip_obj || ip_obj->type != BEN_STRING || !port_obj || port_obj->type != BEN_INT) continue;
+            int64_t port = bencode_int_value(port_obj);
+            size_t ip_len;
+            const uint8_t *ip_data = bencode_string_data(ip_obj, &ip_len);
+            char ip[INET6_ADDRSTRLEN + 1];
+            if (port <= 0 || port > 65535 || ip_len >= sizeof(ip)) continue;
+            memcpy(ip, ip_data, ip_len);
+            ip[ip_len] = '\0';
+            if (peer_addr_from_string(&(*out)[*count], ip, (uint16_t)port) == 0) (*count)++;
+            else LOG_DEBUG("Skipping non-numeric peer address %s", ip);
+        }
+        return 0;
+    }
+    LOG_ERROR("Peers field has unexpected type");
+    return -1;
+}
+
+/**
+ * Добавляет адрес в список, если его там ещё нет (трекеры повторяют пиров в peers и peers6)
+ *
+ * @param *peers массив
+ * @param *count[in,out] количество
+ * @param *p адрес
+ */
+static void add_unique_peer(peer_t *peers, int *count, const peer_t *p) {
+    for (int i = 0; i < *count; i++) {
+        if (peer_addr_equal(&peers[i], p)) return;
+    }
+    peers[(*count)++] = *p;
+}
+
 /**
  * Получает список пиров от трекера
  * @param *tor[in] указатель на заполненный объект с данными о торренте
  * @param *peer_id[in] указатель на peer_id клиента
+ * @param *ann[in] событие, прогресс загрузки и таймаут запроса
  * @param **peers_out[out] указатель на массив с пирами
+ * @param *interval[out] интервал до следующего обращения, с (может быть NULL)
  * @return Количество пиров
  */
-int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, peer_t **peers_out) {
+int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, const announce_t *ann, peer_t **peers_out, int *interval) {
     CURL *curl;
     CURLcode res;
     memory_t chunk = { NULL, 0 };
@@ -97,12 +167,15 @@ int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, peer_t **pee
     char url[URL_LEN];
 
     snprintf(url, sizeof(url),
-             "%s?info_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=0&left=%llu&compact=1&event=started",
+             "%s?info_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=%llu&left=%llu&compact=1%s%s",
              tor->announce ? tor->announce : "",
              info_hash_enc,
              peer_id_enc,
              CLIENT_PORT,
-             (unsigned long long)tor->total_length);
+             (unsigned long long)ann->downloaded,
+             (unsigned long long)ann->left,
+             ann->event ? "&event=" : "", ann->event ? ann->event : "");
+    metrics_add(&metrics.announces, 1);
 
 
     LOG_DEBUG("Tracker URL: %s", url);
@@ -110,7 +183,7 @@ int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, peer_t **pee
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L); // таймаут 30 секунд
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, ann->timeout);
 
     // Выполняем запрос
     res = curl_easy_perform(curl);
@@ -134,29 +207,41 @@ int tracker_get_peers(const torrent_t *tor, const uint8_t *peer_id, peer_t **pee
         goto cleanup_bencode;
     }
 
-    // Извлекаем peers (пара ключ-значение. Ключ - peers, значение - указатель на пиры в формате bencoded - строки)
+    if (interval) {
+        ben_obj_t *interval_obj = bencode_dict_get(resp, "interval");
+        *interval = interval_obj && interval_obj->type == BEN_INT ? (int)bencode_int_value(interval_obj)
+                                                                   : TRACKER_DEFAULT_INTERVAL;
+    }
+
+    // peers: компактная строка IPv4 или список словарей (ip/port); peers6 (BEP 7): компактная строка IPv6
+    peer_t *v4 = NULL, *v6 = NULL;
+    size_t v4_count = 0, v6_count = 0;
     ben_obj_t *peers_obj = bencode_dict_get(resp, "peers");
-    if (!peers_obj || peers_obj->type != BEN_STRING) {
-        LOG_ERROR("No peers field in tracker response or not a string");
+    ben_obj_t *peers6_obj = bencode_dict_get(resp, "peers6");
+    if (!peers_obj && !peers6_obj) {
+        LOG_ERROR("No peers field in tracker response");
         goto cleanup_bencode;
     }
-
-    size_t peers_len;
-    const uint8_t *peers_data = bencode_string_data(peers_obj, &peers_len);
-    //на каждый пир отводится 6 байт: 4 байта на ip адрес, 2 байта на порт.
-    if (peers_len % 6 != 0) { 
-        LOG_ERROR("Invalid peers length: %zu (should be multiple of 6)", peers_len);
+    if (parse_peer_list(peers_obj, PEER_COMPACT_V4, AF_INET, &v4, &v4_count) < 0 ||
+        parse_peer_list(peers6_obj, PEER_COMPACT_V6, AF_INET6, &v6, &v6_count) < 0) {
+        free(v4);
+        free(v6);
         goto cleanup_bencode;
     }
 
-    peer_count = peers_len / 6;
-    *peers_out = xmalloc(peer_count * sizeof(peer_t));
-
-    for (int i = 0; i < peer_count; i++) {
-        // данные уже находятся в сетевом порядке, первые 4 байта - ip-адрес, вторые 4 байта - порт
-        memcpy(&(*peers_out)[i].ip, peers_data + i*6, 4);
-        memcpy(&(*peers_out)[i].port, peers_data + i*6 + 4, 2);
+    // Чередуем семейства в списке (RFC 8305), начиная с IPv6. Здесь только порядок адресов:
+    // параллельные попытки подключения с разнесённым стартом делает dialer
+    *peers_out = xmalloc((v4_count + v6_count ? v4_count + v6_count : 1) * sizeof(peer_t));
+    peer_count = 0;
+    for (size_t i = 0; i < v4_count || i < v6_count; i++) {
+        if (i < v6_count) add_unique_peer(*peers_out, &peer_count, &v6[i]);
+        if (i < v4_count) add_unique_peer(*peers_out, &peer_count, &v4[i]);
     }
+    free(v4);
+    free(v6);
+    int ipv6 = 0;
+    for (int i = 0; i < peer_count; i++) ipv6 += (*peers_out)[i].sa.ss_family == AF_INET6;
+    LOG_INFO("Tracker returned %d peers (%d IPv4, %d IPv6)", peer_count, peer_count - ipv6, ipv6);
 
 cleanup_bencode:
     bencode_free(resp);
@@ -1,6 +1,31 @@
 #include "utils.h"
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
 
 volatile int running = 1;
+int log_level = LOG_LEVEL_INFO;
+
+// Слот кольцевого буфера лога (очередь Вьюкова: seq == позиция - слот свободен для записи,
+// seq == позиция + 1 - в слоте готовая строка)
+typedef struct {
+    atomic_size_t seq;
+    size_t len;
+    char text[LOG_LINE_MAX];
+} log_slot_t;
+
+static struct {
+    log_slot_t slots[LOG_RING_SIZE];
+    atomic_size_t tail;        // следующая позиция для записи (производители)
+    size_t head;               // следующая позиция для чтения (только фоновый поток)
+    atomic_size_t dropped;     // строк потеряно из-за переполнения
+    atomic_int active;         // фоновый поток запущен
+    atomic_int stop;
+    sem_t ready;               // количество готовых строк
+    pthread_t thread;
+} log_ring;
+
+static const char *const log_prefix[] = { "[ERROR]", "[WARNING]", "[INFO]", "[DEBUG]" };
 
 /**
  * Обработчик сигналов
@@ -67,6 +92,166 @@ void xfree(void *ptr) {
 }
 
 
+/**
+ * Форматирует строку лога и отправляет её в кольцевой буфер
+ * (или сразу в stderr, если фоновый поток не запущен)
+ *
+ * @param level уровень
+ * @param *file исходный файл (NULL - без места вызова)
+ * @param line строка исходного файла
+ * @param *fmt формат printf
+ */
+void log_write(int level, const char *file, int line, const char *fmt, ...) {
+    char buf[LOG_LINE_MAX];
+    int n = file ? snprintf(buf, sizeof(buf), "%s %s:%d ", log_prefix[level], file, line)
+                 : snprintf(buf, sizeof(buf), "%s ", log_prefix[level]);
+    if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+    va_list args;
+    va_start(args, fmt);
+    n += vsnprintf(buf + n, sizeof(buf) - n, fmt, args);
+    va_end(args);
+    size_t len = (size_t)n < sizeof(buf) - 1 ? (size_t)n : sizeof(buf) - 2; // место под '\n'
+    buf[len++] = '\n';
+
+    if (!atomic_load_explicit(&log_ring.active, memory_order_acquire)) {
+        ssize_t w = write(STDERR_FILENO, buf, len);
+        (void)w;
+        return;
+    }
+
+    // занимаем слот: CAS по tail, без блокировок
+    size_t pos = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+    log_slot_t *slot;
+    for (;;) {
+        slot = &log_ring.slots[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_ring.tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_ring.dropped, 1, memory_order_relaxed); // буфер полон
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+        }
+    }
+    memcpy(slot->text, buf, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&log_ring.ready);
+}
+
+/**
+ * Фоновый поток: забирает готовые строки и пишет их в stderr пачками
+ *
+ * @param *arg не используется
+ * @return NULL
+ */
+static void *log_thread(void *arg) {
+    (void)arg;
+    char out[LOG_LINE_MAX * 8];
+    for (;;) {
+        while (sem_wait(&log_ring.ready) < 0 && errno == EINTR) {}
+        size_t used = 0;
+        size_t drained = 0;
+        for (;;) {
+            log_slot_t *slot = &log_ring.slots[log_ring.head & (LOG_RING_SIZE - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_ring.head + 1) break;
+            if (used + slot->len > sizeof(out)) {
+                ssize_t w = write(STDERR_FILENO, out, used);
+                (void)w;
+                used = 0;
+            }
+            memcpy(out + used, slot->text, slot->len);
+            used += slot->len;
+            atomic_store_explicit(&slot->seq, log_ring.head + LOG_RING_SIZE, memory_order_release);
+            log_ring.head++;
+            // на каждую строку был sem_post; лишние пробуждения безвредны, поэтому trywait
+            if (drained++ > 0) sem_trywait(&log_ring.ready);
+        }
+        size_t dropped = atomic_exchange_explicit(&log_ring.dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            char note[64];
+            int n = snprintf(note, sizeof(note), "[WARNING] %zu log messages dropped\n", dropped);
+            if (used + n > sizeof(out)) {
+                ssize_t w = write(STDERR_FILENO, out, used);
+                (void)w;
+                used = 0;
+            }
+            memcpy(out + used, note, n);
+            used += n;
+        }
+        if (used) {
+            ssize_t w = write(STDERR_FILENO, out, used);
+            (void)w;
+        }
+        if (atomic_load(&log_ring.stop) && log_ring.head == atomic_load(&log_ring.tail)) break;
+    }
+    return NULL;
+}
+
+/**
+ * Запускает фоновую запись лога
+ *
+ * @return 0/-1 (при ошибке лог остаётся синхронным)
+ */
+int log_start(void) {
+    if (atomic_load(&log_ring.active)) return 0;
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) atomic_init(&log_ring.slots[i].seq, i);
+    atomic_init(&log_ring.tail, 0);
+    log_ring.head = 0;
+    atomic_init(&log_ring.stop, 0);
+    if (sem_init(&log_ring.ready, 0, 0) < 0) return -1;
+    if (pthread_create(&log_ring.thread, NULL, log_thread, NULL) != 0) {
+        sem_destroy(&log_ring.ready);
+        return -1;
+    }
+    atomic_store_explicit(&log_ring.active, 1, memory_order_release);
+    atexit(log_stop); // exit() из xmalloc и т.п. - не теряем хвост лога
+    return 0;
+}
+
+/**
+ * Останавливает фоновый поток, предварительно записав всё из буфера
+ */
+void log_stop(void) {
+    if (!atomic_exchange(&log_ring.active, 0)) return;
+    // строки, занявшие слот до снятия active, поток ещё допишет
+    atomic_store(&log_ring.stop, 1);
+    sem_post(&log_ring.ready);
+    pthread_join(log_ring.thread, NULL);
+    sem_destroy(&log_ring.ready);
+    size_t dropped = atomic_exchange(&log_ring.dropped, 0);
+    if (dropped) LOG_WARN("%zu log messages dropped", dropped);
+}
+
+/**
+ * Разбирает имя уровня логирования
+ *
+ * @param *name error/warn/info/debug или число 0-3
+ * @return уровень или -1
+ */
+int log_level_parse(const char *name) {
+    static const char *const names[] = { "error", "warn", "info", "debug" };
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    if (name[0] >= '0' && name[0] <= '3' && name[1] == '\0') return name[0] - '0';
+    return -1;
+}
+
+/**
+ * Монотонное время (не зависит от перевода системных часов)
+ *
+ * @return - миллисекунды с произвольной точки отсчёта
+ */
+double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 /**
  * Читает данные из файла в буфер в памяти
  *
@@ -127,8 +312,19 @@ void parse_args(int argc, char **argv, config_t *cfg) {
     memset(cfg, 0, sizeof(config_t));
     cfg->use_stdin = 1;
     cfg->use_stdout = 1;
+    static const struct option long_opts[] = {
+        { "check", no_argument, NULL, 'c' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "files", required_argument, NULL, 'F' },
+        { "alloc", required_argument, NULL, 'a' },
+        { "log-level", required_argument, NULL, 'L' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "quiet", no_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "f:d:o:O:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "f:d:o:O:cj:vqF:", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'f':
             cfg->input_file = strdup(optarg);
@@ -146,8 +342,44 @@ void parse_args(int argc, char **argv, config_t *cfg) {
             cfg->extract_dir = strdup(optarg);
             cfg->use_stdout = 0;
             break;
+        case 'c':
+            cfg->check_only = 1;
+            break;
+        case 'j':
+            cfg->threads = atoi(optarg);
+            break;
+        case 'm':
+            cfg->metrics_addr = strdup(optarg);
+            break;
+        case 'F':
+            cfg->files_spec = strdup(optarg);
+            break;
+        case 'a':
+            if (strcmp(optarg, "sparse") == 0) cfg->alloc_mode = ALLOC_SPARSE;
+            else if (strcmp(optarg, "full") == 0) cfg->alloc_mode = ALLOC_FULL;
+            else if (strcmp(optarg, "none") == 0) cfg->alloc_mode = ALLOC_NONE;
+            else {
+                LOG_ERROR("Unknown allocation mode %s (sparse, full, none)", optarg);
+                exit(1);
+            }
+            break;
+        case 'L': {
+            int level = log_level_parse(optarg);
+            if (level < 0) {
+                LOG_ERROR("Unknown log level %s (error, warn, info, debug)", optarg);
+                exit(1);
+            }
+            log_level = level;
+            break;
+        }
+        case 'v':
+            if (log_level < LOG_LEVEL_DEBUG) log_level++;
+            break;
+        case 'q':
+            if (log_level > LOG_LEVEL_ERROR) log_level--;
+            break;
         default:
-            LOG_ERROR("Usage: %s [-f file.torrent | -d dir] [-o file | -O dir]\n", argv[0]);
+            LOG_ERROR("Usage: %s [-f file.torrent | -d dir] [-o file | -O dir] [-F|--files spec] [--alloc sparse|full|none] [--check [-j threads]] [--metrics addr] [-v | -q | --log-level level]\n", argv[0]);
             exit(1);
         }
     }
@@ -163,5 +395,7 @@ void free_config(config_t *cfg) {
     free(cfg->watch_dir);
     free(cfg->output_file);
     free(cfg->extract_dir);
+    free(cfg->metrics_addr);
+    free(cfg->files_spec);
 }
 
@@ -0,0 +1,460 @@
+#!/usr/bin/env python3
+"""
+Бенчмарк torrent_client на локальном рое (loopback).
+
+Генерирует синтетический торрент заданного размера и раскладки, поднимает
+заглушку HTTP-трекера и N процессов-сидов на 127.0.0.1, при необходимости
+добавляет задержку/потери на lo через tc netem, запускает клиент и печатает
+скорость (MB/s), время CPU, пиковый RSS и время до первого байта (TTFB).
+
+Пример:
+    ./bench.py --client ../builds/torrent_client --size 256M --files 4 --seeders 3 --runs 3
+    sudo ./bench.py --client ../builds/torrent_client --size 64M --delay 20 --loss 0.1
+"""
+import argparse
+import hashlib
+import http.server
+import json
+import multiprocessing as mp
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+GEN_CHUNK = 1 << 20
+
+
+def parse_size(s):
+    """Размер с суффиксом K/M/G (степени 1024)."""
+    mult = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    s = s.strip().upper().rstrip('B').rstrip('I')
+    if s and s[-1] in mult:
+        return int(float(s[:-1]) * mult[s[-1]])
+    return int(s)
+
+
+def bencode(o):
+    if isinstance(o, int):
+        return b'i%de' % o
+    if isinstance(o, str):
+        o = o.encode()
+    if isinstance(o, bytes):
+        return b'%d:' % len(o) + o
+    if isinstance(o, list):
+        return b'l' + b''.join(bencode(x) for x in o) + b'e'
+    if isinstance(o, dict):
+        keys = sorted(o, key=lambda k: k.encode() if isinstance(k, str) else k)
+        return b'd' + b''.join(bencode(k) + bencode(o[k]) for k in keys) + b'e'
+    raise TypeError(type(o))
+
+
+# ---------------------------------------------------------------------------
+# Синтетический торрент
+# ---------------------------------------------------------------------------
+
+def file_layout(total, nfiles, seed):
+    """Делит total байт на nfiles файлов разного размера (детерминированно)."""
+    if nfiles <= 1:
+        return [total]
+    rnd = random.Random(seed)
+    weights = [rnd.uniform(0.5, 1.5) for _ in range(nfiles)]
+    sizes = [int(total * w / sum(weights)) for w in weights]
+    sizes[-1] += total - sum(sizes)
+    return sizes
+
+
+def make_torrent(workdir, size, piece_length, nfiles, seed, tracker_url):
+    """
+    Пишет данные в workdir/seed/<name> и торрент в workdir/bench.torrent.
+    Возвращает (info_hash, список (путь, длина), число кусков, имя торрента).
+    """
+    name = 'bench' if nfiles > 1 else 'bench.bin'
+    seed_dir = os.path.join(workdir, 'seed')
+    os.makedirs(seed_dir, exist_ok=True)
+    sizes = file_layout(size, nfiles, seed)
+    rnd = random.Random(seed)
+
+    files = []
+    pieces = []
+    piece = hashlib.sha1()
+    in_piece = 0
+    for idx, length in enumerate(sizes):
+        if nfiles > 1:
+            rel = ['dir%d' % (idx % 3), 'file%03d.bin' % idx]
+            path = os.path.join(seed_dir, name, *rel)
+        else:
+            rel = None
+            path = os.path.join(seed_dir, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, 'wb') as f:
+            left = length
+            while left > 0:
+                chunk = rnd.randbytes(min(GEN_CHUNK, left))
+                f.write(chunk)
+                left -= len(chunk)
+                # хеши кусков считаем по общему потоку данных, через границы файлов
+                pos = 0
+                while pos < len(chunk):
+                    n = min(piece_length - in_piece, len(chunk) - pos)
+                    piece.update(chunk[pos:pos + n])
+                    in_piece += n
+                    pos += n
+                    if in_piece == piece_length:
+                        pieces.append(piece.digest())
+                        piece = hashlib.sha1()
+                        in_piece = 0
+        files.append((path, length, rel))
+    if in_piece:
+        pieces.append(piece.digest())
+
+    info = {'name': name, 'piece length': piece_length, 'pieces': b''.join(pieces)}
+    if nfiles > 1:
+        info['files'] = [{'length': l, 'path': rel} for _, l, rel in files]
+    else:
+        info['length'] = size
+    with open(os.path.join(workdir, 'bench.torrent'), 'wb') as f:
+        f.write(bencode({'announce': tracker_url, 'info': info}))
+    return hashlib.sha1(bencode(info)).digest(), [(p, l) for p, l, _ in files], len(pieces), name
+
+
+# ---------------------------------------------------------------------------
+# Трекер
+# ---------------------------------------------------------------------------
+
+class Tracker:
+    """Заглушка HTTP-трекера: на любой announce отдаёт компактный список сидов."""
+
+    def __init__(self):
+        self.peers = b''
+        self.peers6 = b''
+        self.interval = 1800
+        self.announces = 0
+        tracker = self
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+            def do_GET(self):
+                tracker.announces += 1
+                resp = {'interval': tracker.interval, 'peers': tracker.peers}
+                if tracker.peers6:
+                    resp['peers6'] = tracker.peers6
+                body = bencode(resp)
+                self.send_response(200)
+                self.send_header('Content-Type', 'text/plain')
+                self.send_header('Content-Length', str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, *args):
+                pass
+
+        self.server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+        self.port = self.server.server_address[1]
+        threading.Thread(target=self.server.serve_forever, daemon=True).start()
+
+    def set_peers(self, ports, family='4'):
+        """family: '4' - только peers, '6' - только peers6 (::1), 'dual' - каждый сид в обоих списках."""
+        v4 = socket.inet_pton(socket.AF_INET, '127.0.0.1')
+        v6 = socket.inet_pton(socket.AF_INET6, '::1')
+        self.peers = b''.join(v4 + struct.pack('>H', p) for p in ports) if family != '6' else b''
+        self.peers6 = b''.join(v6 + struct.pack('>H', p) for p in ports) if family != '4' else b''
+
+    def close(self):
+        self.server.shutdown()
+
+
+# ---------------------------------------------------------------------------
+# Сид
+# ---------------------------------------------------------------------------
+
+class Stream:
+    """Чтение диапазона общего потока данных торрента поверх нескольких файлов."""
+
+    def __init__(self, files, piece_length):
+        self.piece_length = piece_length
+        self.files = []
+        off = 0
+        for path, length in files:
+            self.files.append((off, length, os.open(path, os.O_RDONLY)))
+            off += length
+
+    def read(self, pos, n):
+        out = []
+        for off, length, fd in self.files:
+            if n == 0:
+                break
+            if pos >= off + length:
+                continue
+            k = min(n, off + length - pos)
+            out.append(os.pread(fd, k, pos - off))
+            pos += k
+            n -= k
+        return b''.join(out)
+
+
+def recv_exact(conn, n):
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = conn.recv(n - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return bytes(buf)
+
+
+def seed_conn(conn, info_hash, stream, num_pieces, rate, first_byte):
+    """Обслуживание одного соединения: handshake, bitfield, unchoke, отдача блоков."""
+    try:
+        hs = recv_exact(conn, 68)
+        if hs[28:48] != info_hash:
+            return
+        conn.sendall(bytes([19]) + b'BitTorrent protocol' + bytes(8) + info_hash + b'-BN0001-' + os.urandom(6).hex().encode()[:12])
+        bits = bytearray(b'\xff' * ((num_pieces + 7) // 8))
+        if num_pieces % 8:
+            bits[-1] = (0xff << (8 - num_pieces % 8)) & 0xff
+        conn.sendall(struct.pack('>IB', len(bits) + 1, 5) + bits)
+
+        sent = 0
+        start = time.monotonic()
+        while True:
+            length = struct.unpack('>I', recv_exact(conn, 4))[0]
+            if length == 0:
+                continue  # keep-alive
+            msg = recv_exact(conn, length)
+            if msg[0] == 2:  # interested
+                conn.sendall(struct.pack('>IB', 1, 1))
+            elif msg[0] == 6:  # request
+                index, begin, n = struct.unpack('>III', msg[1:13])
+                data = stream.read(index * stream.piece_length + begin, n)
+                if first_byte.value == 0.0:
+                    with first_byte.get_lock():
+                        if first_byte.value == 0.0:
+                            first_byte.value = time.monotonic()
+                conn.sendall(struct.pack('>IBII', len(data) + 9, 7, index, begin) + data)
+                sent += len(data)
+                if rate:
+                    # ограничение скорости сида: не опережаем rate байт/с
+                    ahead = sent / rate - (time.monotonic() - start)
+                    if ahead > 0:
+                        time.sleep(ahead)
+    except (EOFError, ConnectionError, OSError):
+        pass
+    finally:
+        conn.close()
+
+
+def seeder_main(info_hash, files, piece_length, num_pieces, rate, first_byte, port_pipe, family='4'):
+    stream = Stream(files, piece_length)
+    if family == '4':
+        srv = socket.socket()
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(('127.0.0.1', 0))
+    else:
+        # '6' - только ::1, 'dual' - один порт для 127.0.0.1 и ::1
+        srv = socket.socket(socket.AF_INET6)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 1 if family == '6' else 0)
+        srv.bind(('::1' if family == '6' else '::', 0))
+    srv.listen(64)
+    port_pipe.send(srv.getsockname()[1])
+    port_pipe.close()
+    while True:
+        conn, _ = srv.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=seed_conn, args=(conn, info_hash, stream, num_pieces, rate, first_byte),
+                         daemon=True).start()
+
+
+# ---------------------------------------------------------------------------
+# netem
+# ---------------------------------------------------------------------------
+
+def netem_args(args):
+    opts = []
+    if args.delay:
+        opts += ['delay', '%gms' % args.delay]
+        if args.jitter:
+            opts += ['%gms' % args.jitter]
+    if args.loss:
+        opts += ['loss', '%g%%' % args.loss]
+    return opts
+
+
+def netem_apply(opts):
+    cmd = ['tc', 'qdisc', 'add', 'dev', 'lo', 'root', 'netem'] + opts
+    r = subprocess.run(cmd, capture_output=True, text=True)
+    if r.returncode != 0:
+        sys.exit('tc netem failed (root required?): %s' % r.stderr.strip())
+
+
+def netem_remove():
+    subprocess.run(['tc', 'qdisc', 'del', 'dev', 'lo', 'root'], capture_output=True)
+
+
+# ---------------------------------------------------------------------------
+# Запуск клиента
+# ---------------------------------------------------------------------------
+
+def run_client(args, workdir, torrent_name, files, first_byte, run_no):
+    out_dir = os.path.join(workdir, 'out%d' % run_no)
+    shutil.rmtree(out_dir, ignore_errors=True)
+    os.makedirs(out_dir)
+    torrent = os.path.join(workdir, 'bench.torrent')
+    cmd = [args.client, '-f', torrent]
+    stdout = subprocess.DEVNULL
+    if args.tar:
+        stdout = open(os.path.join(out_dir, 'out.tar'), 'wb')
+    elif len(files) > 1:
+        cmd += ['-O', out_dir]
+    else:
+        cmd += ['-o', os.path.join(out_dir, torrent_name)]
+    cmd += args.client_args
+    log = open(os.path.join(workdir, 'client%d.log' % run_no), 'wb')
+
+    first_byte.value = 0.0
+    t0 = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=stdout, stderr=log)
+    _, status, ru = os.wait4(proc.pid, 0)
+    elapsed = time.monotonic() - t0
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    log.close()
+    if stdout is not subprocess.DEVNULL:
+        stdout.close()
+
+    ok = proc.returncode == 0
+    if ok and not args.tar and not args.no_verify:
+        # -O кладёт файлы прямо в директорию, без имени торрента
+        seed_root = os.path.join(workdir, 'seed', torrent_name) if len(files) > 1 else os.path.join(workdir, 'seed')
+        for path, _ in files:
+            got = os.path.join(out_dir, os.path.relpath(path, seed_root))
+            if not os.path.exists(got) or not same_file(path, got):
+                print('run %d: %s differs from source' % (run_no, got), file=sys.stderr)
+                ok = False
+                break
+    if not args.keep:
+        shutil.rmtree(out_dir, ignore_errors=True)
+
+    size = sum(l for _, l in files)
+    cpu = ru.ru_utime + ru.ru_stime
+    return {
+        'run': run_no,
+        'ok': ok,
+        'exit_code': proc.returncode,
+        'seconds': elapsed,
+        'mb_per_s': size / elapsed / 1e6 if elapsed > 0 else 0.0,
+        'cpu_user_s': ru.ru_utime,
+        'cpu_sys_s': ru.ru_stime,
+        'cpu_pct': 100.0 * cpu / elapsed if elapsed > 0 else 0.0,
+        'peak_rss_kib': ru.ru_maxrss,
+        'ttfb_ms': (first_byte.value - t0) * 1000.0 if first_byte.value else None,
+    }
+
+
+def same_file(a, b):
+    with open(a, 'rb') as fa, open(b, 'rb') as fb:
+        while True:
+            x, y = fa.read(GEN_CHUNK), fb.read(GEN_CHUNK)
+            if x != y:
+                return False
+            if not x:
+                return True
+
+
+def median(values):
+    v = sorted(values)
+    return v[len(v) // 2] if v else None
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Loopback swarm benchmark for torrent_client')
+    ap.add_argument('--client', default=os.path.join(os.path.dirname(__file__), '..', 'builds', 'torrent_client'))
+    ap.add_argument('--size', type=parse_size, default=parse_size('64M'), help='total payload size (K/M/G suffix)')
+    ap.add_argument('--piece-length', type=parse_size, default=parse_size('256K'))
+    ap.add_argument('--files', type=int, default=1, help='number of files (>1 makes a multi-file torrent)')
+    ap.add_argument('--seeders', type=int, default=1, help='number of seeder processes')
+    ap.add_argument('--seeder-rate', type=parse_size, default=0, help='per-seeder upload limit, bytes/s (0 - unlimited)')
+    ap.add_argument('--family', choices=('4', '6', 'dual'), default='4',
+                    help='address family of seeders: peers (IPv4), peers6 (IPv6) or both lists')
+    ap.add_argument('--delay', type=float, default=0, help='netem delay on lo, ms (root required)')
+    ap.add_argument('--jitter', type=float, default=0, help='netem jitter, ms')
+    ap.add_argument('--loss', type=float, default=0, help='netem packet loss, %%')
+    ap.add_argument('--runs', type=int, default=1)
+    ap.add_argument('--seed', type=int, default=1, help='PRNG seed for generated data')
+    ap.add_argument('--tar', action='store_true', help='benchmark tar output to stdout instead of -o/-O')
+    ap.add_argument('--no-verify', action='store_true', help='do not compare downloaded files with the source')
+    ap.add_argument('--workdir', help='keep generated data here (default: temporary directory)')
+    ap.add_argument('--keep', action='store_true', help='keep downloaded output and the work directory')
+    ap.add_argument('--json', action='store_true', help='print results as JSON')
+    ap.add_argument('client_args', nargs='*', help='extra arguments for torrent_client (after --)')
+    args = ap.parse_args()
+
+    if not os.access(args.client, os.X_OK):
+        sys.exit('client %s not found, run make first' % args.client)
+    args.client = os.path.abspath(args.client)
+
+    workdir = args.workdir or tempfile.mkdtemp(prefix='tc-bench-')
+    os.makedirs(workdir, exist_ok=True)
+    tracker = Tracker()
+    seeders = []
+    netem = netem_args(args)
+    try:
+        t0 = time.monotonic()
+        info_hash, files, num_pieces, name = make_torrent(
+            workdir, args.size, args.piece_length, args.files, args.seed,
+            'http://127.0.0.1:%d/announce' % tracker.port)
+        gen_s = time.monotonic() - t0
+        if not args.json:
+            print('generated %d bytes in %d file(s), %d pieces of %d, %.1f s'
+                  % (args.size, len(files), num_pieces, args.piece_length, gen_s), file=sys.stderr)
+
+        first_byte = mp.Value('d', 0.0)
+        ports = []
+        for _ in range(max(1, args.seeders)):
+            rx, tx = mp.Pipe(duplex=False)
+            p = mp.Process(target=seeder_main, daemon=True,
+                           args=(info_hash, files, args.piece_length, num_pieces, args.seeder_rate, first_byte, tx,
+                                 args.family))
+            p.start()
+            seeders.append(p)
+            ports.append(rx.recv())
+        tracker.set_peers(ports, args.family)
+
+        if netem:
+            netem_apply(netem)
+        results = [run_client(args, workdir, name, files, first_byte, i + 1) for i in range(args.runs)]
+    finally:
+        if netem:
+            netem_remove()
+        for p in seeders:
+            p.terminate()
+        tracker.close()
+        if not args.keep and not args.workdir:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.json:
+        print(json.dumps({'size': args.size, 'piece_length': args.piece_length, 'files': args.files,
+                          'seeders': args.seeders, 'netem': ' '.join(netem), 'runs': results}, indent=2))
+    else:
+        print('%-4s %-3s %9s %9s %8s %8s %6s %10s %9s'
+              % ('run', 'ok', 'time,s', 'MB/s', 'user,s', 'sys,s', 'cpu%', 'rss,KiB', 'ttfb,ms'))
+        for r in results:
+            ttfb = '%.1f' % r['ttfb_ms'] if r['ttfb_ms'] is not None else '-'
+            print('%-4d %-3s %9.2f %9.1f %8.2f %8.2f %6.1f %10d %9s'
+                  % (r['run'], 'yes' if r['ok'] else 'NO', r['seconds'], r['mb_per_s'], r['cpu_user_s'],
+                     r['cpu_sys_s'], r['cpu_pct'], r['peak_rss_kib'], ttfb))
+        if len(results) > 1:
+            ttfbs = [r['ttfb_ms'] for r in results if r['ttfb_ms'] is not None]
+            print('median: %.1f MB/s, %.1f%% cpu, %d KiB rss, ttfb %s ms'
+                  % (median([r['mb_per_s'] for r in results]), median([r['cpu_pct'] for r in results]),
+                     median([r['peak_rss_kib'] for r in results]),
+                     '%.1f' % median(ttfbs) if ttfbs else '-'))
+    return 0 if all(r['ok'] for r in results) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
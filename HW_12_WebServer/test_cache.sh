@@ -0,0 +1,70 @@
+#!/bin/sh
+# Проверка кеша под нехваткой памяти (-m 1): сжатые на лету варианты и списки директорий
+# после вытеснения должны отдаваться целиком, а не заголовком с пустым телом.
+# Запуск: make test (нужны curl и gzip)
+
+PORT=${PORT:-18099}
+DIR=$(mktemp -d)
+URL=http://127.0.0.1:$PORT
+FAILED=0
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+mkdir "$DIR/text" "$DIR/bin" "$DIR/many"
+for i in $(seq 40); do
+    # текст сжимается, попадает в кеш вариантом gzip без файла
+    seq "$i" 20000 | tr '\n' ' ' > "$DIR/text/t$i.txt"
+done
+for i in $(seq 100); do
+    # 1.6 МБ небольших файлов - больше предела, но записей меньше FILE_CACHE_MAX
+    head -c 16000 /dev/urandom > "$DIR/bin/b$i.bin"
+done
+for i in $(seq 300); do
+    : > "$DIR/many/entry_$i.txt"
+done
+
+# один воркер: вытеснение идёт только из кеша своего воркера
+./webserver -w 1 -m 1 "$DIR" "127.0.0.1:$PORT" > /dev/null 2>&1 &
+PID=$!
+sleep 0.5
+
+fail() {
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# сжатые варианты и список директории по одному соединению (keep-alive)
+fetch_text() {
+    args=""
+    for i in $(seq 40); do
+        args="$args -o $DIR/out$i $URL/text/t$i.txt"
+    done
+    # shellcheck disable=SC2086
+    curl -s -m 5 --compressed $args || fail "curl text ($1)"
+    for i in $(seq 40); do
+        cmp -s "$DIR/out$i" "$DIR/text/t$i.txt" || fail "text/t$i.txt ($1)"
+    done
+    curl -s -m 5 "$URL/many/" -o "$DIR/listing" || fail "curl listing ($1)"
+    [ "$(grep -c entry_ "$DIR/listing")" -eq 300 ] || fail "listing ($1)"
+}
+
+fetch_text "cold"
+# небольшие файлы в памяти вытесняют варианты и список
+for round in 1 2; do
+    args=""
+    for i in $(seq 100); do
+        args="$args -o /dev/null $URL/bin/b$i.bin"
+    done
+    # shellcheck disable=SC2086
+    curl -s -m 20 $args || fail "curl bin (round $round)"
+    fetch_text "after eviction $round"
+done
+
+if [ "$FAILED" -eq 0 ]; then
+    echo "OK"
+fi
+exit "$FAILED"
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE                 /* CPU_SET, sched_setaffinity */
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,76 +12,549 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <time.h>
 #include <limits.h>
+#include <strings.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
 
 #define MAX_EVENTS 1024
-#define BUFFER_SIZE 4096
+#define BUFFER_SIZE 4096             /* начальный буфер запроса, растёт до REQUEST_MAX */
+#define REQUEST_MAX (64 * 1024)      /* предел строки запроса с заголовками (больше - 431) */
+#define HEADERS_MAX 64               /* заголовков в запросе (больше - 431) */
 #define HTTP_HEADER_SIZE 8192
 #define MAX_PATH_LEN 4096
 #define METHOD_LEN 16
 #define PATH_LEN 1024
 #define PROTOCOL_LEN 16
-#define MAX_HTML_LEN (1024*1024)
+#define MAX_HTML_LEN (1024*1024)    /* список директории больше этого кешируется во временном файле */
+#define LISTING_CHUNK (64 * 1024)    /* размер части потокового списка директории */
+#define KEEPALIVE_TIMEOUT 5         /* сколько секунд держать простаивающее соединение */
+#define KEEPALIVE_MAX_REQUESTS 1000 /* после стольких запросов соединение закрывается */
+#define SEND_TIMEOUT 30              /* сколько секунд ждать продвижения отправки медленному клиенту */
+#define MAX_WORKERS 256
+#define FILE_CACHE_BUCKETS 1024      /* корзин хеш-таблицы кеша файлов (степень двойки) */
+#define FILE_CACHE_MAX 256           /* открытых файлов в кеше одного воркера */
+#define FILE_CACHE_TTL 2             /* через сколько секунд запись кеша сверяется с диском */
+#define FILE_HEADER_SIZE 256
+#define RESPONSE_HEAD_SIZE 1024
+#define CACHE_RULE_VALUE_MAX 128                /* длина значения Cache-Control из -c */
+#define RANGES_MAX 16                           /* больше диапазонов в Range - отдаём файл целиком */
+#define COMPRESS_MIN 256                        /* файлы меньше не сжимаются на лету */
+#define COMPRESS_MAX (1024 * 1024)              /* и больше тоже - сжатие идёт в цикле событий */
+#define COMPRESS_LEVEL 6
+
+/* Кодировки ответа (Accept-Encoding), в порядке предпочтения */
+enum { ENC_BR, ENC_GZIP, ENC_COUNT };
+static const char* const encoding_names[ENC_COUNT] = { "br", "gzip" };
+static const char* const encoding_ext[ENC_COUNT] = { ".br", ".gz" };
+#define ETAG_LEN 64
+#define CACHE_RULES_MAX 32                      /* правил Cache-Control (-c) */
+#define SMALL_FILE_MAX (64 * 1024)              /* файлы не больше этого держатся в памяти (-s) */
+#define CONTENT_CACHE_MAX (64 * 1024 * 1024)    /* общий предел памяти под содержимое файлов (-m) */
+
+/* Настройки кеша содержимого (задаются до запуска воркеров) и занятая им память всех воркеров */
+static size_t small_file_max = SMALL_FILE_MAX;
+static size_t content_cache_max = CONTENT_CACHE_MAX;
+static _Atomic size_t content_cache_used;
+
+/* Cache-Control по префиксу пути запроса (-c prefix=value), выбирается самый длинный префикс */
+typedef struct {
+    const char* prefix;
+    const char* value;
+} cache_rule_t;
+
+static cache_rule_t cache_rules[CACHE_RULES_MAX];
+static int cache_rules_count;
+
+/* Участок буфера запроса (без копирования; значения заголовков ещё и нуль-терминированы) */
+typedef struct {
+    const char* ptr;
+    size_t len;
+} str_view_t;
 
 typedef struct {
-    char method[METHOD_LEN];
-    char path[PATH_LEN];
-    char protocol[PROTOCOL_LEN];
+    str_view_t name;
+    str_view_t value;
+} http_header_t;
+
+/* Запрос поверх буфера соединения: строки указывают в буфер и действительны до следующего запроса */
+typedef struct {
+    const char* method;
+    const char* protocol;
+    str_view_t target;          /* путь с query как пришёл */
+    str_view_t query;           /* после '?' (len == 0 - нет) */
+    char path[PATH_LEN];        /* путь без query, с раскрытыми %XX */
+    http_header_t headers[HEADERS_MAX];
+    int header_count;
+    int keep_alive;             /* клиент готов держать соединение (HTTP/1.1 без Connection: close) */
+    int has_body;               /* у запроса есть тело (Content-Length/Transfer-Encoding) */
+    const char* if_none_match;  /* список ETag из If-None-Match ("" - нет) */
+    time_t if_modified_since;   /* If-Modified-Since (0 - нет или не разобран) */
+    const char* range;          /* значение Range ("" - нет) */
+    const char* if_range;       /* If-Range: ETag или дата ("" - нет) */
+    unsigned accept_encoding;           /* биты 1 << ENC_* из Accept-Encoding */
 } http_request_t;
 
+/* Состояние разбора запроса: разбор продолжается с места, где остановился на прошлом recv.
+ * Хранятся смещения, а не указатели - буфер может вырасти (realloc) */
+typedef struct {
+    int state;
+    uint32_t pos;               /* разобрано байт */
+    uint32_t start;             /* начало строки запроса (пустые строки перед ней пропускаются) */
+    uint32_t mark;              /* начало текущего элемента */
+    uint32_t value_end;         /* конец значения заголовка без пробелов в конце */
+    uint32_t method_end, target_start, target_end, protocol_start, protocol_end;
+    uint32_t name[HEADERS_MAX][2];      /* смещение и длина имени заголовка */
+    uint32_t value[HEADERS_MAX][2];     /* смещение и длина значения */
+    int header_count;
+} http_parser_t;
+
+/* Диапазон байт файла [start, end] */
+typedef struct {
+    off_t start;
+    off_t end;
+} range_t;
+
+/* Открытый файл в кеше: всё, что нужно для ответа без обращения к файловой системе */
+typedef struct file_entry {
+    char* key;                  /* путь из запроса */
+    char* path;                 /* путь в файловой системе (сверка с диском по TTL) */
+    char* real_path;            /* разрешённый путь (realpath), проверенный на выход за base_dir */
+    int fd;
+    off_t size;
+    struct stat st;             /* метаданные при открытии: смена inode/размера/времени - запись устарела */
+    const char* mime_type;
+    char* content;              /* содержимое небольшого файла (NULL - отдаётся sendfile) */
+    int spilled;                /* fd - временный файл с большим списком директории, учтён в пределе памяти */
+    const char* encoding;       /* Content-Encoding сжатого варианта (NULL - исходный файл) */
+    int vary;                   /* у ресурса есть сжатые варианты - ответ зависит от Accept-Encoding */
+    unsigned variants;          /* биты 1 << ENC_*: рядом лежит file.br/file.gz */
+    int compress_useless;       /* сжатие на лету не помогло (или файл не подходит) */
+    time_t variants_checked;    /* когда искали file.br/file.gz */
+    char etag[ETAG_LEN];        /* "" - у ответа нет валидатора (список директории) */
+    char validators[FILE_HEADER_SIZE]; /* ETag, Last-Modified и Cache-Control - они же для 304 */
+    char header[FILE_HEADER_SIZE * 2]; /* готовая часть заголовка ответа (после Date, до Connection) */
+    int header_len;
+    time_t checked;             /* когда последний раз сверялись с диском */
+    int refs;                   /* ссылок из кеша и из отправляемых ответов */
+    int cached;                 /* запись ещё в кеше (иначе освобождается с последним ответом) */
+    struct file_entry* hash_next;
+    struct file_entry *prev, *next;  /* LRU: в начале - давно не использованные */
+} file_entry_t;
+
+/* Кеш открытых файлов воркера (у каждого свой - шард без блокировок) */
+typedef struct {
+    file_entry_t* buckets[FILE_CACHE_BUCKETS];
+    file_entry_t lru;           /* голова кольцевого списка */
+    int count;
+} file_cache_t;
+
+/* Ответ, который отправляется по мере готовности сокета (EPOLLOUT) */
 typedef struct {
+    char* data;                 /* заголовок и тело небольших ответов (NULL - ответа нет) */
+    size_t len;
+    size_t sent;
+    int file_fd;                /* тело из файла через sendfile (-1 - нет) */
+    off_t file_offset;
+    off_t file_end;
+    const char* body;           /* тело из памяти кеша после заголовка (уходит вместе с ним) */
+    size_t body_len;
+    file_entry_t* entry;        /* файл из кеша (file_fd и body принадлежат ему, а не ответу) */
+    DIR* dir;                   /* список директории дописывается по мере отправки (NULL - нет) */
+    int chunked;                /* части списка оформляются как Transfer-Encoding: chunked */
+    range_t* ranges;            /* части multipart/byteranges (NULL - нет) */
+    int range_count;
+    int range_index;            /* следующая часть; == range_count - осталась завершающая граница */
+    char boundary[32];
+    int keep_alive;             /* после отправки соединение остаётся открытым */
+    char head[RESPONSE_HEAD_SIZE]; /* заголовок ответа из кеша (data указывает сюда) */
+} response_t;
+
+typedef struct client_data {
     int fd;
-    char buffer[BUFFER_SIZE];
+    char* buffer;                       /* принятые, но не обработанные данные */
     size_t buffer_len;
-    int response_sent;
+    size_t buffer_cap;
+    http_parser_t parser;               /* разбор запроса в начале буфера */
+    int requests;                       /* обработано запросов на соединении */
+    response_t response;                /* текущий ответ; следующий запрос разбирается после его отправки */
+    time_t last_active;                 /* время последнего продвижения чтения или записи */
+    struct client_data *prev, *next;    /* список соединений по времени активности */
 } client_data_t;
 
-/* Парсинг HTTP-запроса */
-static int parse_http_request(const char* request, http_request_t* req) {
-    char method[METHOD_LEN], path[PATH_LEN], protocol[PROTOCOL_LEN];
+/* Состояние цикла событий (одного воркера: всё своё, общих данных и блокировок нет) */
+typedef struct {
+    int epoll_fd;
+    int listen_fd;              /* свой слушающий сокет (SO_REUSEPORT при нескольких воркерах) */
+    int cpu;                    /* CPU, к которому привязан поток (-1 - без привязки) */
+    pthread_t thread;
+    const char* base_dir;
+    char* real_base;            /* realpath(base_dir), вычисляется один раз */
+    char date[64];              /* значение заголовка Date, обновляется раз в секунду */
+    unsigned boundary_seq;      /* счётчик для границ multipart/byteranges */
+    time_t date_time;
+    file_cache_t files;
+    client_data_t idle;         /* ждут запроса; голова кольцевого списка, в начале - дольше всех простаивающие */
+    client_data_t writing;      /* отправляют ответ медленному клиенту */
+} server_t;
+
+/* Есть ли в списке через запятую (значение Connection) элемент token, без учёта регистра */
+static int strcasestr_token(const char* list, const char* token) {
+    size_t token_len = strlen(token);
+    const char* p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        const char* end = p;
+        while (*end && *end != ',') end++;
+        const char* last = end;
+        while (last > p && last[-1] == ' ') last--;
+        if ((size_t)(last - p) == token_len && strncasecmp(p, token, token_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
 
-    if (sscanf(request, "%15s %1023s %15s", method, path, protocol) != 3) {
-        return -1;
+/* Принимаемые кодировки из Accept-Encoding: биты 1 << ENC_*, q=0 исключает кодировку */
+static unsigned parse_accept_encoding(const char* value) {
+    unsigned accepted = 0;
+    const char* p = value;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        const char* name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ') p++;
+        size_t name_len = (size_t)(p - name);
+        double q = 1.0;
+        const char* params = p;
+        while (*p && *p != ',') p++;
+        const char* qp = strstr(params, "q=");
+        if (qp && qp < p) q = strtod(qp + 2, NULL);
+        if (q <= 0 || name_len == 0) continue;
+        for (int e = 0; e < ENC_COUNT; e++) {
+            if ((name_len == strlen(encoding_names[e]) && strncasecmp(name, encoding_names[e], name_len) == 0) ||
+                (e == ENC_GZIP && name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+                accepted |= 1u << e;
+            }
+        }
     }
+    return accepted;
+}
+
+/* Состояния разбора запроса */
+enum {
+    P_METHOD, P_TARGET, P_PROTOCOL, P_LINE_LF, P_HEADER_START, P_NAME,
+    P_VALUE_WS, P_VALUE, P_VALUE_LF, P_END_LF
+};
 
-    strncpy(req->method, method, sizeof(req->method) - 1);
-    strncpy(req->path, path, sizeof(req->path) - 1);
-    strncpy(req->protocol, protocol, sizeof(req->protocol) - 1);
+/* Символ, допустимый в методе и имени заголовка (tchar) */
+static int is_token_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+static void http_parser_reset(http_parser_t* p) {
+    p->state = P_METHOD;
+    p->pos = p->start = p->mark = 0;
+    p->header_count = 0;
+}
 
+/* Продолжение разбора строки запроса и заголовков: каждый байт просматривается один раз.
+ * Возвращает 1 - запрос целиком (p->pos - его длина), 0 - нужны ещё данные,
+ * иначе HTTP-статус ошибки (400, 414, 431) */
+static int http_parse(http_parser_t* p, const char* buf, size_t len) {
+    for (; p->pos < len; p->pos++) {
+        unsigned char c = (unsigned char)buf[p->pos];
+        uint32_t i = p->pos;
+        switch (p->state) {
+        case P_METHOD:
+            if (i == p->start && (c == '\r' || c == '\n')) {
+                /* пустые строки перед запросом (остаток предыдущего) пропускаем */
+                p->start = p->mark = i + 1;
+            } else if (c == ' ') {
+                if (i == p->start) return 400;
+                p->method_end = i;
+                p->target_start = i + 1;
+                p->state = P_TARGET;
+            } else if (!is_token_char(c) || i - p->start >= METHOD_LEN - 1) {
+                return 400;
+            }
+            break;
+        case P_TARGET:
+            if (c == ' ') {
+                if (i == p->target_start) return 400;
+                p->target_end = i;
+                p->protocol_start = i + 1;
+                p->state = P_PROTOCOL;
+            } else if (c <= ' ' || c == 0x7f) {
+                return 400;
+            } else if (i - p->target_start >= PATH_LEN - 1) {
+                return 414;
+            }
+            break;
+        case P_PROTOCOL:
+            if (c == '\r' || c == '\n') {
+                p->protocol_end = i;
+                if (i - p->protocol_start < 6 || strncmp(buf + p->protocol_start, "HTTP/", 5) != 0) return 400;
+                p->state = c == '\r' ? P_LINE_LF : P_HEADER_START;
+            } else if (c <= ' ' || i - p->protocol_start >= PROTOCOL_LEN - 1) {
+                return 400;
+            }
+            break;
+        case P_LINE_LF:
+        case P_VALUE_LF:
+            if (c != '\n') return 400;
+            p->state = P_HEADER_START;
+            break;
+        case P_HEADER_START:
+            if (c == '\r') {
+                p->state = P_END_LF;
+            } else if (c == '\n') {
+                p->pos++;
+                return 1;
+            } else if (is_token_char(c)) {
+                if (p->header_count >= HEADERS_MAX) return 431;
+                p->mark = i;
+                p->state = P_NAME;
+            } else {
+                /* в том числе перенос значения на новую строку (obs-fold) */
+                return 400;
+            }
+            break;
+        case P_NAME:
+            if (c == ':') {
+                if (i == p->mark) return 400;
+                p->name[p->header_count][0] = p->mark;
+                p->name[p->header_count][1] = i - p->mark;
+                p->state = P_VALUE_WS;
+            } else if (!is_token_char(c)) {
+                return 400;
+            }
+            break;
+        case P_VALUE_WS:
+            if (c == ' ' || c == '\t') break;
+            p->mark = p->value_end = i;
+            p->state = P_VALUE;
+            /* fallthrough */
+        case P_VALUE:
+            if (c == '\r' || c == '\n') {
+                p->value[p->header_count][0] = p->mark;
+                p->value[p->header_count][1] = p->value_end - p->mark;
+                p->header_count++;
+                p->state = c == '\r' ? P_VALUE_LF : P_HEADER_START;
+            } else if ((c < ' ' && c != '\t') || c == 0x7f) {
+                return 400;
+            } else if (c != ' ' && c != '\t') {
+                p->value_end = i + 1;
+            }
+            break;
+        case P_END_LF:
+            if (c != '\n') return 400;
+            p->pos++;
+            return 1;
+        }
+    }
     return 0;
 }
 
-/* Проверка безопасности пути (предотвращение path traversal) */
-static int is_safe_path(const char* base_dir, const char* requested_path) {
-    char* real_base = realpath(base_dir, NULL);
-    if (real_base == NULL) {
-        return 0;
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Раскрытие %XX в пути; управляющие байты (%00-%1F, %7F) и неполные последовательности - ошибка.
+ * Возвращает 0 или -1 */
+static int percent_decode(const char* src, size_t len, char* dst, size_t size) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = src[i];
+        if (c == '%') {
+            int hi = i + 2 < len ? hex_digit(src[i + 1]) : -1;
+            int lo = hi >= 0 ? hex_digit(src[i + 2]) : -1;
+            if (lo < 0) return -1;
+            c = (char)(hi * 16 + lo);
+            if ((unsigned char)c < 0x20 || c == 0x7f) return -1;
+            i += 2;
+        }
+        if (out + 1 >= size) return -1;
+        dst[out++] = c;
+    }
+    dst[out] = '\0';
+    return 0;
+}
+
+/* Имя заголовка без учёта регистра */
+static int header_is(const http_header_t* h, const char* name) {
+    size_t len = strlen(name);
+    return h->name.len == len && strncasecmp(h->name.ptr, name, len) == 0;
+}
+
+/* Сборка запроса из разобранного буфера: элементы строки запроса и значения заголовков
+ * нуль-терминируются на месте (разделители после них больше не нужны), путь раскрывается.
+ * Нужные серверу заголовки выбираются за один проход. Возвращает 0 или HTTP-статус ошибки */
+static int parse_http_request(char* buf, const http_parser_t* p, http_request_t* req) {
+    memset(req, 0, sizeof(*req));
+    buf[p->method_end] = '\0';
+    buf[p->protocol_end] = '\0';
+    req->method = buf + p->start;
+    req->protocol = buf + p->protocol_start;
+    req->target.ptr = buf + p->target_start;
+    req->target.len = p->target_end - p->target_start;
+    req->if_none_match = req->range = req->if_range = "";
+
+    const char* question = memchr(req->target.ptr, '?', req->target.len);
+    size_t path_len = question ? (size_t)(question - req->target.ptr) : req->target.len;
+    if (question) {
+        req->query.ptr = question + 1;
+        req->query.len = req->target.len - path_len - 1;
+    }
+    if (percent_decode(req->target.ptr, path_len, req->path, sizeof(req->path)) == -1) return 400;
+
+    const char* connection = NULL;
+    req->header_count = p->header_count;
+    for (int i = 0; i < p->header_count; i++) {
+        http_header_t* h = &req->headers[i];
+        h->name.ptr = buf + p->name[i][0];
+        h->name.len = p->name[i][1];
+        h->value.ptr = buf + p->value[i][0];
+        h->value.len = p->value[i][1];
+        buf[p->value[i][0] + p->value[i][1]] = '\0';
+
+        if (header_is(h, "Connection")) {
+            connection = h->value.ptr;
+        } else if (header_is(h, "Transfer-Encoding") ||
+                   (header_is(h, "Content-Length") && strtoul(h->value.ptr, NULL, 10) > 0)) {
+            req->has_body = 1;
+        } else if (header_is(h, "Range")) {
+            req->range = h->value.ptr;
+        } else if (header_is(h, "If-Range")) {
+            req->if_range = h->value.ptr;
+        } else if (header_is(h, "Accept-Encoding")) {
+            req->accept_encoding = parse_accept_encoding(h->value.ptr);
+        } else if (header_is(h, "If-None-Match")) {
+            /* условный запрос: If-None-Match главнее If-Modified-Since */
+            req->if_none_match = h->value.ptr;
+        } else if (header_is(h, "If-Modified-Since")) {
+            struct tm tm_info;
+            memset(&tm_info, 0, sizeof(tm_info));
+            const char* end = strptime(h->value.ptr, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+            if (end && *end == '\0') req->if_modified_since = timegm(&tm_info);
+        }
+    }
+
+    /* HTTP/1.1 держит соединение по умолчанию, HTTP/1.0 - только по Connection: keep-alive */
+    int is_http11 = strcmp(req->protocol, "HTTP/1.1") == 0;
+    if (connection) {
+        if (strcasestr_token(connection, "close")) {
+            req->keep_alive = 0;
+        } else {
+            req->keep_alive = is_http11 || strcasestr_token(connection, "keep-alive");
+        }
+    } else {
+        req->keep_alive = is_http11;
+    }
+
+    return 0;
+}
+
+/* Есть ли etag в списке If-None-Match (слабое сравнение: префикс W/ не учитывается; "*" - любой) */
+static int etag_match(const char* list, const char* etag) {
+    size_t etag_len = strlen(etag);
+    const char* p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        const char* end = p;
+        while (*end && *end != ',') end++;
+        const char* last = end;
+        while (last > p && last[-1] == ' ') last--;
+        if ((size_t)(last - p) == etag_len && strncmp(p, etag, etag_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
+
+/* Можно ли ответить 304: у клиента та же версия файла */
+static int not_modified(const http_request_t* req, const char* etag, time_t mtime) {
+    if (!etag[0]) return 0;
+    if (req->if_none_match[0]) return etag_match(req->if_none_match, etag);
+    return req->if_modified_since != 0 && mtime <= req->if_modified_since;
+}
+
+/* Cache-Control для пути запроса: самый длинный подходящий префикс из -c, NULL - нет правила */
+static const char* cache_control(const char* path) {
+    const char* value = NULL;
+    size_t best = 0;
+    for (int i = 0; i < cache_rules_count; i++) {
+        size_t len = strlen(cache_rules[i].prefix);
+        if (len >= best && strncmp(path, cache_rules[i].prefix, len) == 0) {
+            value = cache_rules[i].value;
+            best = len;
+        }
     }
+    return value;
+}
+
+/* ETag версии файла: inode, размер и время изменения с наносекундами */
+static void format_etag(char* buf, size_t size, const struct stat* st) {
+    snprintf(buf, size, "\"%llx-%llx-%llx\"", (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ull + (unsigned long long)st->st_mtim.tv_nsec);
+}
+
+/* Заголовки валидаторов и кеширования: ETag и Last-Modified (если etag не пуст), Cache-Control по пути */
+static int format_validators(char* buf, size_t size, const char* path, const char* etag, time_t mtime) {
+    int len = 0;
+    buf[0] = '\0';
+    if (etag[0]) {
+        struct tm tm_info;
+        gmtime_r(&mtime, &tm_info);
+        char date_buf[64];
+        strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+        len += snprintf(buf + len, size - len, "ETag: %s\r\nLast-Modified: %s\r\n", etag, date_buf);
+    }
+    const char* control = cache_control(path);
+    if (control && (size_t)len < size) {
+        len += snprintf(buf + len, size - len, "Cache-Control: %s\r\n", control);
+    }
+    return len;
+}
 
+/* Проверка безопасности пути (предотвращение path traversal).
+ * real_base - realpath базовой директории; при успехе *resolved - разрешённый путь (освобождает вызывающий) */
+static int is_safe_path(const char* real_base, const char* base_dir, const char* requested_path, char** resolved) {
     /* Строим полный путь запроса */
     char full_requested_path[MAX_PATH_LEN * 2];
     snprintf(full_requested_path, sizeof(full_requested_path), "%s/%s", base_dir, requested_path);
 
     char* real_requested = realpath(full_requested_path, NULL);
     if (real_requested == NULL) {
-        free(real_base);
         return 0;
     }
 
-    /* Проверяем, что запрошенный путь находится внутри базовой директории */
+    /* Проверяем, что запрошенный путь находится внутри базовой директории (а не в соседней с общим префиксом) */
     size_t base_len = strlen(real_base);
-    int is_safe = (strncmp(real_base, real_requested, base_len) == 0);
-
-    free(real_base);
-    free(real_requested);
+    int is_safe = strncmp(real_base, real_requested, base_len) == 0 &&
+                  (real_requested[base_len] == '/' || real_requested[base_len] == '\0' ||
+                   (base_len > 0 && real_base[base_len - 1] == '/'));
 
-    return is_safe;
+    if (!is_safe) {
+        free(real_requested);
+        return 0;
+    }
+    *resolved = real_requested;
+    return 1;
 }
 
 /* Получение MIME-типа по расширению файла */
@@ -108,77 +584,109 @@ static const char* get_mime_type(const char* filename) {
     return "application/octet-stream";
 }
 
-/* Генерация HTML-списка файлов */
-static int generate_file_list(const char* dir_path, char* output, size_t max_size) {
-    DIR* dir = opendir(dir_path);
-    if (!dir) return -1;
+/* Текстовые типы, которые имеет смысл сжимать */
+static int is_compressible(const char* mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 || strcmp(mime_type, "application/javascript") == 0 ||
+           strcmp(mime_type, "application/json") == 0;
+}
 
+/* Растущий буфер для HTML */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+/* Дописывание в буфер по формату printf, при нехватке места буфер растёт. Возвращает 0 или -1 */
+__attribute__((format(printf, 2, 3)))
+static int strbuf_printf(strbuf_t* sb, const char* fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int written = vsnprintf(sb->data ? sb->data + sb->len : NULL, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+        if (written < 0) return -1;
+        if ((size_t)written < sb->cap - sb->len) {
+            sb->len += (size_t)written;
+            return 0;
+        }
+        size_t cap = sb->cap ? sb->cap * 2 : 4096;
+        while (cap <= sb->len + (size_t)written) cap *= 2;
+        char* data = realloc(sb->data, cap);
+        if (!data) return -1;
+        sb->data = data;
+        sb->cap = cap;
+    }
+}
+
+/* Шапка HTML-списка файлов */
+static int listing_head(strbuf_t* sb, const char* dir_path) {
+    return strbuf_printf(sb,
+                         "<!DOCTYPE html>\n"
+                         "<html>\n"
+                         "<head>\n"
+                         "    <title>Directory Listing</title>\n"
+                         "    <style>\n"
+                         "        body { font-family: Arial, sans-serif; margin: 40px; }\n"
+                         "        h1 { color: #333; }\n"
+                         "        table { border-collapse: collapse; width: 100%%; }\n"
+                         "        th, td { padding: 8px; text-align: left; border-bottom: 1px solid #ddd; }\n"
+                         "        tr:hover { background-color: #f5f5f5; }\n"
+                         "        a { text-decoration: none; color: #0066cc; }\n"
+                         "        a:hover { text-decoration: underline; }\n"
+                         "        .size { text-align: right; }\n"
+                         "        .dir { font-weight: bold; }\n"
+                         "    </style>\n"
+                         "</head>\n"
+                         "<body>\n"
+                         "    <h1>Directory Listing: %s</h1>\n"
+                         "    <table>\n"
+                         "        <tr>\n"
+                         "            <th>Name</th>\n"
+                         "            <th>Size</th>\n"
+                         "            <th>Modified</th>\n"
+                         "        </tr>\n"
+                         "        <tr>\n"
+                         "            <td><a href=\"../\">..</a></td>\n"
+                         "            <td class=\"size\">-</td>\n"
+                         "            <td>-</td>\n"
+                         "        </tr>\n",
+                         dir_path);
+}
+
+static int listing_tail(strbuf_t* sb) {
+    return strbuf_printf(sb,
+                         "    </table>\n"
+                         "</body>\n"
+                         "</html>\n");
+}
+
+/* Строки списка для очередных элементов директории, пока буфер не достигнет limit.
+ * Метаданные - fstatat относительно открытой директории (без сборки и разбора полного пути);
+ * readdir читает элементы пачками через getdents64.
+ * Возвращает 1 - директория прочитана до конца, 0 - достигнут limit, -1 - нет памяти */
+static int listing_rows(strbuf_t* sb, DIR* dir, size_t limit) {
+    int dir_fd = dirfd(dir);
     struct dirent* entry;
     struct stat file_stat;
     char time_buf[64];
 
-    /* Начало HTML-документа */
-    char* ptr = output;
-    int remaining = max_size;
-
-    /* Формируем шапку страницы */
-    int written = snprintf(ptr, remaining,
-                           "<!DOCTYPE html>\n"
-                           "<html>\n"
-                           "<head>\n"
-                           "    <title>Directory Listing</title>\n"
-                           "    <style>\n"
-                           "        body { font-family: Arial, sans-serif; margin: 40px; }\n"
-                           "        h1 { color: #333; }\n"
-                           "        table { border-collapse: collapse; width: 100%%; }\n"
-                           "        th, td { padding: 8px; text-align: left; border-bottom: 1px solid #ddd; }\n"
-                           "        tr:hover { background-color: #f5f5f5; }\n"
-                           "        a { text-decoration: none; color: #0066cc; }\n"
-                           "        a:hover { text-decoration: underline; }\n"
-                           "        .size { text-align: right; }\n"
-                           "        .dir { font-weight: bold; }\n"
-                           "    </style>\n"
-                           "</head>\n"
-                           "<body>\n"
-                           "    <h1>Directory Listing: %s</h1>\n"
-                           "    <table>\n"
-                           "        <tr>\n"
-                           "            <th>Name</th>\n"
-                           "            <th>Size</th>\n"
-                           "            <th>Modified</th>\n"
-                           "        </tr>\n"
-                           "        <tr>\n"
-                           "            <td><a href=\"../\">..</a></td>\n"
-                           "            <td class=\"size\">-</td>\n"
-                           "            <td>-</td>\n"
-                           "        </tr>\n",
-                           dir_path);
-
-    /* если шапка занимает больше памяти, чем отведено, закрываем директорию, возвращаем ошибку */
-    if (written >= remaining) {
-        closedir(dir);
-        return -1;
-    }
+    while (sb->len < limit) {
+        /* Запись каждого элемента директории */
+        if ((entry = readdir(dir)) == NULL) return 1;
 
-    ptr += written;
-    remaining -= written;
-
-    /* Запись каждого элемента директории */
-    while ((entry = readdir(dir)) != NULL) {
         /* Пропускаем . и .. */
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
 
-        char full_path[MAX_PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-
-        if (stat(full_path, &file_stat) == -1) {
+        if (fstatat(dir_fd, entry->d_name, &file_stat, 0) == -1) {
             continue;
         }
 
-        struct tm* tm_info = localtime(&file_stat.st_mtime);
-        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
+        struct tm tm_info;
+        localtime_r(&file_stat.st_mtime, &tm_info);
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", &tm_info);
 
         const char* class_name = S_ISDIR(file_stat.st_mode) ? "dir" : "";
         char size_formatted[32] = "-";
@@ -197,57 +705,77 @@ static int generate_file_list(const char* dir_path, char* output, size_t max_siz
         }
 
         /* добавляем в ответ блок с данными о файле или папке */
-        written = snprintf(ptr, remaining,
-                           "        <tr>\n"
-                           "            <td class=\"%s\"><a href=\"%s%s\">%s</a></td>\n"
-                           "            <td class=\"size\">%s</td>\n"
-                           "            <td>%s</td>\n"
-                           "        </tr>\n",
-                           class_name,
-                           entry->d_name,
-                           S_ISDIR(file_stat.st_mode) ? "/" : "",
-                           entry->d_name,
-                           size_formatted,
-                           time_buf);
-
-        /* если записали в ответ больше, чем разрешено - прерываем дальнейшую обработку */
-        if (written >= remaining) break;
-        ptr += written;
-        remaining -= written;
-    }
-
-    closedir(dir);
-
-    /* Завершение HTML-документа */
-    written = snprintf(ptr, remaining,
-                       "    </table>\n"
-                       "</body>\n"
-                       "</html>\n");
-
-    /* если записали в ответ больше данных, чем допустимо - возвращаем ошибку*/
-    if (written >= remaining) return -1;
-
+        if (strbuf_printf(sb,
+                          "        <tr>\n"
+                          "            <td class=\"%s\"><a href=\"%s%s\">%s</a></td>\n"
+                          "            <td class=\"size\">%s</td>\n"
+                          "            <td>%s</td>\n"
+                          "        </tr>\n",
+                          class_name,
+                          entry->d_name,
+                          S_ISDIR(file_stat.st_mode) ? "/" : "",
+                          entry->d_name,
+                          size_formatted,
+                          time_buf) == -1) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-/* Отправка HTTP-ответа */
-static void send_http_response(int client_fd, int status_code, const char* status_text, const char* content_type, const char* body, size_t body_len) {
+/* Заголовок Connection (и Keep-Alive) для ответа */
+static int format_connection(char* buf, size_t size, int keep_alive) {
+    if (!keep_alive) return snprintf(buf, size, "Connection: close\r\n");
+    return snprintf(buf, size, "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+                    KEEPALIVE_TIMEOUT, KEEPALIVE_MAX_REQUESTS);
+}
+
+static int response_pending(const response_t* resp) {
+    return resp->data != NULL || resp->body != NULL || resp->file_fd != -1 || resp->dir != NULL ||
+           resp->ranges != NULL;
+}
+
+static void file_entry_release(file_entry_t* entry);
+
+static void response_free(response_t* resp) {
+    if (resp->data != resp->head) free(resp->data);
+    if (resp->entry) {
+        file_entry_release(resp->entry);
+    } else if (resp->file_fd != -1) {
+        close(resp->file_fd);
+    }
+    if (resp->dir) closedir(resp->dir);
+    resp->dir = NULL;
+    free(resp->ranges);
+    resp->ranges = NULL;
+    resp->range_count = resp->range_index = 0;
+    resp->data = NULL;
+    resp->len = resp->sent = 0;
+    resp->body = NULL;
+    resp->body_len = 0;
+    resp->file_fd = -1;
+    resp->entry = NULL;
+}
+
+/* Подготовка HTTP-ответа из заголовка и тела в памяти; отправляет его client_write */
+static int set_http_response(response_t* resp, int status_code, const char* status_text, const char* content_type, const char* body, size_t body_len, int keep_alive) {
     char header[HTTP_HEADER_SIZE];
     time_t now = time(NULL);
-    struct tm* tm_info = gmtime(&now);
+    struct tm tm_info;
+    gmtime_r(&now, &tm_info);
     char date_buf[64];
 
-    strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", tm_info);
+    strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
     /* заполняем заголовок */
     int header_len = snprintf(header, sizeof(header),
                               "HTTP/1.1 %d %s\r\n"
                               "Date: %s\r\n"
                               "Server: Simple HTTP Server\r\n"
-                              "Connection: close\r\n"
                               "Content-Length: %zu\r\n",
                               status_code, status_text,
                               date_buf,
                               body_len);
+    header_len += format_connection(header + header_len, sizeof(header) - header_len, keep_alive);
 
     /* если есть content_type, добавляем */
     if (content_type) {
@@ -258,13 +786,20 @@ static void send_http_response(int client_fd, int status_code, const char* statu
     /* добавляем пустую строку */
     header_len += snprintf(header + header_len, sizeof(header) - header_len, "\r\n");
 
-    /* Отправляем заголовок */
-    send(client_fd, header, header_len, 0);
+    /* заголовок и тело - одним буфером, чтобы уйти одним send */
+    resp->data = malloc(header_len + body_len);
+    if (!resp->data) return -1;
+    memcpy(resp->data, header, header_len);
+    if (body_len > 0) memcpy(resp->data + header_len, body, body_len);
+    resp->len = header_len + body_len;
+    resp->sent = 0;
+    resp->keep_alive = keep_alive;
+    return 0;
+}
 
-    /*  Отправляем тело, если есть */
-    if (body && body_len > 0) {
-        send(client_fd, body, body_len, 0);
-    }
+/* Ответ-ошибка с текстом статуса в теле */
+static int set_error_response(response_t* resp, int status_code, const char* status_line, int keep_alive) {
+    return set_http_response(resp, status_code, status_line + 4, "text/html", status_line, strlen(status_line), keep_alive);
 }
 
 /* Установка сокета в неблокирующий режим */
@@ -276,26 +811,830 @@ static int set_nonblocking(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-/* Обработка HTTP-запроса */
-static void handle_http_request(int client_fd, const char* request, const char* base_dir) {
+/* Значение заголовка Date; форматируется не чаще раза в секунду */
+static const char* http_date(server_t* srv) {
+    time_t now = time(NULL);
+    if (now != srv->date_time) {
+        struct tm tm_info;
+        gmtime_r(&now, &tm_info);
+        strftime(srv->date, sizeof(srv->date), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+        srv->date_time = now;
+    }
+    return srv->date;
+}
+
+/* Хеш пути запроса (FNV-1a) */
+static size_t path_hash(const char* path) {
+    size_t h = 2166136261u;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h & (FILE_CACHE_BUCKETS - 1);
+}
+
+static void file_cache_init(file_cache_t* cache) {
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+    cache->lru.prev = cache->lru.next = &cache->lru;
+    cache->count = 0;
+}
+
+/* Освобождение ссылки на запись; файл закрывается, когда запись убрана из кеша и не отправляется */
+static void file_entry_release(file_entry_t* entry) {
+    if (--entry->refs > 0) return;
+    if (entry->content) free(entry->content);
+    if (entry->content || entry->spilled) {
+        atomic_fetch_sub_explicit(&content_cache_used, (size_t)entry->size, memory_order_relaxed);
+    }
+    if (entry->fd != -1) close(entry->fd);
+    free(entry->key);
+    free(entry->path);
+    free(entry->real_path);
+    free(entry);
+}
+
+/* Удаление записи из кеша; ответы, которые ещё отправляют файл, держат свои ссылки */
+static void file_cache_remove(file_cache_t* cache, file_entry_t* entry) {
+    file_entry_t** link = &cache->buckets[path_hash(entry->key)];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->cached = 0;
+    cache->count--;
+    file_entry_release(entry);
+}
+
+static void file_cache_clear(file_cache_t* cache) {
+    while (cache->lru.next != &cache->lru) {
+        file_cache_remove(cache, cache->lru.next);
+    }
+}
+
+/* Перенос записи в конец LRU (недавно использованные) */
+static void file_cache_touch(file_cache_t* cache, file_entry_t* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = cache->lru.prev;
+    entry->next = &cache->lru;
+    cache->lru.prev->next = entry;
+    cache->lru.prev = entry;
+}
+
+/* Файл не менялся с момента открытия: тот же inode, размер, время изменения данных и атрибутов */
+static int same_file(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/* Поиск файла по пути запроса. Раз в FILE_CACHE_TTL секунд запись сверяется с диском одним stat
+ * (подмена файла, запись в него, смена прав или ссылки); устаревшая запись удаляется */
+static file_entry_t* file_cache_lookup(file_cache_t* cache, const char* key) {
+    file_entry_t* entry = cache->buckets[path_hash(key)];
+    while (entry && strcmp(entry->key, key) != 0) entry = entry->hash_next;
+    if (!entry) return NULL;
+
+    time_t now = time(NULL);
+    if (now - entry->checked >= FILE_CACHE_TTL) {
+        struct stat st;
+        if (stat(entry->path, &st) == -1 || !same_file(&st, &entry->st)) {
+            file_cache_remove(cache, entry);
+            return NULL;
+        }
+        entry->checked = now;
+    }
+    file_cache_touch(cache, entry);
+    return entry;
+}
+
+/* Резервирование памяти под содержимое в общем пределе; не хватает - освобождается содержимое
+ * давно не использованных файлов этого воркера (файлы остаются открытыми, отдаются sendfile),
+ * а записи без файла (списки директорий, сжатые варианты) и большие списки во временных файлах
+ * удаляются целиком.
+ * Содержимое, которое сейчас отправляется, не трогаем. Возвращает 0 - память зарезервирована */
+static int content_reserve(file_cache_t* cache, size_t size) {
+    size_t used = atomic_fetch_add_explicit(&content_cache_used, size, memory_order_relaxed) + size;
+    file_entry_t* entry = cache->lru.next;
+    while (used > content_cache_max && entry != &cache->lru) {
+        file_entry_t* next = entry->next;
+        if ((entry->content || entry->spilled) && entry->refs == 1) {
+            if (entry->fd == -1 || entry->spilled) {
+                /* список директории или сжатый вариант: без содержимого отдавать нечего - убираем запись */
+                file_cache_remove(cache, entry);
+                used = atomic_load_explicit(&content_cache_used, memory_order_relaxed);
+            } else {
+                free(entry->content);
+                entry->content = NULL;
+                used = atomic_fetch_sub_explicit(&content_cache_used, (size_t)entry->size, memory_order_relaxed) -
+                       (size_t)entry->size;
+            }
+        }
+        entry = next;
+    }
+    if (used > content_cache_max) {
+        /* остальное занято другими воркерами или отправляемыми ответами */
+        atomic_fetch_sub_explicit(&content_cache_used, size, memory_order_relaxed);
+        return -1;
+    }
+    return 0;
+}
+
+/* Чтение небольшого файла в память: дальше ответ уходит одним sendmsg без sendfile */
+static void file_entry_load(file_cache_t* cache, file_entry_t* entry) {
+    if (entry->size == 0 || (size_t)entry->size > small_file_max) return;
+    if (content_reserve(cache, (size_t)entry->size) == -1) return;
+
+    char* content = malloc((size_t)entry->size);
+    off_t done = 0;
+    while (content && done < entry->size) {
+        ssize_t n = pread(entry->fd, content + done, (size_t)(entry->size - done), done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;          /* ошибка или файл укоротился - отдадим через sendfile */
+        done += n;
+    }
+    if (!content || done < entry->size) {
+        free(content);
+        atomic_fetch_sub_explicit(&content_cache_used, (size_t)entry->size, memory_order_relaxed);
+        return;
+    }
+    entry->content = content;
+}
+
+/* Готовые заголовки записи: валидаторы (они же для 304) и заголовок ответа 200 */
+static void file_entry_render(file_entry_t* entry) {
+    int len = format_validators(entry->validators, sizeof(entry->validators), entry->key, entry->etag,
+                                entry->st.st_mtime);
+    if (entry->vary && (size_t)len < sizeof(entry->validators)) {
+        snprintf(entry->validators + len, sizeof(entry->validators) - len, "Vary: Accept-Encoding\r\n");
+    }
+    char encoding[64] = "";
+    if (entry->encoding) snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n", entry->encoding);
+    entry->header_len = snprintf(entry->header, sizeof(entry->header),
+                                 "Server: Simple HTTP Server\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "%s"
+                                 "Content-Length: %lld\r\n"
+                                 "%s%s",
+                                 entry->mime_type, encoding, (long long)entry->size,
+                                 entry->etag[0] && !entry->encoding ? "Accept-Ranges: bytes\r\n" : "",
+                                 entry->validators);
+}
+
+/* Новая запись кеша (ещё не в кеше, без открытого файла). real_path переходит во владение записи.
+ * Возвращает запись или NULL (не хватило памяти) */
+static file_entry_t* file_entry_new(const char* key, const char* path, char* real_path,
+                                    const struct stat* st, off_t size, const char* mime_type) {
+    file_entry_t* entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->key = strdup(key)) || !(entry->path = strdup(path))) {
+        if (entry) {
+            free(entry->key);
+            free(entry);
+        }
+        return NULL;
+    }
+    entry->st = *st;
+    entry->fd = -1;
+    entry->real_path = real_path;
+    entry->size = size;
+    entry->mime_type = mime_type;
+    entry->checked = time(NULL);
+    /* валидаторы - только у файлов: список директории меняется и без смены её mtime */
+    if (S_ISREG(st->st_mode)) {
+        format_etag(entry->etag, sizeof(entry->etag), st);
+        entry->vary = is_compressible(mime_type);
+    }
+    file_entry_render(entry);
+    return entry;
+}
+
+/* Добавление записи в кеш (при переполнении вытесняется давно не использованная) */
+static void file_cache_link(file_cache_t* cache, file_entry_t* entry) {
+    if (cache->count >= FILE_CACHE_MAX) {
+        file_cache_remove(cache, cache->lru.next);
+    }
+    size_t h = path_hash(entry->key);
+    entry->hash_next = cache->buckets[h];
+    cache->buckets[h] = entry;
+    entry->prev = entry->next = entry;
+    file_cache_touch(cache, entry);
+    entry->refs = 1;
+    entry->cached = 1;
+    cache->count++;
+}
+
+/* Открытие файла и добавление в кеш.
+ * real_path переходит во владение записи. Возвращает запись или NULL (errno - причина) */
+static file_entry_t* file_cache_insert(file_cache_t* cache, const char* key, const char* path, char* real_path) {
+    /* O_NONBLOCK: open не должен зависнуть на FIFO */
+    int fd = open(real_path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        free(real_path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        /* директория отдаётся списком, остальное (устройства, FIFO) не отдаём */
+        int err = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+        close(fd);
+        free(real_path);
+        errno = err;
+        return NULL;
+    }
+
+    file_entry_t* entry = file_entry_new(key, path, real_path, &st, st.st_size, get_mime_type(real_path));
+    if (!entry) {
+        close(fd);
+        free(real_path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->fd = fd;
+    file_entry_load(cache, entry);
+    file_cache_link(cache, entry);
+    return entry;
+}
+
+/* Ключ кеша для сжатого варианта ресурса ('\n' не встречается в пути запроса: percent_decode
+ * отвергает управляющие байты) */
+static void variant_key(char* buf, size_t size, const file_entry_t* entry, int enc) {
+    snprintf(buf, size, "%s\n%s", entry->key, encoding_names[enc]);
+}
+
+/* Сжатый вариант становится представлением исходного ресурса: его тип, своя кодировка и ETag */
+static void variant_init(file_entry_t* variant, const file_entry_t* entry, int enc) {
+    variant->mime_type = entry->mime_type;
+    variant->encoding = encoding_names[enc];
+    variant->vary = 1;
+    variant->variants = 0;
+    variant->compress_useless = 1;
+    variant->variants_checked = variant->checked;
+    file_entry_render(variant);
+}
+
+/* Сжатие файла в gzip на лету. Результат - запись с содержимым в памяти, сверяемая по TTL
+ * с исходным файлом и с ETag исходного ("-gzip" в конце). NULL - не сжали */
+static file_entry_t* compress_entry(file_cache_t* cache, file_entry_t* entry, const char* key) {
+    size_t size = (size_t)entry->size;
+    if (size < COMPRESS_MIN || size > COMPRESS_MAX) return NULL;
+
+    char* source = entry->content;
+    if (!source) {
+        source = malloc(size);
+        if (!source) return NULL;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(entry->fd, source + done, size - done, (off_t)done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        if (done < size) {
+            free(source);
+            return NULL;
+        }
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    char* out = NULL;
+    size_t out_len = 0;
+    /* 15 + 16: окно 32 КиБ и обёртка gzip */
+    if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+        size_t bound = deflateBound(&zs, (uLong)size);
+        out = malloc(bound);
+        if (out) {
+            zs.next_in = (Bytef*)source;
+            zs.avail_in = (uInt)size;
+            zs.next_out = (Bytef*)out;
+            zs.avail_out = (uInt)bound;
+            if (deflate(&zs, Z_FINISH) == Z_STREAM_END) out_len = zs.total_out;
+        }
+        deflateEnd(&zs);
+    }
+    if (source != entry->content) free(source);
+
+    /* выигрыш меньше 10% не стоит памяти и заголовков */
+    if (out_len == 0 || out_len > size - size / 10 || content_reserve(cache, out_len) == -1) {
+        free(out);
+        return NULL;
+    }
+    file_entry_t* variant = file_entry_new(key, entry->path, NULL, &entry->st, (off_t)out_len, entry->mime_type);
+    if (!variant) {
+        atomic_fetch_sub_explicit(&content_cache_used, out_len, memory_order_relaxed);
+        free(out);
+        return NULL;
+    }
+    variant->content = out;
+    snprintf(variant->etag, sizeof(variant->etag), "%.*s-gzip\"", (int)strlen(entry->etag) - 1, entry->etag);
+    variant_init(variant, entry, ENC_GZIP);
+    file_cache_link(cache, variant);
+    return variant;
+}
+
+/* Сжатый вариант файла для клиента: готовый file.br/file.gz рядом (отдаётся sendfile или из памяти,
+ * как обычный файл) или gzip на лету для текстовых типов. Варианты живут в том же кеше.
+ * Возвращает запись варианта или NULL - отдаём исходный файл */
+static file_entry_t* file_variant(server_t* srv, file_entry_t* entry, unsigned accepted) {
+    if (!accepted || !entry->etag[0] || entry->encoding) return NULL;
+    file_cache_t* cache = &srv->files;
+
+    /* наличие file.br/file.gz проверяется раз в FILE_CACHE_TTL */
+    time_t now = time(NULL);
+    if (now - entry->variants_checked >= FILE_CACHE_TTL) {
+        entry->variants = 0;
+        for (int e = 0; e < ENC_COUNT; e++) {
+            char path[MAX_PATH_LEN * 2 + 8];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s%s", entry->path, encoding_ext[e]);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) entry->variants |= 1u << e;
+        }
+        entry->variants_checked = now;
+        if (entry->variants && !entry->vary) {
+            entry->vary = 1;
+            file_entry_render(entry);
+        }
+    }
+
+    file_entry_t* variant = NULL;
+    char key[PATH_LEN + 16];
+    for (int e = 0; e < ENC_COUNT && !variant; e++) {
+        if (!(accepted & (1u << e))) continue;
+        int sibling = (entry->variants >> e) & 1;
+        if (!sibling && (e != ENC_GZIP || entry->compress_useless || !is_compressible(entry->mime_type))) continue;
+
+        variant_key(key, sizeof(key), entry, e);
+        variant = file_cache_lookup(cache, key);
+        if (variant) break;
+
+        if (sibling) {
+            /* готовый сжатый файл: та же проверка на выход за base_dir, что и у запросов */
+            char request_path[PATH_LEN + 8];
+            char* real_path;
+            char path[MAX_PATH_LEN * 2 + 8];
+            snprintf(request_path, sizeof(request_path), "%s%s", entry->key, encoding_ext[e]);
+            snprintf(path, sizeof(path), "%s%s", entry->path, encoding_ext[e]);
+            if (is_safe_path(srv->real_base, srv->base_dir, request_path, &real_path)) {
+                variant = file_cache_insert(cache, key, path, real_path);
+                if (variant) variant_init(variant, entry, e);
+            }
+        } else {
+            variant = compress_entry(cache, entry, key);
+            if (!variant) entry->compress_useless = 1;
+        }
+    }
+    return variant;
+}
+
+/* Ответ с файлом из кеша: заголовок собирается в буфере ответа без выделения памяти,
+ * тело небольшого файла уходит из памяти вместе с заголовком, большого - sendfile из открытого файла */
+static void set_file_response(server_t* srv, response_t* resp, file_entry_t* entry, int keep_alive) {
+    int len = snprintf(resp->head, sizeof(resp->head), "HTTP/1.1 200 OK\r\nDate: %s\r\n%s",
+                       http_date(srv), entry->header);
+    len += format_connection(resp->head + len, sizeof(resp->head) - len, keep_alive);
+    len += snprintf(resp->head + len, sizeof(resp->head) - len, "\r\n");
+    resp->data = resp->head;
+    resp->len = (size_t)len;
+    resp->sent = 0;
+    resp->entry = entry;
+    entry->refs++;
+    if (entry->content) {
+        resp->body = entry->content;
+        resp->body_len = (size_t)entry->size;
+    } else {
+        resp->file_fd = entry->fd;
+        resp->file_offset = 0;
+        resp->file_end = entry->size;
+    }
+    resp->keep_alive = keep_alive;
+}
+
+/* Ответ 304 Not Modified без тела; validators - ETag, Last-Modified и Cache-Control */
+static void set_not_modified_response(server_t* srv, response_t* resp, const char* validators, int keep_alive) {
+    int len = snprintf(resp->head, sizeof(resp->head),
+                       "HTTP/1.1 304 Not Modified\r\nDate: %s\r\nServer: Simple HTTP Server\r\n%s",
+                       http_date(srv), validators);
+    len += format_connection(resp->head + len, sizeof(resp->head) - len, keep_alive);
+    len += snprintf(resp->head + len, sizeof(resp->head) - len, "\r\n");
+    resp->data = resp->head;
+    resp->len = (size_t)len;
+    resp->sent = 0;
+    resp->keep_alive = keep_alive;
+}
+
+/* Разбор Range: bytes=a-b, a-, -n через запятую. Недостижимые диапазоны отбрасываются.
+ * Возвращает число диапазонов, 0 - ни один не достижим (416), -1 - заголовок не разобран
+ * или диапазонов слишком много (отдаётся весь файл) */
+static int parse_ranges(const char* value, off_t size, range_t* ranges, int max) {
+    if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+    const char* p = value + 6;
+    int count = 0, specs = 0;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (!*p) break;
+        if (++specs > max) return -1;
+
+        char* end;
+        off_t start, last;
+        if (*p == '-') {
+            /* последние n байт */
+            if (p[1] < '0' || p[1] > '9') return -1;
+            long long n = strtoll(p + 1, &end, 10);
+            if (n == 0 || size == 0) goto skip;
+            start = n >= size ? 0 : size - n;
+            last = size - 1;
+        } else {
+            if (*p < '0' || *p > '9') return -1;
+            start = strtoll(p, &end, 10);
+            if (*end != '-') return -1;
+            if (end[1] >= '0' && end[1] <= '9') {
+                last = strtoll(end + 1, &end, 10);
+                if (last < start) return -1;
+            } else {
+                end++;
+                last = size - 1;
+            }
+            if (start >= size) goto skip;
+            if (last >= size) last = size - 1;
+        }
+        ranges[count].start = start;
+        ranges[count].end = last;
+        count++;
+    skip:
+        while (*end == ' ') end++;
+        if (*end && *end != ',') return -1;
+        p = end;
+    }
+    return specs ? count : -1;
+}
+
+/* If-Range: диапазоны отдаются, только если у клиента та же версия (сильное сравнение ETag
+ * или точное совпадение даты Last-Modified) */
+static int if_range_match(const char* if_range, const file_entry_t* entry) {
+    if (!if_range[0]) return 1;
+    if (if_range[0] == '"') return strcmp(if_range, entry->etag) == 0;
+    if (strncmp(if_range, "W/", 2) == 0) return 0;
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    const char* end = strptime(if_range, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+    return end && *end == '\0' && timegm(&tm_info) == entry->st.st_mtime;
+}
+
+/* Заголовок части multipart/byteranges (buf == NULL - только длина) */
+static int format_range_part(char* buf, size_t size, const response_t* resp, const range_t* range) {
+    return snprintf(buf, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    resp->boundary, resp->entry->mime_type, (long long)range->start, (long long)range->end,
+                    (long long)resp->entry->size);
+}
+
+/* Следующая часть multipart/byteranges: её заголовок в буфере ответа и тело через sendfile,
+ * после последней части - завершающая граница */
+static void range_next_part(response_t* resp) {
+    if (resp->range_index < resp->range_count) {
+        const range_t* range = &resp->ranges[resp->range_index];
+        resp->len = (size_t)format_range_part(resp->head, sizeof(resp->head), resp, range);
+        resp->file_offset = range->start;
+        resp->file_end = range->end + 1;
+    } else {
+        resp->len = (size_t)snprintf(resp->head, sizeof(resp->head), "\r\n--%s--\r\n", resp->boundary);
+        resp->file_offset = resp->file_end;
+    }
+    resp->range_index++;
+    resp->data = resp->head;
+    resp->sent = 0;
+}
+
+/* Ответ 206 на диапазоны файла из кеша: один диапазон - тело из памяти или sendfile со смещением,
+ * несколько - multipart/byteranges, части которого дописываются по мере отправки.
+ * Возвращает 0, -1 - не хватило памяти */
+static int set_range_response(server_t* srv, response_t* resp, file_entry_t* entry,
+                              const range_t* ranges, int count, int keep_alive) {
+    int len = snprintf(resp->head, sizeof(resp->head),
+                       "HTTP/1.1 206 Partial Content\r\nDate: %s\r\nServer: Simple HTTP Server\r\n%s",
+                       http_date(srv), entry->validators);
+    resp->entry = entry;
+    entry->refs++;
+    if (count == 1) {
+        off_t part_len = ranges[0].end - ranges[0].start + 1;
+        len += snprintf(resp->head + len, sizeof(resp->head) - len,
+                        "Content-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n",
+                        entry->mime_type, (long long)ranges[0].start, (long long)ranges[0].end,
+                        (long long)entry->size, (long long)part_len);
+        if (entry->content) {
+            resp->body = entry->content + ranges[0].start;
+            resp->body_len = (size_t)part_len;
+        } else {
+            resp->file_fd = entry->fd;
+            resp->file_offset = ranges[0].start;
+            resp->file_end = ranges[0].end + 1;
+        }
+    } else {
+        resp->ranges = malloc(sizeof(range_t) * count);
+        if (!resp->ranges) return -1;
+        memcpy(resp->ranges, ranges, sizeof(range_t) * count);
+        resp->range_count = count;
+        resp->range_index = 0;
+        snprintf(resp->boundary, sizeof(resp->boundary), "%08llx%08x",
+                 (unsigned long long)time(NULL), ++srv->boundary_seq);
+
+        /* длина тела: заголовки и содержимое всех частей и завершающая граница */
+        off_t body_len = (off_t)strlen(resp->boundary) + 8;
+        for (int i = 0; i < count; i++) {
+            body_len += format_range_part(NULL, 0, resp, &ranges[i]) + ranges[i].end - ranges[i].start + 1;
+        }
+        len += snprintf(resp->head + len, sizeof(resp->head) - len,
+                        "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %lld\r\n",
+                        resp->boundary, (long long)body_len);
+        resp->file_fd = entry->fd;
+        resp->file_offset = resp->file_end = 0;
+    }
+    len += format_connection(resp->head + len, sizeof(resp->head) - len, keep_alive);
+    len += snprintf(resp->head + len, sizeof(resp->head) - len, "\r\n");
+    resp->data = resp->head;
+    resp->len = (size_t)len;
+    resp->sent = 0;
+    resp->keep_alive = keep_alive;
+    return 0;
+}
+
+/* Ответ представлением файла (исходным или сжатым) с учётом условных заголовков и Range.
+ * Возвращает 0, -1 - не хватило памяти */
+static int set_representation_response(server_t* srv, response_t* resp, const http_request_t* req,
+                                       file_entry_t* entry, int keep_alive) {
+    if (not_modified(req, entry->etag, entry->st.st_mtime)) {
+        set_not_modified_response(srv, resp, entry->validators, keep_alive);
+        return 0;
+    }
+    if (req->range[0] && entry->etag[0] && if_range_match(req->if_range, entry)) {
+        range_t ranges[RANGES_MAX];
+        int count = parse_ranges(req->range, entry->size, ranges, RANGES_MAX);
+        if (count > 0) return set_range_response(srv, resp, entry, ranges, count, keep_alive);
+        if (count == 0) {
+            /* ни один диапазон не достижим */
+            int len = snprintf(resp->head, sizeof(resp->head),
+                               "HTTP/1.1 416 Range Not Satisfiable\r\nDate: %s\r\nServer: Simple HTTP Server\r\n"
+                               "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n",
+                               http_date(srv), (long long)entry->size);
+            len += format_connection(resp->head + len, sizeof(resp->head) - len, keep_alive);
+            len += snprintf(resp->head + len, sizeof(resp->head) - len, "\r\n");
+            resp->data = resp->head;
+            resp->len = (size_t)len;
+            resp->sent = 0;
+            resp->keep_alive = keep_alive;
+            return 0;
+        }
+    }
+    set_file_response(srv, resp, entry, keep_alive);
+    return 0;
+}
+
+/* Ответ на запрос файла из кеша: выбор сжатого варианта по Accept-Encoding (только для ответа
+ * целиком). Исходная запись удерживается, пока добавление варианта может её вытеснить.
+ * Возвращает 0, -1 - не хватило памяти */
+static int set_entry_response(server_t* srv, response_t* resp, const http_request_t* req,
+                              file_entry_t* entry, int keep_alive) {
+    if (req->range[0] || !req->accept_encoding) {
+        return set_representation_response(srv, resp, req, entry, keep_alive);
+    }
+    entry->refs++;
+    file_entry_t* variant = file_variant(srv, entry, req->accept_encoding);
+    int ret = set_representation_response(srv, resp, req, variant ? variant : entry, keep_alive);
+    file_entry_release(entry);
+    return ret;
+}
+
+/* Очередная часть потокового списка директории: строки примерно на LISTING_CHUNK байт,
+ * в конце - окончание HTML (и завершающая пустая часть chunked). Возвращает 0 или -1 */
+static int listing_next_chunk(response_t* resp) {
+    strbuf_t sb = {0};
+    /* место под размер части; ведущие нули в chunk-size допустимы */
+    if (resp->chunked && strbuf_printf(&sb, "%08x\r\n", 0) == -1) return -1;
+    size_t prefix = sb.len;
+
+    int ret = listing_rows(&sb, resp->dir, LISTING_CHUNK);
+    if (ret == 1) {
+        closedir(resp->dir);
+        resp->dir = NULL;
+        ret = listing_tail(&sb);
+    }
+    if (ret == 0 && resp->chunked) {
+        char size_line[16];
+        snprintf(size_line, sizeof(size_line), "%08zx\r\n", sb.len - prefix);
+        memcpy(sb.data, size_line, prefix);
+        ret = strbuf_printf(&sb, resp->dir ? "\r\n" : "\r\n0\r\n\r\n");
+    }
+    if (ret == -1) {
+        free(sb.data);
+        return -1;
+    }
+    resp->data = sb.data;
+    resp->len = sb.len;
+    resp->sent = 0;
+    return 0;
+}
+
+/* Безымянный временный файл в $TMPDIR (или /tmp): удаляется вместе с последним дескриптором.
+ * Возвращает дескриптор или -1 */
+static int spill_open(void) {
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+    /* файловая система без O_TMPFILE */
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/webserver-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) unlink(path);
+    return fd;
+}
+
+/* Запись буфера в файл целиком. Возвращает 0 или -1 */
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Большой список директории во временный файл: начало уже в sb, остальные строки дописываются
+ * частями по LISTING_CHUNK, так что в памяти не собирается весь список.
+ * Возвращает дескриптор файла (позиция директории - в конце) или -1 */
+static int listing_spill(DIR* dir, strbuf_t* sb) {
+    int fd = spill_open();
+    if (fd == -1) return -1;
+    int ret = 0;
+    while (ret == 0) {
+        if (write_all(fd, sb->data, sb->len) == -1) break;
+        sb->len = 0;
+        ret = listing_rows(sb, dir, LISTING_CHUNK);
+    }
+    if (ret == 1 && listing_tail(sb) == 0 && write_all(fd, sb->data, sb->len) == 0) return fd;
+    close(fd);
+    return -1;
+}
+
+/* Ответ со списком директории. Список до MAX_HTML_LEN попадает в кеш в памяти, больший -
+ * во временном файле и отдаётся sendfile; оба сверяются с директорией по времени изменения,
+ * как файлы, и учитываются в пределе памяти -m. Если временный файл не создать, список уходит
+ * частями по мере отправки, без общего буфера: chunked для HTTP/1.1, до закрытия соединения для HTTP/1.0.
+ * Возвращает 0, если ответ подготовлен, -1 - не хватило памяти */
+static int set_listing_response(server_t* srv, response_t* resp, const char* key, const char* dir_path,
+                                int chunked_ok, int keep_alive) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        return set_error_response(resp, errno == EACCES ? 403 : 404,
+                                  errno == EACCES ? "403 Forbidden" : "404 Not Found", keep_alive);
+    }
+    struct stat st;
+    if (fstat(dirfd(dir), &st) == -1) {
+        closedir(dir);
+        return set_error_response(resp, 500, "500 Internal Server Error", keep_alive);
+    }
+
+    strbuf_t sb = {0};
+    int ret = listing_head(&sb, dir_path);
+    if (ret == 0) ret = listing_rows(&sb, dir, MAX_HTML_LEN);
+    if (ret == 1) {
+        closedir(dir);
+        dir = NULL;
+        ret = listing_tail(&sb);
+    }
+    if (ret == -1) {
+        if (dir) closedir(dir);
+        free(sb.data);
+        return set_error_response(resp, 500, "500 Internal Server Error", keep_alive);
+    }
+
+    if (!dir) {
+        /* список целиком: в кеш, если позволяет общий предел памяти */
+        file_entry_t* entry = NULL;
+        if (content_reserve(&srv->files, sb.len) == 0) {
+            entry = file_entry_new(key, dir_path, NULL, &st, (off_t)sb.len, "text/html");
+            if (!entry) atomic_fetch_sub_explicit(&content_cache_used, sb.len, memory_order_relaxed);
+        }
+        if (entry) {
+            entry->content = sb.data;
+            file_cache_link(&srv->files, entry);
+            set_file_response(srv, resp, entry, keep_alive);
+            return 0;
+        }
+        ret = set_http_response(resp, 200, "OK", "text/html", sb.data, sb.len, keep_alive);
+        free(sb.data);
+        return ret;
+    }
+
+    /* большая директория: целиком во временный файл, в кеш - если позволяет предел памяти */
+    int spill_fd = listing_spill(dir, &sb);
+    struct stat spill_st;
+    if (spill_fd != -1 && fstat(spill_fd, &spill_st) == 0) {
+        closedir(dir);
+        free(sb.data);
+        file_entry_t* entry = file_entry_new(key, dir_path, NULL, &st, spill_st.st_size, "text/html");
+        if (!entry) {
+            close(spill_fd);
+            return -1;
+        }
+        entry->fd = spill_fd;
+        if (content_reserve(&srv->files, (size_t)spill_st.st_size) == 0) {
+            entry->spilled = 1;
+            file_cache_link(&srv->files, entry);
+        }
+        /* не в кеше - запись освобождается (и файл закрывается) вместе с ответом */
+        set_file_response(srv, resp, entry, keep_alive);
+        return 0;
+    }
+    if (spill_fd != -1) close(spill_fd);
+    /* временного файла нет - список заново и частями: заголовок и первая часть сейчас,
+     * остальное - listing_next_chunk */
+    rewinddir(dir);
+    sb.len = 0;
+    ret = listing_head(&sb, dir_path);
+    if (ret == 0) ret = listing_rows(&sb, dir, MAX_HTML_LEN);
+    if (ret == 1) {
+        /* директория успела уменьшиться: список целиком, без кеша */
+        closedir(dir);
+        ret = listing_tail(&sb);
+        if (ret == 0) ret = set_http_response(resp, 200, "OK", "text/html", sb.data, sb.len, keep_alive);
+        free(sb.data);
+        return ret;
+    }
+    if (ret == -1) {
+        closedir(dir);
+        free(sb.data);
+        return set_error_response(resp, 500, "500 Internal Server Error", keep_alive);
+    }
+
+    if (!chunked_ok) keep_alive = 0;
+    char header[HTTP_HEADER_SIZE];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Date: %s\r\n"
+                              "Server: Simple HTTP Server\r\n"
+                              "Content-Type: text/html\r\n"
+                              "%s",
+                              http_date(srv), chunked_ok ? "Transfer-Encoding: chunked\r\n" : "");
+    header_len += format_connection(header + header_len, sizeof(header) - header_len, keep_alive);
+    char size_line[32];
+    int size_len = chunked_ok ? snprintf(size_line, sizeof(size_line), "\r\n%zx\r\n", sb.len)
+                              : snprintf(size_line, sizeof(size_line), "\r\n");
+
+    resp->data = malloc((size_t)header_len + (size_t)size_len + sb.len + 2);
+    if (!resp->data) {
+        closedir(dir);
+        free(sb.data);
+        return -1;
+    }
+    char* p = resp->data;
+    memcpy(p, header, header_len);
+    p += header_len;
+    memcpy(p, size_line, size_len);
+    p += size_len;
+    memcpy(p, sb.data, sb.len);
+    p += sb.len;
+    if (chunked_ok) {
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+    free(sb.data);
+    resp->len = (size_t)(p - resp->data);
+    resp->sent = 0;
+    resp->dir = dir;
+    resp->chunked = chunked_ok;
+    resp->keep_alive = keep_alive;
+    return 0;
+}
+
+/* Обработка HTTP-запроса, разобранного parser в начале request:
+ * заполняет resp (заголовок в памяти, тело из памяти или файла).
+ * keep_alive - сервер готов оставить соединение (лимит запросов не исчерпан).
+ * Возвращает 0, если ответ подготовлен, -1 - не хватило памяти */
+static int handle_http_request(server_t* srv, response_t* resp, char* request, const http_parser_t* parser,
+                               int keep_alive) {
+    const char* base_dir = srv->base_dir;
     http_request_t req;
 
     /* обработка запроса (метод, путь, протокол ) */
-    if (parse_http_request(request, &req) == -1) {
-        const char* bad_request = "400 Bad Request";
+    if (parse_http_request(request, parser, &req) != 0) {
         /* если нудачно, отправляем ошибку обработки запроса */
-        send_http_response(client_fd, 400, bad_request, "text/html", bad_request, strlen(bad_request));
-        return;
+        return set_error_response(resp, 400, "400 Bad Request", 0);
     }
+    /* тело запроса не читаем - после него границы следующего запроса неизвестны */
+    keep_alive = keep_alive && req.keep_alive && !req.has_body;
 
     /* Поддерживаем только GET */
     if (strcmp(req.method, "GET") != 0) {
         /* уведомляем, что метод не поддерживается */
-        const char* not_allowed = "405 Method Not Allowed";
-        send_http_response(client_fd, 405, not_allowed, "text/html", not_allowed, strlen(not_allowed));
-        return;
+        return set_error_response(resp, 405, "405 Method Not Allowed", 0);
     }
 
+    /* Файл уже открыт и проверен - ни одного обращения к файловой системе */
+    file_entry_t* entry = file_cache_lookup(&srv->files, req.path);
+    if (entry) return set_entry_response(srv, resp, &req, entry, keep_alive);
+
     /* Обрабатываем путь */
     char file_path[MAX_PATH_LEN * 2];
     /* если запрашиваемый путь - корень, то используем директорию, переданную в параметрах в качестве пути */
@@ -307,155 +1646,290 @@ static void handle_http_request(int client_fd, const char* request, const char*
     }
 
     /* Проверяем безопасность пути */
-    if (!is_safe_path(base_dir, req.path)) {
-        const char* forbidden = "403 Forbidden";
-        send_http_response(client_fd, 403, forbidden, "text/html", forbidden, strlen(forbidden));
-        return;
+    char* real_path;
+    if (!is_safe_path(srv->real_base, base_dir, req.path, &real_path)) {
+        return set_error_response(resp, 403, "403 Forbidden", keep_alive);
     }
 
-    struct stat file_stat;
+    /* Условный запрос к файлу вне кеша: хватает stat, файл не открывается */
+    if (req.if_none_match[0] || req.if_modified_since) {
+        struct stat st;
+        if (stat(real_path, &st) == 0 && S_ISREG(st.st_mode) && access(real_path, R_OK) == 0) {
+            char etag[ETAG_LEN];
+            format_etag(etag, sizeof(etag), &st);
+            if (not_modified(&req, etag, st.st_mtime)) {
+                char validators[FILE_HEADER_SIZE];
+                int len = format_validators(validators, sizeof(validators), req.path, etag, st.st_mtime);
+                /* как и у записи кеша: 304 несёт те же Vary, что и полный ответ */
+                if (is_compressible(get_mime_type(real_path)) && (size_t)len < sizeof(validators)) {
+                    snprintf(validators + len, sizeof(validators) - len, "Vary: Accept-Encoding\r\n");
+                }
+                set_not_modified_response(srv, resp, validators, keep_alive);
+                free(real_path);
+                return 0;
+            }
+        }
+    }
 
-    /* Проверяем существование файла/директории */
-    if (stat(file_path, &file_stat) == -1) {
-        const char* not_found = "404 Not Found";
-        send_http_response(client_fd, 404, not_found, "text/html", not_found, strlen(not_found));
-        return;
+    /* Файл открывается и попадает в кеш; права и существование проверяет open */
+    entry = file_cache_insert(&srv->files, req.path, file_path, real_path);
+    if (entry) return set_entry_response(srv, resp, &req, entry, keep_alive);
+    if (errno == ENOMEM) return -1;
+    if (errno != EISDIR) {
+        return set_error_response(resp, errno == EACCES ? 403 : 404,
+                                  errno == EACCES ? "403 Forbidden" : "404 Not Found", keep_alive);
     }
 
     /* Проверяем права доступа */
     if (access(file_path, R_OK) == -1) {
-        const char* forbidden = "403 Forbidden";
-        send_http_response(client_fd, 403, forbidden, "text/html", forbidden, strlen(forbidden));
-        return;
+        return set_error_response(resp, 403, "403 Forbidden", keep_alive);
     }
 
-    /* Если это директория - показываем список файлов */
-    if (S_ISDIR(file_stat.st_mode)) {
-        /* для списка файлов */
-        char* html_content = malloc(MAX_HTML_LEN);
-        if (!html_content) {
-            /* не удадлось выделить память - возвращаем внтреннюю ошибку сервера */
-            const char* server_error = "500 Internal Server Error";
-            send_http_response(client_fd, 500, server_error, "text/html", server_error, strlen(server_error));
-            return;
+    /* Это директория - показываем список файлов */
+    return set_listing_response(srv, resp, req.path, file_path,
+                                strcmp(req.protocol, "HTTP/1.1") == 0, keep_alive);
+}
+
+/* Закрытие соединения: снимаем с epoll и из списка активности, освобождаем память */
+static void client_close(server_t* srv, client_data_t* client) {
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    response_free(&client->response);
+    client->prev->next = client->next;
+    client->next->prev = client->prev;
+    free(client->buffer);
+    free(client);
+}
+
+/* Отметка активности: соединение переносится в конец своего списка (ждущие запроса или
+ * отправляющие ответ), поэтому каждый список упорядочен по last_active */
+static void client_touch(server_t* srv, client_data_t* client) {
+    client_data_t* list = response_pending(&client->response) ? &srv->writing : &srv->idle;
+    client->last_active = time(NULL);
+    client->prev->next = client->next;
+    client->next->prev = client->prev;
+    client->prev = list->prev;
+    client->next = list;
+    list->prev->next = client;
+    list->prev = client;
+}
+
+/* Отправка заголовка и тела из памяти. Возвращает 1 - отправлены, 0 - буфер сокета полон, -1 - ошибка */
+static int client_send_buffers(client_data_t* client) {
+    response_t* resp = &client->response;
+    while (resp->sent < resp->len + resp->body_len) {
+        /* заголовок и тело из памяти - одним вызовом (writev с флагами) */
+        struct iovec iov[2];
+        struct msghdr msg = { .msg_iov = iov };
+        if (resp->sent < resp->len) {
+            iov[msg.msg_iovlen++] = (struct iovec){ resp->data + resp->sent, resp->len - resp->sent };
+        }
+        if (resp->body_len > 0) {
+            size_t off = resp->sent > resp->len ? resp->sent - resp->len : 0;
+            iov[msg.msg_iovlen++] = (struct iovec){ (char*)resp->body + off, resp->body_len - off };
         }
+        /* MSG_MORE: заголовок и начало файла уходят общими сегментами */
+        ssize_t sent = sendmsg(client->fd, &msg,
+                               MSG_NOSIGNAL | (resp->file_fd != -1 ? MSG_MORE : 0));
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        resp->sent += (size_t)sent;
+    }
+    return 1;
+}
 
-        if (generate_file_list(file_path, html_content, MAX_HTML_LEN) == 0) {
-            /* если список сгенерирован успешно - возвращаем 200 и содержимое в html формате */
-            send_http_response(client_fd, 200, "OK", "text/html", html_content, strlen(html_content));
+/* Отправка текущего ответа, пока сокет принимает данные.
+ * Возвращает 1 - ответ отправлен, 0 - буфер сокета полон (продолжим по EPOLLOUT), -1 - ошибка */
+static int client_write(client_data_t* client) {
+    response_t* resp = &client->response;
+    while (1) {
+        int ret = client_send_buffers(client);
+        if (ret <= 0) return ret;
+        while (resp->file_fd != -1 && resp->file_offset < resp->file_end) {
+            ssize_t sent = sendfile(client->fd, resp->file_fd, &resp->file_offset, resp->file_end - resp->file_offset);
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            if (sent == 0) return -1; /* файл укоротился - Content-Length уже не выполнить */
+        }
+        if (resp->dir) {
+            /* буфер ушёл - дописываем следующую часть списка директории */
+            free(resp->data);
+            resp->data = NULL;
+            if (listing_next_chunk(resp) == -1) return -1;
+        } else if (resp->ranges && resp->range_index <= resp->range_count) {
+            range_next_part(resp);
         } else {
-            /* в противном случае - внутреняя ошибка сервера */
-            const char* server_error = "500 Internal Server Error";
-            send_http_response(client_fd, 500, server_error, "text/html", server_error, strlen(server_error));
+            return 1;
         }
-
-        free(html_content);
-        return;
     }
+}
 
-    /* если запрошен файл (запрошенный путь совпадает с путем файла) - отправляем его содержимое */
-    int file_fd = open(file_path, O_RDONLY);
-    if (file_fd == -1) {
-        /* если файл не обнаружен, возвращаем 404 */
-        const char* not_found = "404 Not Found";
-        send_http_response(client_fd, 404, not_found, "text/html", not_found, strlen(not_found));
-        return;
+/* Разбор следующего запроса из буфера (конвейер, HTTP pipelining) и подготовка ответа.
+ * Разбор продолжается с места остановки, поэтому медленный клиент не приводит к повторным проходам.
+ * Возвращает 1 - ответ подготовлен, 0 - полного запроса в буфере нет, -1 - соединение нужно закрыть */
+static int next_request(server_t* srv, client_data_t* client) {
+    http_parser_t* parser = &client->parser;
+    int ret = http_parse(parser, client->buffer, client->buffer_len);
+    if (ret == 0) {
+        if (client->buffer_len < client->buffer_cap) return 0;
+        /* буфер заполнен, а запрос не кончился - растим до REQUEST_MAX */
+        if (client->buffer_cap < REQUEST_MAX) {
+            char* buffer = realloc(client->buffer, client->buffer_cap * 2);
+            if (!buffer) return -1;
+            client->buffer = buffer;
+            client->buffer_cap *= 2;
+            return 0;
+        }
+        ret = 431;
+    }
+    if (ret != 1) {
+        /* после ошибки границы следующего запроса неизвестны - соединение закрывается */
+        const char* status = ret == 414 ? "414 URI Too Long" :
+                             ret == 431 ? "431 Request Header Fields Too Large" : "400 Bad Request";
+        return set_error_response(&client->response, ret, status, 0) == 0 ? 1 : -1;
     }
 
+    /* Запрос обрабатывается на месте, остаток (следующие запросы конвейера) сдвигается в начало буфера */
+    size_t request_len = parser->pos;
+    client->requests++;
+    ret = handle_http_request(srv, &client->response, client->buffer, parser,
+                              client->requests < KEEPALIVE_MAX_REQUESTS);
+    memmove(client->buffer, client->buffer + request_len, client->buffer_len - request_len);
+    client->buffer_len -= request_len;
+    http_parser_reset(parser);
+    return ret == 0 ? 1 : -1;
+}
 
+/* Продвижение соединения по готовности сокета: дописать текущий ответ, затем разобрать
+ * следующий запрос из буфера, а когда полных запросов нет - дочитать сокет до EAGAIN
+ * (epoll в режиме edge-triggered). Ответ на каждый запрос отправляется целиком до разбора
+ * следующего, поэтому порядок ответов совпадает с порядком запросов; пока ответ не ушёл,
+ * сокет не читается - медленный клиент сам ограничивает свой конвейер.
+ * Возвращает 0 - соединение остаётся, -1 - его нужно закрыть */
+static int client_advance(server_t* srv, client_data_t* client) {
+    while (1) {
+        if (response_pending(&client->response)) {
+            int ret = client_write(client);
+            if (ret <= 0) return ret;
+            int keep_alive = client->response.keep_alive;
+            response_free(&client->response);
+            if (!keep_alive) return -1;
+        }
 
-    /* поределяем mime-type для файла*/
-    const char* mime_type = get_mime_type(file_path);
+        int ret = next_request(srv, client);
+        if (ret == -1) return -1;
+        if (ret == 1) continue;
 
-    /* Заполняем структуру времени */
-    time_t now = time(NULL);
-    struct tm* tm_info = gmtime(&now);
-    char date_buf[64];
+        ssize_t bytes_read = recv(client->fd, client->buffer + client->buffer_len,
+                                  client->buffer_cap - client->buffer_len, 0);
+        if (bytes_read > 0) {
+            client->buffer_len += (size_t)bytes_read;
+            continue;
+        }
+        /* клиент закрыл соединение - ответы на полученные запросы уже отправлены */
+        if (bytes_read == 0) return -1;
+        if (errno == EINTR) continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
 
-    /* Конвертируем время в строку */
-    strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", tm_info);
+/* Закрытие соединений, простаивающих дольше timeout (начало списка - самые давние) */
+static void expire_clients(server_t* srv, client_data_t* list, int timeout) {
+    time_t now = time(NULL);
+    while (list->next != list && now - list->next->last_active >= timeout) {
+        client_close(srv, list->next);
+    }
+}
 
-    /* Формируем заголовок */
-    char header[HTTP_HEADER_SIZE];
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.1 200 OK\r\n"
-                              "Date: %s\r\n"
-                              "Server: Simple HTTP Server\r\n"
-                              "Content-Type: %s\r\n"
-                              "Content-Length: %ld\r\n"
-                              "Connection: close\r\n"
-                              "\r\n",
-                              date_buf,
-                              mime_type,
-                              file_stat.st_size);
+/* Приём всех ожидающих подключений (серверный сокет в режиме edge-triggered) */
+static void accept_clients(server_t* srv) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
 
-    /* Отправляем заголовок */
-    send(client_fd, header, header_len, 0);
+        int client_fd = accept(srv->listen_fd, (struct sockaddr*)&client_addr, &client_len);
 
-    /* Отправляем содержимое файла с помощью sendfile */
-    off_t offset = 0;
-    while (offset < file_stat.st_size) {
-        ssize_t sent = sendfile(client_fd, file_fd, &offset, file_stat.st_size - offset);
-        if (sent == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue;
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
             }
-            break;
+            return;
         }
-    }
-
-
-    close(file_fd);
-}
-
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <directory> <host:port>\n", argv[0]);
-        return 1;
-    }
 
-    const char* base_dir = argv[1];
-    const char* host_port = argv[2];
+        /* Устанавливаем неблокирующий режим для клиентского сокета */
+        if (set_nonblocking(client_fd) == -1) {
+            perror("fcntl client nonblocking");
+            close(client_fd);
+            continue;
+        }
 
-    /* Парсим хост и порт */
-    char host[256] = "0.0.0.0";
-    int port = 8080;
+        /* Ответы на keep-alive соединении короткие и идут друг за другом: без Nagle
+         * (склейку заголовка с телом обеспечивает MSG_MORE) */
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-    char host_copy[256];
-    /* Делаем копию переменной окружения */
-    strncpy(host_copy, host_port, sizeof(host_copy) - 1);
-    host_copy[sizeof(host_copy) - 1] = '\0';
+        char addr_buf[INET_ADDRSTRLEN];
+        printf("New connection from %s:%d\n",
+               inet_ntop(AF_INET, &client_addr.sin_addr, addr_buf, sizeof(addr_buf)),
+               ntohs(client_addr.sin_port));
 
-    char* colon = strchr(host_copy, ':');
-    /* Если есть разделитель, заполняем и хост и порт */
-    if (colon) {
-        *colon = '\0';
-        strncpy(host, host_copy, sizeof(host) - 1);
-        port = atoi(colon + 1);
-    } else {
-        /* Если указан только порт - заполняем только порт */
-        port = atoi(host_copy);
-    }
+        /* Выделяем память для данных клиента */
+        client_data_t* client_data = malloc(sizeof(client_data_t));
+        if (!client_data) {
+            close(client_fd);
+            continue;
+        }
 
-    /* Проверяем существование базовой директории */
-    struct stat dir_stat;
-    if (stat(base_dir, &dir_stat) == -1 || !S_ISDIR(dir_stat.st_mode)) {
-        fprintf(stderr, "Invalid directory: %s\n", base_dir);
-        return 1;
+        memset(client_data, 0, sizeof(client_data_t));
+        client_data->buffer = malloc(BUFFER_SIZE);
+        if (!client_data->buffer) {
+            free(client_data);
+            close(client_fd);
+            continue;
+        }
+        client_data->buffer_cap = BUFFER_SIZE;
+        client_data->fd = client_fd;
+        client_data->response.file_fd = -1;
+        http_parser_reset(&client_data->parser);
+        client_data->prev = client_data->next = client_data;
+        client_touch(srv, client_data);
+
+        /* Добавляем клиента в epoll: чтение и запись в режиме edge-triggered, регистрация
+         * не меняется - EPOLLOUT без ожидающего ответа просто ничего не делает */
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        event.data.ptr = client_data;
+
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            perror("epoll_ctl client");
+            client_data->prev->next = client_data->next;
+            client_data->next->prev = client_data->prev;
+            free(client_data->buffer);
+            free(client_data);
+            close(client_fd);
+        }
     }
+}
 
+/* Создание слушающего сокета; reuse_port - по сокету на воркер, ядро распределяет подключения между ними */
+static int create_listener(const char* host, int port, int reuse_port) {
     /* Создаем сокет */
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     /* Устанавливаем сокет в неблокирующий режим */
     if (set_nonblocking(server_fd) == -1) {
         perror("fcntl nonblocking");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
     /* Устанавливаем опцию SO_REUSEADDR */
@@ -463,7 +1937,14 @@ int main(int argc, char* argv[]) {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
         perror("setsockopt");
         close(server_fd);
-        return 1;
+        return -1;
+    }
+
+    /* SO_REUSEPORT: у каждого воркера своя очередь подключений */
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_fd);
+        return -1;
     }
 
     /* Настраиваем адрес */
@@ -479,7 +1960,7 @@ int main(int argc, char* argv[]) {
         } else {
             perror("inet_pton");
             close(server_fd);
-            return 1;
+            return -1;
         }
     }
 
@@ -487,44 +1968,72 @@ int main(int argc, char* argv[]) {
     if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
         perror("bind");
         close(server_fd);
-        return 1;
+        return -1;
     }
 
     /* Начинаем слушать */
     if (listen(server_fd, SOMAXCONN) == -1) {
         perror("listen");
         close(server_fd);
-        return 1;
+        return -1;
     }
+    return server_fd;
+}
 
-    printf("Server started on %s:%d\n", host, port);
-    printf("Serving directory: %s\n", base_dir);
+/* Подготовка воркера: свой epoll со своим слушающим сокетом */
+static int server_init(server_t* srv, int listen_fd, const char* base_dir, int cpu) {
+    memset(srv, 0, sizeof(*srv));
+    srv->listen_fd = listen_fd;
+    srv->base_dir = base_dir;
+    srv->cpu = cpu;
+    srv->idle.prev = srv->idle.next = &srv->idle;
+    srv->writing.prev = srv->writing.next = &srv->writing;
+    file_cache_init(&srv->files);
+
+    srv->real_base = realpath(base_dir, NULL);
+    if (!srv->real_base) {
+        perror("realpath");
+        return -1;
+    }
 
     /* Создаем epoll */
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
+    srv->epoll_fd = epoll_create1(0);
+    if (srv->epoll_fd == -1) {
         perror("epoll_create1");
-        close(server_fd);
-        return 1;
+        return -1;
     }
 
     /* Добавляем серверный сокет в epoll */
     struct epoll_event event;
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = server_fd;
+    event.data.fd = listen_fd;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1) {
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
         perror("epoll_ctl");
-        close(epoll_fd);
-        close(server_fd);
-        return 1;
+        close(srv->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Цикл событий воркера; раз в секунду закрываем простаивающие и зависшие соединения */
+static void* server_run(void* arg) {
+    server_t* srv = arg;
+
+    /* Привязка к CPU: соединения воркера и их данные остаются в кеше одного ядра */
+    if (srv->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(srv->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            perror("sched_setaffinity");
+        }
     }
 
-    /* Основной цикл событий */
     struct epoll_event events[MAX_EVENTS];
 
     while (1) {
-        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        int num_events = epoll_wait(srv->epoll_fd, events, MAX_EVENTS, 1000);
         if (num_events == -1) {
             if (errno == EINTR) continue;
             perror("epoll_wait");
@@ -532,124 +2041,181 @@ int main(int argc, char* argv[]) {
         }
 
         for (int i = 0; i < num_events; i++) {
-            /* Если data.fd == server_fd, то у нас новое подключение */
-            if (events[i].data.fd == server_fd) {
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-
-                int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-
-                if (client_fd == -1) {
-                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        perror("accept");
-                    }
-                    continue;
-                }
+            /* Если data.fd == listen_fd, то у нас новое подключение */
+            if (events[i].data.fd == srv->listen_fd) {
+                accept_clients(srv);
+                continue;
+            }
 
-                /* Устанавливаем неблокирующий режим для клиентского сокета */
-                if (set_nonblocking(client_fd) == -1) {
-                    perror("fcntl client nonblocking");
-                    close(client_fd);
-                    continue;
-                }
+            client_data_t* client_data = events[i].data.ptr;
 
-                printf("New connection from %s:%d\n",
-                       inet_ntoa(client_addr.sin_addr),
-                       ntohs(client_addr.sin_port));
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                /* Соединение закрыто или ошибка */
+                client_close(srv, client_data);
+                continue;
+            }
 
-                /* Выделяем память для данных клиента */
-                client_data_t* client_data = malloc(sizeof(client_data_t));
-                if (!client_data) {
-                    close(client_fd);
-                    continue;
-                }
+            /* Сокет готов к чтению и/или записи. EPOLLRDHUP: клиент закрыл запись, но мог
+             * успеть прислать запросы - отвечаем на них, закрытие увидит recv */
+            if (client_advance(srv, client_data) == -1) {
+                client_close(srv, client_data);
+            } else {
+                client_touch(srv, client_data);
+            }
+        }
+        expire_clients(srv, &srv->idle, KEEPALIVE_TIMEOUT);
+        expire_clients(srv, &srv->writing, SEND_TIMEOUT);
+    }
 
-                memset(client_data, 0, sizeof(client_data_t));
-                client_data->fd = client_fd;
+    /* Очистка */
+    while (srv->idle.next != &srv->idle) {
+        client_close(srv, srv->idle.next);
+    }
+    while (srv->writing.next != &srv->writing) {
+        client_close(srv, srv->writing.next);
+    }
+    file_cache_clear(&srv->files);
+    free(srv->real_base);
+    close(srv->listen_fd);
+    close(srv->epoll_fd);
+    return NULL;
+}
 
-                /* Добавляем клиента в epoll */
-                event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                event.data.ptr = client_data;
+/* Номер n-го CPU из доступных процессу (воркеры раскладываются по ним по кругу), -1 - неизвестно */
+static int pick_cpu(int n) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) return -1;
+    int count = CPU_COUNT(&set);
+    if (count == 0) return -1;
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && n-- == 0) return cpu;
+    }
+    return -1;
+}
 
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
-                    perror("epoll_ctl client");
-                    free(client_data);
-                    close(client_fd);
-                }
-            } else {
-                /* пришли данные от клиента */
-                client_data_t* client_data = events[i].data.ptr;
-
-                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-                    /* Соединение закрыто или ошибка */
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_data->fd, NULL);
-                    close(client_data->fd);
-                    free(client_data);
-                    continue;
-                }
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-s bytes] [-m MiB] <directory> <host:port>\n"
+                    "  -w N  N worker threads, each with its own epoll and SO_REUSEPORT socket,\n"
+                    "        pinned to a CPU (0 - one per available CPU)\n"
+                    "  -s N  keep files up to N bytes in memory (default %d, 0 - off)\n"
+                    "  -m N  memory limit for cached file contents, MiB (default %d)\n"
+                    "  -c prefix=value  Cache-Control value for paths starting with prefix\n"
+                    "        (repeatable, longest prefix wins), e.g. -c /static/=max-age=86400\n",
+            prog, SMALL_FILE_MAX, CONTENT_CACHE_MAX / (1024 * 1024));
+}
 
-                if (events[i].events & EPOLLIN) {
-                    /* Читаем данные */
-                    ssize_t bytes_read;
-                    while ((bytes_read = recv(client_data->fd, client_data->buffer + client_data->buffer_len, sizeof(client_data->buffer) - client_data->buffer_len - 1, 0)) > 0) {
-                        client_data->buffer_len += bytes_read;
-
-                        /* Проверяем конец HTTP-запроса (двойной CRLF) */
-                        if (client_data->buffer_len >= 4) {
-                            char* end = strstr(client_data->buffer, "\r\n\r\n");
-                            if (end) {
-                                /* Нуль-терминируем для безопасности */
-                                size_t request_len = end - client_data->buffer + 4;
-                                if (request_len < sizeof(client_data->buffer)) {
-                                    client_data->buffer[request_len] = '\0';
-                                }
-
-                                /* Обрабатываем запрос */
-                                handle_http_request(client_data->fd, client_data->buffer, base_dir);
-
-                                /* Помечаем, что ответ отправлен */
-                                client_data->response_sent = 1;
-
-                                /* Закрываем соединение после отправки ответа */
-                                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_data->fd, NULL);
-
-                                shutdown(client_data->fd, SHUT_WR);
-                                close(client_data->fd);
-                                free(client_data);
-                                break;
-                            }
-                        }
-
-                        /* Если буфер заполнен, но конец запроса не найден */
-                        if (client_data->buffer_len >= sizeof(client_data->buffer) - 1) {
-                            /* Отправляем ошибку */
-                            const char* bad_request = "400 Bad Request";
-                            send_http_response(client_data->fd, 400, bad_request,
-                                               "text/html", bad_request, strlen(bad_request));
-
-                            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_data->fd, NULL);
-                            close(client_data->fd);
-                            free(client_data);
-                            break;
-                        }
-                    }
-
-                    /* Если соединение закрыто или ошибка */
-                    if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-                        if (!client_data->response_sent) {
-                            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_data->fd, NULL);
-                            close(client_data->fd);
-                            free(client_data);
-                        }
-                    }
-                }
+int main(int argc, char* argv[]) {
+    int workers = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:m:c:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            small_file_max = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            content_cache_max = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'c': {
+            char* eq = strchr(optarg, '=');
+            if (!eq || optarg[0] != '/' || strlen(eq + 1) > CACHE_RULE_VALUE_MAX ||
+                cache_rules_count >= CACHE_RULES_MAX) {
+                usage(argv[0]);
+                return 1;
             }
+            *eq = '\0';
+            cache_rules[cache_rules_count].prefix = optarg;
+            cache_rules[cache_rules_count].value = eq + 1;
+            cache_rules_count++;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
         }
     }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    /* Очистка */
-    close(server_fd);
-    close(epoll_fd);
+    const char* base_dir = argv[optind];
+    const char* host_port = argv[optind + 1];
+
+    /* Парсим хост и порт */
+    char host[256] = "0.0.0.0";
+    int port = 8080;
+
+    char host_copy[256];
+    /* Делаем копию переменной окружения */
+    strncpy(host_copy, host_port, sizeof(host_copy) - 1);
+    host_copy[sizeof(host_copy) - 1] = '\0';
+
+    char* colon = strchr(host_copy, ':');
+    /* Если есть разделитель, заполняем и хост и порт */
+    if (colon) {
+        *colon = '\0';
+        strncpy(host, host_copy, sizeof(host) - 1);
+        port = atoi(colon + 1);
+    } else {
+        /* Если указан только порт - заполняем только порт */
+        port = atoi(host_copy);
+    }
+
+    /* Проверяем существование базовой директории */
+    struct stat dir_stat;
+    if (stat(base_dir, &dir_stat) == -1 || !S_ISDIR(dir_stat.st_mode)) {
+        fprintf(stderr, "Invalid directory: %s\n", base_dir);
+        return 1;
+    }
+
+    if (workers <= 0) {
+        cpu_set_t set;
+        workers = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    }
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    /* sendfile в закрытый клиентом сокет не должен завершать процесс */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Воркеры: у каждого свой слушающий сокет, epoll и соединения */
+    static server_t servers[MAX_WORKERS];
+    for (int i = 0; i < workers; i++) {
+        int listen_fd = create_listener(host, port, workers > 1);
+        if (listen_fd == -1) return 1;
+        if (server_init(&servers[i], listen_fd, base_dir, workers > 1 ? pick_cpu(i) : -1) == -1) {
+            close(listen_fd);
+            return 1;
+        }
+    }
+
+    printf("Server started on %s:%d\n", host, port);
+    printf("Serving directory: %s\n", base_dir);
+    if (workers > 1) printf("Workers: %d\n", workers);
+    fflush(stdout);
+
+    /* Один воркер работает в основном потоке */
+    if (workers == 1) {
+        server_run(&servers[0]);
+        return 0;
+    }
+    for (int i = 0; i < workers; i++) {
+        int err = pthread_create(&servers[i].thread, NULL, server_run, &servers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(servers[i].thread, NULL);
+    }
 
     return 0;
 }